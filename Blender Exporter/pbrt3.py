@@ -27,6 +27,10 @@ import bpy
 from math import pi as pi
 from mathutils import Matrix, Vector
 import datetime # for export timestamp
+import os
+import struct
+import sys
+from array import array
 
 
 
@@ -161,7 +165,23 @@ def GenerateLightString(light) -> str:
 
 
 
-def GenerateMeshString(obj, scene) -> str:
+# writes a mesh file for pbrt's "binarymesh" shape (see src/shapes/binarymesh.h):
+# a 32 byte header, then the arrays, each starting at a multiple of 16 bytes
+def WriteBinaryMesh(filename, indices, positions, normals):
+	flags = 1 # has normals
+	with open(filename, 'wb') as f:
+		f.write(struct.pack('<4sIIii12x', b'PBMS', 1, flags, len(indices)//3, len(positions)//3))
+		for data, typecode in ((indices, 'i'), (positions, 'f'), (normals, 'f')):
+			a = array(typecode, data)
+			if sys.byteorder != 'little':
+				a.byteswap()
+			a.tofile(f)
+			f.write(bytes(-f.tell() % 16))
+
+
+# binaryMeshPrefix: if given, the mesh data is written to <prefix>_<object>.pbm
+# instead of being embedded in the scene file
+def GenerateMeshString(obj, scene, binaryMeshPrefix=None) -> str:
 	# Meshes
 	def TriangulateMesh(me):
 		import bmesh
@@ -250,22 +270,28 @@ def GenerateMeshString(obj, scene) -> str:
 	
 	
 	# mesh data
-	s += '	Shape "trianglemesh"  # triangles: {}, positions: {}, normals: {}\n'.format(len(indices)//3, len(positions)//3, len(normals)//3)
-	
-	s += '		"integer indices" [' # indices
-	for i in indices:
-		s += str(i) + " "
-	s += ']\n'
-	
-	s += '		"point P" [' # positions
-	for p in positions:
-		s += str(p) + " "
-	s += ']\n'
-	
-	s += '		"normal N" [' # normals
-	for n in normals:
-		s += str(n) + " "
-	s += ']\n'
+	if binaryMeshPrefix is not None:
+		meshFilename = binaryMeshPrefix + '_' + bpy.path.clean_name(obj.name) + '.pbm'
+		WriteBinaryMesh(meshFilename, indices, positions, normals)
+		s += '	Shape "binarymesh"  # triangles: {}, positions: {}, normals: {}\n'.format(len(indices)//3, len(positions)//3, len(normals)//3)
+		s += '		"string filename" "{}"\n'.format(os.path.basename(meshFilename))
+	else:
+		s += '	Shape "trianglemesh"  # triangles: {}, positions: {}, normals: {}\n'.format(len(indices)//3, len(positions)//3, len(normals)//3)
+		
+		s += '		"integer indices" [' # indices
+		for i in indices:
+			s += str(i) + " "
+		s += ']\n'
+		
+		s += '		"point P" [' # positions
+		for p in positions:
+			s += str(p) + " "
+		s += ']\n'
+		
+		s += '		"normal N" [' # normals
+		for n in normals:
+			s += str(n) + " "
+		s += ']\n'
 	
 	if int(obj.pbrt3_semantic) != 0: # ObjectSemantic
 		s += '		"integer ObjectSemantic" ' + obj.pbrt3_semantic + '\n'
@@ -292,7 +318,7 @@ def ShouldExportObject(obj, context) -> bool:
 		return False
 
 
-def GenerateSceneString(context, filename) -> str:	
+def GenerateSceneString(context, filename, binaryMeshPrefix=None) -> str:	
 	scene = context.scene
 	scene.update()
 	
@@ -312,7 +338,7 @@ def GenerateSceneString(context, filename) -> str:
 	# local meshes Meshs
 	meshes = [m for m in context.scene.objects if m.type=='MESH' and ShouldExportObject(m, context)]
 	for mesh in meshes:
-		s += GenerateMeshString(mesh, scene)
+		s += GenerateMeshString(mesh, scene, binaryMeshPrefix)
 
 	# meshes that were linked as a group...
 	groups = [g for g in context.scene.objects if g.type=='EMPTY' and ShouldExportObject(g, context) and g.dupli_group is not None]
@@ -333,7 +359,7 @@ def GenerateSceneString(context, filename) -> str:
 		for mesh in meshes:
 			if g.pbrt3_semantic != mesh.pbrt3_semantic:
 				raise Exception("semantics differ! Group: "+g.name)
-			s += GenerateMeshString(mesh, scene)
+			s += GenerateMeshString(mesh, scene, binaryMeshPrefix)
 
 		s += "AttributeEnd\n\n"
 		
@@ -375,15 +401,17 @@ class ExportPbrt3(bpy.types.Operator, ExportHelper):
 					sc.frame_set(i)
 					s = "-{num:04d}".format(num=i)
 					extPos = self.filepath.rfind(".")
+					meshPrefix = self.filepath[:extPos]+s if self.ExportBinaryMeshes else None
 					f = open(self.filepath[:extPos]+s+self.filepath[extPos:], 'w', encoding='utf-8')
-					f.write(GenerateSceneString(context, renderFilename+s+extension))
+					f.write(GenerateSceneString(context, renderFilename+s+extension, meshPrefix))
 					f.close()
 					
 				sc.frame_set(frame_orig)
 				
 			else:
+				meshPrefix = self.filepath[:self.filepath.rfind(".")] if self.ExportBinaryMeshes else None
 				f = open(self.filepath, 'w', encoding='utf-8')
-				f.write(GenerateSceneString(context, renderFilename+extension))
+				f.write(GenerateSceneString(context, renderFilename+extension, meshPrefix))
 				f.close()
 		
 			print("done")
@@ -399,6 +427,8 @@ class ExportPbrt3(bpy.types.Operator, ExportHelper):
 		row.prop(self, "FollowExportName")
 		row = layout.row()
 		row.prop(self, "ExportSceneAnimation")
+		row = layout.row()
+		row.prop(self, "ExportBinaryMeshes")
 
 	FollowExportName = BoolProperty(
 		name='Follow exported Filename',
@@ -410,6 +440,11 @@ class ExportPbrt3(bpy.types.Operator, ExportHelper):
 		description='Writes a .pbrt file for every frame in the scene',
 		default=False)
 		
+	ExportBinaryMeshes = BoolProperty(
+		name='Export binary meshes',
+		description='Writes the meshes to .pbm files next to the .pbrt file, which pbrt loads without parsing',
+		default=False)
+		
 
 # action that is associated with the export menu entry
 def MenuExport(self, context):
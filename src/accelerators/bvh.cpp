@@ -37,7 +37,17 @@
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include "fileutil.h"
 #include <algorithm>
+#include <array>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#ifdef PBRT_IS_WINDOWS
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace pbrt {
 
@@ -45,8 +55,56 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_COUNTER("BVH/Trees read from cache", cachedTrees);
+STAT_PERCENT("BVH/Shadow rays blocked by the last occluder", cachedOcclusions,
+             shadowRays);
 
 // BVHAccel Local Declarations
+
+// The primitive that blocked the last shadow ray traced through a BVH by
+// this thread. Shadow rays of neighbouring samples are mostly blocked by
+// the same few walls, so testing it first often avoids the traversal. The
+// cache is direct-mapped by tree, since the BVHs of object instances are
+// queried in between.
+struct BVHOccluderCache {
+    const BVHAccel *bvh;
+    size_t primitive;
+};
+static PBRT_CONSTEXPR int occluderCacheSize = 8;
+static PBRT_THREAD_LOCAL BVHOccluderCache occluderCache[occluderCacheSize];
+
+static inline int OccluderCacheSlot(const BVHAccel *bvh) {
+    return (reinterpret_cast<uintptr_t>(bvh) / sizeof(BVHAccel)) %
+           occluderCacheSize;
+}
+
+// Like Bounds3f::IntersectP(), but also returns the parametric range of
+// the ray inside the bounds, clipped to [0, tMax].
+static inline bool IntersectBounds(const Bounds3f &bounds, const Ray &ray,
+                                   const Vector3f &invDir,
+                                   const int dirIsNeg[3], Float *hitt0,
+                                   Float *hitt1) {
+    Float tMin = (bounds[dirIsNeg[0]].x - ray.o.x) * invDir.x;
+    Float tMax = (bounds[1 - dirIsNeg[0]].x - ray.o.x) * invDir.x;
+    Float tyMin = (bounds[dirIsNeg[1]].y - ray.o.y) * invDir.y;
+    Float tyMax = (bounds[1 - dirIsNeg[1]].y - ray.o.y) * invDir.y;
+    tMax *= 1 + 2 * gamma(3);
+    tyMax *= 1 + 2 * gamma(3);
+    if (tMin > tyMax || tyMin > tMax) return false;
+    if (tyMin > tMin) tMin = tyMin;
+    if (tyMax < tMax) tMax = tyMax;
+    Float tzMin = (bounds[dirIsNeg[2]].z - ray.o.z) * invDir.z;
+    Float tzMax = (bounds[1 - dirIsNeg[2]].z - ray.o.z) * invDir.z;
+    tzMax *= 1 + 2 * gamma(3);
+    if (tMin > tzMax || tzMin > tMax) return false;
+    if (tzMin > tMin) tMin = tzMin;
+    if (tzMax < tMax) tMax = tzMax;
+    if (!(tMin < ray.tMax && tMax > 0)) return false;
+    *hitt0 = std::max(tMin, (Float)0);
+    *hitt1 = std::min(tMax, ray.tMax);
+    return true;
+}
+
 struct BVHPrimitiveInfo {
     BVHPrimitiveInfo() {}
     BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3f &bounds)
@@ -92,16 +150,36 @@ struct LBVHTreelet {
     BVHBuildNode *buildNodes;
 };
 
-struct LinearBVHNode {
-    Bounds3f bounds;
-    union {
-        int primitivesOffset;   // leaf
-        int secondChildOffset;  // interior
+// Subtrees that the serial upper part of the SAH build leaves for the
+// thread pool. _node_ already has its bounds, the rest is filled in once
+// the subtree for [start, end) has been built.
+struct BVHDeferredSubtrees {
+    struct Subtree {
+        BVHBuildNode *node;
+        int start, end;
     };
-    uint16_t nPrimitives;  // 0 -> interior node
-    uint8_t axis;          // interior node: xyz
-    uint8_t pad[1];        // ensure 32 byte total size
+    int maxPrimitives;
+    std::vector<Subtree> subtrees;
+};
+
+// Layout of a BVH cache file: the header, the flattened nodes, and for
+// each position in the ordered primitives, the index of the primitive in
+// the list that was passed to the constructor
+struct BVHCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    int32_t nPrimitives, nNodes;
+    uint32_t nodeSize;  // differs if _Float_ is double
+    uint8_t pad[36];    // keep the nodes 64 byte aligned
 };
+static_assert(sizeof(BVHCacheHeader) == 64, "Unexpected BVHCacheHeader size");
+static const char bvhCacheMagic[4] = {'P', 'B', 'V', 'H'};
+static PBRT_CONSTEXPR uint32_t bvhCacheVersion = 1;
+
+// Smallest subtree that is built as a separate task; also the chunk size
+// for the parallel reductions over the primitives of the upper nodes
+static PBRT_CONSTEXPR int minParallelBuildPrimitives = 16384;
 
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
@@ -136,6 +214,26 @@ inline uint32_t EncodeMorton3(const Vector3f &v) {
     return (LeftShift3(v.z) << 2) | (LeftShift3(v.y) << 1) | LeftShift3(v.x);
 }
 
+// The tree only depends on the primitives' bounds and the build
+// parameters, so that's all the cache key has to cover.
+static uint64_t HashPrimitiveBounds(
+    const std::vector<BVHPrimitiveInfo> &primitiveInfo, int maxPrimsInNode,
+    BVHAccel::SplitMethod splitMethod) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull;
+    auto mix = [&hash](uint64_t v) {
+        hash ^= v + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+    };
+    mix(primitiveInfo.size());
+    mix(maxPrimsInNode);
+    mix((int)splitMethod);
+    for (const BVHPrimitiveInfo &pi : primitiveInfo)
+        for (int i = 0; i < 2; ++i)
+            for (int a = 0; a < 3; ++a) mix(FloatToBits(pi.bounds[i][a]));
+    return hash;
+}
+
 static void RadixSort(std::vector<MortonPrimitive> *v) {
     std::vector<MortonPrimitive> tempVector(v->size());
     PBRT_CONSTEXPR int bitsPerPass = 6;
@@ -181,7 +279,8 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
 
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod,
+                   const std::string &cacheDirectory)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
       primitives(std::move(p)) {
@@ -194,19 +293,56 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
     for (size_t i = 0; i < primitives.size(); ++i)
         primitiveInfo[i] = {i, primitives[i]->WorldBound()};
 
+    // Use the tree of an earlier run with the same primitive bounds, if
+    // there's one in _cacheDirectory_
+    uint64_t cacheKey = 0;
+    std::string cacheFilename;
+    if (!cacheDirectory.empty()) {
+        cacheKey = HashPrimitiveBounds(primitiveInfo, this->maxPrimsInNode,
+                                       splitMethod);
+        cacheFilename = StringPrintf("%s/bvh-%016llx.cache",
+                                     cacheDirectory.c_str(),
+                                     (unsigned long long)cacheKey);
+        if (readCache(cacheFilename, cacheKey)) return;
+    }
+
     // Build BVH tree for primitives using _primitiveInfo_
     MemoryArena arena(1024 * 1024);
+    std::vector<MemoryArena> threadArenas(MaxThreadIndex());
     int totalNodes = 0;
-    std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(primitives.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
         root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
-    else
+    else {
+        // Build the upper levels of the tree in this thread, deferring
+        // subtrees below a size that gives each thread several of them
+        bool parallelBuild =
+            MaxThreadIndex() > 1 &&
+            primitives.size() >= 4 * minParallelBuildPrimitives;
+        BVHDeferredSubtrees deferred;
+        deferred.maxPrimitives =
+            std::max<int>(minParallelBuildPrimitives,
+                          primitives.size() / (16 * MaxThreadIndex()));
         root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
+                              &totalNodes, orderedPrims,
+                              parallelBuild ? &deferred : nullptr);
+
+        // Build the deferred subtrees in parallel. The splits don't depend
+        // on the order in which this happens, so the resulting tree is the
+        // same as the one of the serial build.
+        std::vector<int> subtreeNodes(deferred.subtrees.size(), 0);
+        ParallelFor([&](int64_t i) {
+            const BVHDeferredSubtrees::Subtree &subtree = deferred.subtrees[i];
+            *subtree.node = *recursiveBuild(
+                threadArenas[ThreadIndex], primitiveInfo, subtree.start,
+                subtree.end, &subtreeNodes[i], orderedPrims);
+        }, deferred.subtrees.size());
+        for (int n : subtreeNodes) totalNodes += n;
+    }
     primitives.swap(orderedPrims);
     primitiveInfo.resize(0);
+    // _orderedPrims_ now holds the primitives in their original order
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
                               "primitives (%.2f MB), arena allocated %.2f MB",
                               totalNodes, (int)primitives.size(),
@@ -222,6 +358,156 @@ BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
     int offset = 0;
     flattenBVHTree(root, &offset);
     CHECK_EQ(totalNodes, offset);
+    if (!cacheFilename.empty())
+        writeCache(cacheFilename, cacheKey, orderedPrims, totalNodes);
+}
+
+// Checks that the nodes read from a cache file form a tree that the
+// traversal can walk without leaving the node and primitive arrays: every
+// node is the child of exactly one earlier node, children come after their
+// parents, leaves refer to existing primitives, and no path is deeper than
+// the traversal stacks (64 entries)
+static bool ValidBVHCacheNodes(const LinearBVHNode *nodes, int nNodes,
+                               size_t nPrimitives) {
+    std::vector<int> depth(nNodes, -1);
+    depth[0] = 0;
+    for (int i = 0; i < nNodes; ++i) {
+        const LinearBVHNode &node = nodes[i];
+        if (depth[i] < 0 || depth[i] >= 64) return false;
+        if (node.nPrimitives > 0) {
+            if (node.primitivesOffset < 0 ||
+                (size_t)node.primitivesOffset + node.nPrimitives > nPrimitives)
+                return false;
+            continue;
+        }
+        if (node.axis > 2 || node.secondChildOffset <= i + 1 ||
+            node.secondChildOffset >= nNodes)
+            return false;
+        for (int child : {i + 1, node.secondChildOffset}) {
+            if (depth[child] >= 0) return false;
+            depth[child] = depth[i] + 1;
+        }
+    }
+    return true;
+}
+
+bool BVHAccel::readCache(const std::string &filename, uint64_t key) {
+    std::unique_ptr<MappedFile> file = MappedFile::Open(filename);
+    if (!file) return false;
+
+    // Make sure that the file holds a tree for these primitives
+    const BVHCacheHeader *header = (const BVHCacheHeader *)file->Data();
+    if (file->Size() < sizeof(BVHCacheHeader) ||
+        memcmp(header->magic, bvhCacheMagic, 4) != 0 ||
+        header->version != bvhCacheVersion ||
+        header->nodeSize != sizeof(LinearBVHNode)) {
+        Warning("%s: not a BVH cache file of this version. Rebuilding.",
+                filename.c_str());
+        return false;
+    }
+    size_t expectedSize = sizeof(BVHCacheHeader) +
+                          (size_t)header->nNodes * sizeof(LinearBVHNode) +
+                          (size_t)header->nPrimitives * sizeof(int32_t);
+    if (header->key != key ||
+        (size_t)header->nPrimitives != primitives.size() ||
+        header->nNodes <= 0 || file->Size() != expectedSize) {
+        Warning("%s: BVH cache file doesn't match the scene. Rebuilding.",
+                filename.c_str());
+        return false;
+    }
+    // The primitive order has to be a permutation, and the nodes have to
+    // form a tree over the primitives, or the traversal could go astray
+    const LinearBVHNode *cachedNodes =
+        (const LinearBVHNode *)(file->Data() + sizeof(BVHCacheHeader));
+    const int32_t *primitiveOrder =
+        (const int32_t *)(file->Data() + sizeof(BVHCacheHeader) +
+                          header->nNodes * sizeof(LinearBVHNode));
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(primitives.size());
+    std::vector<bool> used(primitives.size(), false);
+    bool valid =
+        ValidBVHCacheNodes(cachedNodes, header->nNodes, primitives.size());
+    for (size_t i = 0; valid && i < primitives.size(); ++i) {
+        int32_t index = primitiveOrder[i];
+        if (index < 0 || (size_t)index >= primitives.size() || used[index]) {
+            valid = false;
+            break;
+        }
+        used[index] = true;
+        orderedPrims[i] = primitives[index];
+    }
+    if (!valid) {
+        Warning("%s: corrupt BVH cache file. Rebuilding.", filename.c_str());
+        return false;
+    }
+
+    // Use the nodes in place
+    primitives.swap(orderedPrims);
+    nodes = (LinearBVHNode *)cachedNodes;
+    cacheFile = std::move(file);
+    ++cachedTrees;
+    treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]);
+    LOG(INFO) << StringPrintf("BVH with %d nodes for %d primitives read "
+                              "from \"%s\"", header->nNodes,
+                              (int)primitives.size(), filename.c_str());
+    return true;
+}
+
+void BVHAccel::writeCache(
+    const std::string &filename, uint64_t key,
+    const std::vector<std::shared_ptr<Primitive>> &unordered,
+    int totalNodes) const {
+    // Find the original index of each of the ordered primitives
+    std::vector<std::pair<const Primitive *, int32_t>> originalIndex(
+        unordered.size());
+    for (size_t i = 0; i < unordered.size(); ++i)
+        originalIndex[i] = std::make_pair(unordered[i].get(), (int32_t)i);
+    std::sort(originalIndex.begin(), originalIndex.end());
+    std::vector<int32_t> primitiveOrder(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        primitiveOrder[i] =
+            std::lower_bound(
+                originalIndex.begin(), originalIndex.end(),
+                std::make_pair((const Primitive *)primitives[i].get(), 0))
+                ->second;
+
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bvhCacheMagic, 4);
+    header.version = bvhCacheVersion;
+    header.key = key;
+    header.nPrimitives = primitives.size();
+    header.nNodes = totalNodes;
+    header.nodeSize = sizeof(LinearBVHNode);
+
+    // Write to a temporary file first, so that concurrent renders never
+    // see a partially written cache; its name is unique to this process
+    // and thread, as others may be writing the same cache at the same time
+#ifdef PBRT_IS_WINDOWS
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    std::string tempFilename = StringPrintf(
+        "%s.%d.%zu.tmp", filename.c_str(), pid,
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    FILE *f = fopen(tempFilename.c_str(), "wb");
+    if (!f) {
+        Warning("%s: unable to write BVH cache file: %s",
+                tempFilename.c_str(), strerror(errno));
+        return;
+    }
+    bool ok =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(nodes, sizeof(LinearBVHNode), totalNodes, f) ==
+            (size_t)totalNodes &&
+        fwrite(primitiveOrder.data(), sizeof(int32_t), primitiveOrder.size(),
+               f) == primitiveOrder.size();
+    ok = (fclose(f) == 0) && ok;
+    std::remove(filename.c_str());
+    if (!ok || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        Warning("%s: unable to write BVH cache file", filename.c_str());
+        std::remove(tempFilename.c_str());
+    }
 }
 
 Bounds3f BVHAccel::WorldBound() const {
@@ -233,44 +519,89 @@ struct BucketInfo {
     Bounds3f bounds;
 };
 
+// Accumulates _chunkFunc_ over [start, end) into a _T_ initialized to
+// _init_. If _parallel_ is set, chunks of the range are processed over the
+// thread pool and their results are combined with _merge_ afterwards.
+template <typename T, typename ChunkFunc, typename MergeFunc>
+static T ReduceRange(int start, int end, bool parallel, const T &init,
+                     ChunkFunc chunkFunc, MergeFunc merge) {
+    const int chunkSize = minParallelBuildPrimitives;
+    int nChunks = parallel ? (end - start + chunkSize - 1) / chunkSize : 1;
+    T result = init;
+    if (nChunks <= 1) {
+        chunkFunc(start, end, result);
+        return result;
+    }
+    std::vector<T> chunkResults(nChunks, init);
+    ParallelFor([&](int64_t c) {
+        int chunkStart = start + c * chunkSize;
+        chunkFunc(chunkStart, std::min(chunkStart + chunkSize, end),
+                  chunkResults[c]);
+    }, nChunks);
+    for (const T &r : chunkResults) merge(result, r);
+    return result;
+}
+
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
     int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
+    BVHDeferredSubtrees *deferred) {
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
-    (*totalNodes)++;
-    // Compute bounds of all primitives in BVH node
-    Bounds3f bounds;
-    for (int i = start; i < end; ++i)
-        bounds = Union(bounds, primitiveInfo[i].bounds);
     int nPrimitives = end - start;
+    // Upper nodes of a parallel build reduce over their primitives in
+    // parallel; all of these reductions are exact, so they don't change the
+    // splits
+    bool parallel = deferred && nPrimitives > deferred->maxPrimitives;
+    auto unionBounds = [](Bounds3f &b, const Bounds3f &b2) {
+        b = Union(b, b2);
+    };
+
+    // Compute bounds of all primitives in BVH node
+    Bounds3f bounds = ReduceRange(
+        start, end, parallel, Bounds3f(),
+        [&](int s, int e, Bounds3f &b) {
+            for (int i = s; i < e; ++i) b = Union(b, primitiveInfo[i].bounds);
+        },
+        unionBounds);
+    if (deferred && !parallel) {
+        // Leave the subtree for the parallel part of the build
+        node->bounds = bounds;
+        deferred->subtrees.push_back({node, start, end});
+        return node;
+    }
+    (*totalNodes)++;
     if (nPrimitives == 1) {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
+        // Leaves are created in depth-first order, so this one's
+        // primitives go to [start, end) of _orderedPrims_
         for (int i = start; i < end; ++i) {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims[i] = primitives[primNum];
         }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+        node->InitLeaf(start, nPrimitives, bounds);
         return node;
     } else {
         // Compute bound of primitive centroids, choose split dimension _dim_
-        Bounds3f centroidBounds;
-        for (int i = start; i < end; ++i)
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+        Bounds3f centroidBounds = ReduceRange(
+            start, end, parallel, Bounds3f(),
+            [&](int s, int e, Bounds3f &b) {
+                for (int i = s; i < e; ++i)
+                    b = Union(b, primitiveInfo[i].centroid);
+            },
+            unionBounds);
         int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
             for (int i = start; i < end; ++i) {
                 int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                orderedPrims[i] = primitives[primNum];
             }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+            node->InitLeaf(start, nPrimitives, bounds);
             return node;
         } else {
             // Partition primitives based on _splitMethod_
@@ -318,20 +649,32 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                 } else {
                     // Allocate _BucketInfo_ for SAH partition buckets
                     PBRT_CONSTEXPR int nBuckets = 12;
-                    BucketInfo buckets[nBuckets];
+                    typedef std::array<BucketInfo, nBuckets> Buckets;
 
                     // Initialize _BucketInfo_ for SAH partition buckets
-                    for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
-                        buckets[b].count++;
-                        buckets[b].bounds =
-                            Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                    }
+                    Buckets buckets = ReduceRange(
+                        start, end, parallel, Buckets(),
+                        [&](int s, int e, Buckets &buckets) {
+                            for (int i = s; i < e; ++i) {
+                                int b = nBuckets *
+                                        centroidBounds.Offset(
+                                            primitiveInfo[i].centroid)[dim];
+                                if (b == nBuckets) b = nBuckets - 1;
+                                CHECK_GE(b, 0);
+                                CHECK_LT(b, nBuckets);
+                                buckets[b].count++;
+                                buckets[b].bounds = Union(
+                                    buckets[b].bounds, primitiveInfo[i].bounds);
+                            }
+                        },
+                        [](Buckets &buckets, const Buckets &chunkBuckets) {
+                            for (int b = 0; b < nBuckets; ++b) {
+                                buckets[b].count += chunkBuckets[b].count;
+                                buckets[b].bounds =
+                                    Union(buckets[b].bounds,
+                                          chunkBuckets[b].bounds);
+                            }
+                        });
 
                     // Compute costs for splitting after each bucket
                     Float cost[nBuckets - 1];
@@ -379,23 +722,23 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
                         for (int i = start; i < end; ++i) {
                             int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            orderedPrims[i] = primitives[primNum];
                         }
-                        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+                        node->InitLeaf(start, nPrimitives, bounds);
                         return node;
                     }
                 }
                 break;
             }
             }
-            node->InitInterior(dim,
-                               recursiveBuild(arena, primitiveInfo, start, mid,
-                                              totalNodes, orderedPrims),
-                               recursiveBuild(arena, primitiveInfo, mid, end,
-                                              totalNodes, orderedPrims));
+            node->InitInterior(
+                dim,
+                recursiveBuild(arena, primitiveInfo, start, mid, totalNodes,
+                               orderedPrims, deferred),
+                recursiveBuild(arena, primitiveInfo, mid, end, totalNodes,
+                               orderedPrims, deferred));
         }
     }
     return node;
@@ -657,7 +1000,9 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+BVHAccel::~BVHAccel() {
+    if (!cacheFile) FreeAligned(nodes);
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     if (!nodes) return false;
@@ -702,61 +1047,184 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
 bool BVHAccel::IntersectP(const Ray &ray) const {
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
+    ++shadowRays;
+    // Test the primitive that blocked this thread's last shadow ray first
+    BVHOccluderCache &cache = occluderCache[OccluderCacheSlot(this)];
+    if (cache.bvh == this && cache.primitive < primitives.size() &&
+        primitives[cache.primitive]->IntersectP(ray)) {
+        ++cachedOcclusions;
+        return true;
+    }
+
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+    Float t0, t1;
+    if (!IntersectBounds(nodes[0].bounds, ray, invDir, dirIsNeg, &t0, &t1))
+        return false;
     int nodesToVisit[64];
     int toVisitOffset = 0, currentNodeIndex = 0;
     while (true) {
         const LinearBVHNode *node = &nodes[currentNodeIndex];
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
-            // Process BVH node _node_ for traversal
-            if (node->nPrimitives > 0) {
-                for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
-                        return true;
-                    }
-                }
-                if (toVisitOffset == 0) break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
-            } else {
-                if (dirIsNeg[node->axis]) {
-                    /// second child first
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node->secondChildOffset;
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                    currentNodeIndex = currentNodeIndex + 1;
+        if (node->nPrimitives > 0) {
+            for (int i = 0; i < node->nPrimitives; ++i) {
+                if (primitives[node->primitivesOffset + i]->IntersectP(ray)) {
+                    cache.bvh = this;
+                    cache.primitive = node->primitivesOffset + i;
+                    return true;
                 }
             }
-        } else {
             if (toVisitOffset == 0) break;
             currentNodeIndex = nodesToVisit[--toVisitOffset];
+        } else {
+            // Only children whose bounds are hit are visited. Any hit ends
+            // the traversal, so the child in which the ray covers the
+            // longer stretch goes first: it is more likely to block it.
+            int first = currentNodeIndex + 1, second = node->secondChildOffset;
+            Float first0, first1, second0, second1;
+            bool hitFirst = IntersectBounds(nodes[first].bounds, ray, invDir,
+                                            dirIsNeg, &first0, &first1);
+            bool hitSecond = IntersectBounds(nodes[second].bounds, ray, invDir,
+                                             dirIsNeg, &second0, &second1);
+            if (hitFirst && hitSecond) {
+                if (second1 - second0 > first1 - first0)
+                    std::swap(first, second);
+                nodesToVisit[toVisitOffset++] = second;
+                currentNodeIndex = first;
+            } else if (hitFirst)
+                currentNodeIndex = first;
+            else if (hitSecond)
+                currentNodeIndex = second;
+            else {
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
         }
     }
     return false;
 }
 
-std::shared_ptr<BVHAccel> CreateBVHAccelerator(
-    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
+// Traverses the BVH with up to _bvhRayPacketSize_ rays at once. Each node
+// is fetched once for all rays that reach it; the rays that hit its bounds
+// form the list that is passed on to its children. _leafFunc(node, i)_ is
+// called for the rays that reach a leaf and returns true once ray _i_
+// needs no further traversal.
+static PBRT_CONSTEXPR int bvhRayPacketSize = 64;
+
+template <typename LeafFunc>
+static void TraverseRayPacket(const LinearBVHNode *nodes, const Ray *rays,
+                              int nRays, LeafFunc leafFunc) {
+    CHECK_LE(nRays, bvhRayPacketSize);
+    Vector3f invDir[bvhRayPacketSize];
+    int dirIsNeg[bvhRayPacketSize][3];
+    bool done[bvhRayPacketSize];
+    // Ray lists of all nodes on the stack, one above the other
+    int rayLists[65 * bvhRayPacketSize];
+    for (int i = 0; i < nRays; ++i) {
+        const Ray &ray = rays[i];
+        invDir[i] = Vector3f(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        dirIsNeg[i][0] = invDir[i].x < 0;
+        dirIsNeg[i][1] = invDir[i].y < 0;
+        dirIsNeg[i][2] = invDir[i].z < 0;
+        done[i] = false;
+        rayLists[i] = i;
+    }
+
+    struct StackEntry {
+        int nodeIndex, listStart, listCount;
+    };
+    StackEntry nodesToVisit[64];
+    int toVisitOffset = 0;
+    StackEntry current = {0, 0, nRays};
+    while (true) {
+        const LinearBVHNode *node = &nodes[current.nodeIndex];
+        // Gather the rays that hit _node_ into a new list above the current
+        // one
+        int hitStart = current.listStart + current.listCount, nHit = 0;
+        for (int j = 0; j < current.listCount; ++j) {
+            int i = rayLists[current.listStart + j];
+            if (!done[i] && node->bounds.IntersectP(rays[i], invDir[i],
+                                                    dirIsNeg[i]))
+                rayLists[hitStart + nHit++] = i;
+        }
+
+        if (nHit > 0 && node->nPrimitives > 0) {
+            for (int j = 0; j < nHit; ++j) {
+                int i = rayLists[hitStart + j];
+                if (leafFunc(*node, i)) done[i] = true;
+            }
+        } else if (nHit > 0) {
+            // Visit the child that's nearer for the first ray first; both
+            // get the list of rays that hit _node_
+            int first = current.nodeIndex + 1, second = node->secondChildOffset;
+            if (dirIsNeg[rayLists[hitStart]][node->axis])
+                std::swap(first, second);
+            CHECK_LT(toVisitOffset, 64);
+            nodesToVisit[toVisitOffset++] = {second, hitStart, nHit};
+            current = {first, hitStart, nHit};
+            continue;
+        }
+        if (toVisitOffset == 0) break;
+        current = nodesToVisit[--toVisitOffset];
+    }
+}
+
+void BVHAccel::IntersectBatch(const Ray *rays, int n,
+                              SurfaceInteraction *isects, bool *hits) const {
+    for (int i = 0; i < n; ++i) hits[i] = false;
+    if (!nodes) return;
+    ProfilePhase p(Prof::AccelIntersect);
+    for (int start = 0; start < n; start += bvhRayPacketSize)
+        TraverseRayPacket(
+            nodes, rays + start, std::min(bvhRayPacketSize, n - start),
+            [&](const LinearBVHNode &node, int i) {
+                for (int j = 0; j < node.nPrimitives; ++j)
+                    if (primitives[node.primitivesOffset + j]->Intersect(
+                            rays[start + i], &isects[start + i]))
+                        hits[start + i] = true;
+                return false;
+            });
+}
+
+void BVHAccel::IntersectPBatch(const Ray *rays, int n, bool *occluded) const {
+    for (int i = 0; i < n; ++i) occluded[i] = false;
+    if (!nodes) return;
+    ProfilePhase p(Prof::AccelIntersectP);
+    for (int start = 0; start < n; start += bvhRayPacketSize)
+        TraverseRayPacket(
+            nodes, rays + start, std::min(bvhRayPacketSize, n - start),
+            [&](const LinearBVHNode &node, int i) {
+                for (int j = 0; j < node.nPrimitives; ++j)
+                    if (primitives[node.primitivesOffset + j]->IntersectP(
+                            rays[start + i])) {
+                        occluded[start + i] = true;
+                        return true;
+                    }
+                return false;
+            });
+}
+
+BVHAccel::SplitMethod GetBVHSplitMethod(const ParamSet &ps) {
     std::string splitMethodName = ps.FindOneString("splitmethod", "sah");
-    BVHAccel::SplitMethod splitMethod;
     if (splitMethodName == "sah")
-        splitMethod = BVHAccel::SplitMethod::SAH;
+        return BVHAccel::SplitMethod::SAH;
     else if (splitMethodName == "hlbvh")
-        splitMethod = BVHAccel::SplitMethod::HLBVH;
+        return BVHAccel::SplitMethod::HLBVH;
     else if (splitMethodName == "middle")
-        splitMethod = BVHAccel::SplitMethod::Middle;
+        return BVHAccel::SplitMethod::Middle;
     else if (splitMethodName == "equal")
-        splitMethod = BVHAccel::SplitMethod::EqualCounts;
-    else {
-        Warning("BVH split method \"%s\" unknown.  Using \"sah\".",
-                splitMethodName.c_str());
-        splitMethod = BVHAccel::SplitMethod::SAH;
-    }
+        return BVHAccel::SplitMethod::EqualCounts;
+    Warning("BVH split method \"%s\" unknown.  Using \"sah\".",
+            splitMethodName.c_str());
+    return BVHAccel::SplitMethod::SAH;
+}
 
+std::shared_ptr<BVHAccel> CreateBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
+    BVHAccel::SplitMethod splitMethod = GetBVHSplitMethod(ps);
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    std::string cacheDirectory = ps.FindOneString("cachedir", "");
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, cacheDirectory);
 }
 
 }  // namespace pbrt
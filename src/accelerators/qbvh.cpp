@@ -0,0 +1,374 @@
+
+
+// accelerators/qbvh.cpp*
+#include "accelerators/qbvh.h"
+#include "interaction.h"
+#include "paramset.h"
+#include "stats.h"
+#include "shapes/triangle.h"
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PBRT_QBVH_HAVE_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/QBVH tree", qbvhTreeBytes);
+STAT_RATIO("QBVH/Children per node", qbvhChildren, qbvhNodes);
+STAT_PERCENT("QBVH/Primitives in packed triangle leaves", qbvhPackedPrims,
+             qbvhPrims);
+STAT_COUNTER("QBVH/Packed triangle hits missed when intersected again",
+             nPackedHitsMissed);
+
+// QBVHAccel Local Declarations
+struct QBVHNode {
+    // QBVHNode Public Methods
+    QBVHNode() {
+        // Empty slots get inverted bounds, so that they are never hit
+        for (int i = 0; i < 4; ++i) {
+            for (int a = 0; a < 3; ++a) {
+                bounds[0][a][i] = Infinity;
+                bounds[1][a][i] = -Infinity;
+            }
+            child[i] = -1;
+            nPrimitives[i] = 0;
+            packed[i] = false;
+        }
+    }
+    void SetChild(int i, const Bounds3f &b, int c, int n) {
+        // Round outwards, in case _Float_ is double
+        for (int a = 0; a < 3; ++a) {
+            float lo = (float)b.pMin[a], hi = (float)b.pMax[a];
+            bounds[0][a][i] = (Float)lo > b.pMin[a] ? NextFloatDown(lo) : lo;
+            bounds[1][a][i] = (Float)hi < b.pMax[a] ? NextFloatUp(hi) : hi;
+        }
+        child[i] = c;
+        nPrimitives[i] = n;
+    }
+
+    // Child bounds as structure of arrays: [min/max][axis][child]
+    float bounds[2][3][4];
+    // Interior child: index of its _QBVHNode_, leaf child: first primitive
+    int32_t child[4];
+    uint16_t nPrimitives[4];  // 0 -> interior child (or empty if child < 0)
+    // Leaf child whose primitives all have an entry in _QBVHAccel::triangles_
+    bool packed[4];
+};
+
+struct QBVHTriangle {
+    Point3f p0, p1, p2;
+};
+
+// Returns the triangle behind _prim_ if it can be intersected from its
+// vertices alone, i.e. without alpha textures that need the full hit.
+static const Triangle *PackableTriangle(const Primitive *prim) {
+    const GeometricPrimitive *geomPrim =
+        dynamic_cast<const GeometricPrimitive *>(prim);
+    if (!geomPrim) return nullptr;
+    const Triangle *tri = dynamic_cast<const Triangle *>(geomPrim->GetShape());
+    if (!tri) return nullptr;
+    const TriangleMesh *mesh = tri->GetMesh();
+    if (mesh->alphaMask || mesh->shadowAlphaMask) return nullptr;
+    return tri;
+}
+
+// Ray data that stays constant during traversal, in single precision
+struct QBVHRay {
+    QBVHRay(const Ray &ray) {
+        for (int a = 0; a < 3; ++a) {
+            org[a] = ray.o[a];
+            invDir[a] = 1 / (float)ray.d[a];
+            dirIsNeg[a] = invDir[a] < 0;
+        }
+    }
+    float org[3], invDir[3];
+    int dirIsNeg[3];
+};
+
+// Tests _ray_ against all four children of _node_. Returns a bit mask of
+// the children that were hit and their entry distances in _tNear_.
+static inline int IntersectChildren(const QBVHNode &node, const QBVHRay &ray,
+                                    Float rayTMax, float tNear[4]) {
+    const float robustScale = 1 + 2 * gamma(3);
+#ifdef PBRT_QBVH_HAVE_SSE
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps((float)rayTMax);
+    for (int a = 0; a < 3; ++a) {
+        __m128 o = _mm_set1_ps(ray.org[a]);
+        __m128 invDir = _mm_set1_ps(ray.invDir[a]);
+        __m128 tEntry = _mm_mul_ps(
+            _mm_sub_ps(_mm_loadu_ps(node.bounds[ray.dirIsNeg[a]][a]), o), invDir);
+        __m128 tExit = _mm_mul_ps(
+            _mm_sub_ps(_mm_loadu_ps(node.bounds[1 - ray.dirIsNeg[a]][a]), o),
+            invDir);
+        // If the first operand is NaN (0 * inf), min/max return the second
+        // one, so such slabs don't affect the interval.
+        t0 = _mm_max_ps(tEntry, t0);
+        t1 = _mm_min_ps(tExit, t1);
+    }
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(robustScale));
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        float t0 = 0, t1 = (float)rayTMax;
+        for (int a = 0; a < 3; ++a) {
+            float tEntry = (node.bounds[ray.dirIsNeg[a]][a][i] - ray.org[a]) *
+                           ray.invDir[a];
+            float tExit = (node.bounds[1 - ray.dirIsNeg[a]][a][i] - ray.org[a]) *
+                          ray.invDir[a];
+            if (tEntry > t0) t0 = tEntry;
+            if (tExit < t1) t1 = tExit;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1 * robustScale) mask |= 1 << i;
+    }
+    return mask;
+#endif  // PBRT_QBVH_HAVE_SSE
+}
+
+// QBVHAccel Method Definitions
+QBVHAccel::QBVHAccel(std::vector<std::shared_ptr<Primitive>> p,
+                     int maxPrimsInNode, BVHAccel::SplitMethod splitMethod,
+                     bool packTriangles, const std::string &cacheDirectory) {
+    // Build a binary BVH and collapse it into a tree with four children per
+    // node afterwards
+    BVHAccel bvh(std::move(p), maxPrimsInNode, splitMethod, cacheDirectory);
+    ProfilePhase _(Prof::AccelConstruction);
+    primitives = std::move(bvh.primitives);
+    if (!bvh.nodes) return;
+    bounds = bvh.nodes[0].bounds;
+
+    std::vector<QBVHNode> wideNodes;
+    collapse(bvh.nodes, 0, wideNodes);
+    qbvhPrims += primitives.size();
+
+    if (packTriangles) {
+        // Copy the vertices of all plain triangles, in leaf order, and mark
+        // the leaves that consist of them only
+        std::vector<bool> packable(primitives.size());
+        triangles = AllocAligned<QBVHTriangle>(primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i) {
+            const Triangle *tri = PackableTriangle(primitives[i].get());
+            if (!tri) continue;
+            const Point3f *p = tri->GetMesh()->p.get();
+            triangles[i] = {p[tri->v[0]], p[tri->v[1]], p[tri->v[2]]};
+            packable[i] = true;
+        }
+        for (QBVHNode &node : wideNodes)
+            for (int i = 0; i < 4; ++i) {
+                if (node.nPrimitives[i] == 0) continue;
+                int first = node.child[i];
+                node.packed[i] = std::all_of(
+                    packable.begin() + first,
+                    packable.begin() + first + node.nPrimitives[i],
+                    [](bool b) { return b; });
+                if (node.packed[i]) qbvhPackedPrims += node.nPrimitives[i];
+            }
+        qbvhTreeBytes += primitives.size() * sizeof(QBVHTriangle);
+    }
+
+    nodes = AllocAligned<QBVHNode>(wideNodes.size());
+    std::copy(wideNodes.begin(), wideNodes.end(), nodes);
+    qbvhTreeBytes += wideNodes.size() * sizeof(QBVHNode) + sizeof(*this) +
+                     primitives.size() * sizeof(primitives[0]);
+    LOG(INFO) << StringPrintf("QBVH created with %d nodes for %d primitives "
+                              "(%.2f MB)",
+                              (int)wideNodes.size(), (int)primitives.size(),
+                              float(wideNodes.size() * sizeof(QBVHNode)) /
+                                  (1024.f * 1024.f));
+}
+
+int QBVHAccel::collapse(const LinearBVHNode *bvhNodes, int bvhNodeIndex,
+                        std::vector<QBVHNode> &wideNodes) {
+    // Gather up to four children by repeatedly replacing the interior child
+    // with the largest surface area by its two children
+    int children[4];
+    int nChildren = 0;
+    const LinearBVHNode &bvhNode = bvhNodes[bvhNodeIndex];
+    if (bvhNode.nPrimitives > 0)
+        // Only happens if the whole tree is a single leaf
+        children[nChildren++] = bvhNodeIndex;
+    else {
+        children[nChildren++] = bvhNodeIndex + 1;
+        children[nChildren++] = bvhNode.secondChildOffset;
+        while (nChildren < 4) {
+            int open = -1;
+            Float maxArea = -1;
+            for (int i = 0; i < nChildren; ++i) {
+                const LinearBVHNode &c = bvhNodes[children[i]];
+                if (c.nPrimitives == 0 && c.bounds.SurfaceArea() > maxArea) {
+                    open = i;
+                    maxArea = c.bounds.SurfaceArea();
+                }
+            }
+            if (open == -1) break;
+            int opened = children[open];
+            children[open] = opened + 1;
+            children[nChildren++] = bvhNodes[opened].secondChildOffset;
+        }
+    }
+
+    int nodeIndex = wideNodes.size();
+    wideNodes.push_back(QBVHNode());
+    ++qbvhNodes;
+    qbvhChildren += nChildren;
+    for (int i = 0; i < nChildren; ++i) {
+        const LinearBVHNode &c = bvhNodes[children[i]];
+        if (c.nPrimitives > 0)
+            wideNodes[nodeIndex].SetChild(i, c.bounds, c.primitivesOffset,
+                                          c.nPrimitives);
+        else {
+            // _wideNodes_ may be reallocated by the recursive call
+            int childIndex = collapse(bvhNodes, children[i], wideNodes);
+            wideNodes[nodeIndex].SetChild(i, c.bounds, childIndex, 0);
+        }
+    }
+    return nodeIndex;
+}
+
+Bounds3f QBVHAccel::WorldBound() const { return bounds; }
+
+QBVHAccel::~QBVHAccel() {
+    FreeAligned(nodes);
+    FreeAligned(triangles);
+}
+
+bool QBVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    if (!nodes) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    QBVHRay qRay(ray);
+    // Closest hit so far if it's in a packed leaf; its primitive is only
+    // intersected once the traversal is done
+    int closestPacked = -1;
+    // _ray.tMax_ on entry and at the closest hit of the other primitives
+    Float tMax = ray.tMax, unpackedTMax = ray.tMax;
+
+    // Nodes and leaves still to visit, the closest one on top. Each level
+    // adds at most three entries, so this is plenty for the tree depths the
+    // binary BVH supports.
+    struct StackEntry {
+        int child, nPrimitives;
+        bool packed;
+        float tNear;
+    };
+    StackEntry toVisit[256];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = {0, 0, false, 0.f};
+    while (toVisitOffset > 0) {
+        StackEntry entry = toVisit[--toVisitOffset];
+        // Skip entries behind the closest intersection found so far
+        if (entry.tNear > ray.tMax) continue;
+        if (entry.packed) {
+            for (int i = entry.child; i < entry.child + entry.nPrimitives;
+                 ++i) {
+                const QBVHTriangle &tri = triangles[i];
+                Float t, b0, b1, b2;
+                if (IntersectTriangle(tri.p0, tri.p1, tri.p2, ray, &t, &b0,
+                                      &b1, &b2)) {
+                    ray.tMax = t;
+                    closestPacked = i;
+                }
+            }
+            continue;
+        }
+        if (entry.nPrimitives > 0) {
+            for (int i = 0; i < entry.nPrimitives; ++i)
+                if (primitives[entry.child + i]->Intersect(ray, isect)) {
+                    hit = true;
+                    closestPacked = -1;
+                    unpackedTMax = ray.tMax;
+                }
+            continue;
+        }
+
+        const QBVHNode &node = nodes[entry.child];
+        float tNear[4];
+        int hitMask = IntersectChildren(node, qRay, ray.tMax, tNear);
+        // Push the children far to near, so that the nearest is visited next
+        int first = toVisitOffset;
+        for (int i = 0; i < 4; ++i) {
+            if (!(hitMask & (1 << i))) continue;
+            int j = toVisitOffset++;
+            while (j > first && toVisit[j - 1].tNear < tNear[i]) {
+                toVisit[j] = toVisit[j - 1];
+                --j;
+            }
+            toVisit[j] = {node.child[i], node.nPrimitives[i], node.packed[i],
+                          tNear[i]};
+        }
+        DCHECK_LE(toVisitOffset, 256);
+    }
+    if (closestPacked >= 0) {
+        // Repeat the winning test through the primitive to get the full
+        // _SurfaceInteraction_; it computes the same hit as above
+        ray.tMax = tMax;
+        if (primitives[closestPacked]->Intersect(ray, isect)) return true;
+        // Should the primitive still miss, _isect_ holds the closest hit of
+        // the other primitives, if any, so go back to that one
+        ++nPackedHitsMissed;
+        ray.tMax = unpackedTMax;
+    }
+    return hit;
+}
+
+bool QBVHAccel::IntersectP(const Ray &ray) const {
+    if (!nodes) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    QBVHRay qRay(ray);
+
+    // Any hit ends the traversal, so the visiting order doesn't matter here
+    struct StackEntry {
+        int child, nPrimitives;
+        bool packed;
+    };
+    StackEntry toVisit[256];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = {0, 0, false};
+    while (toVisitOffset > 0) {
+        StackEntry entry = toVisit[--toVisitOffset];
+        if (entry.packed) {
+            for (int i = entry.child; i < entry.child + entry.nPrimitives;
+                 ++i) {
+                const QBVHTriangle &tri = triangles[i];
+                Float t, b0, b1, b2;
+                if (IntersectTriangle(tri.p0, tri.p1, tri.p2, ray, &t, &b0,
+                                      &b1, &b2))
+                    return true;
+            }
+            continue;
+        }
+        if (entry.nPrimitives > 0) {
+            for (int i = 0; i < entry.nPrimitives; ++i)
+                if (primitives[entry.child + i]->IntersectP(ray)) return true;
+            continue;
+        }
+
+        const QBVHNode &node = nodes[entry.child];
+        float tNear[4];
+        int hitMask = IntersectChildren(node, qRay, ray.tMax, tNear);
+        for (int i = 0; i < 4; ++i)
+            if (hitMask & (1 << i))
+                toVisit[toVisitOffset++] = {node.child[i], node.nPrimitives[i],
+                                            node.packed[i]};
+        DCHECK_LE(toVisitOffset, 256);
+    }
+    return false;
+}
+
+std::shared_ptr<QBVHAccel> CreateQBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
+    BVHAccel::SplitMethod splitMethod = GetBVHSplitMethod(ps);
+    int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
+    bool packTriangles = ps.FindOneBool("packtriangles", true);
+    std::string cacheDirectory = ps.FindOneString("cachedir", "");
+    return std::make_shared<QBVHAccel>(std::move(prims), maxPrimsInNode,
+                                       splitMethod, packTriangles,
+                                       cacheDirectory);
+}
+
+}  // namespace pbrt
@@ -0,0 +1,63 @@
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_QBVH_H
+#define PBRT_ACCELERATORS_QBVH_H
+
+// accelerators/qbvh.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include "accelerators/bvh.h"
+
+namespace pbrt {
+
+// QBVHAccel Forward Declarations
+struct QBVHNode;
+struct QBVHTriangle;
+
+/* A BVH with four children per node. It is built by collapsing a regular
+   binary BVHAccel, so it uses the same split methods. The bounds of all four
+   children are stored as a structure of arrays, so that a ray can be tested
+   against them at once with SSE. This halves the depth of the tree and thus
+   the number of (cache missing) node fetches during traversal.
+
+   Leaves that contain only plain triangles also get their vertices copied
+   into a contiguous array in leaf order. Those are tested directly, without
+   going through the _Primitive_ and _Shape_ virtual calls and the mesh
+   indirection, and only the closest one is intersected through its
+   primitive afterwards to fill in the _SurfaceInteraction_. */
+class QBVHAccel : public Aggregate {
+  public:
+    // QBVHAccel Public Methods
+    QBVHAccel(std::vector<std::shared_ptr<Primitive>> p,
+              int maxPrimsInNode = 1,
+              BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH,
+              bool packTriangles = true,
+              const std::string &cacheDirectory = "");
+    Bounds3f WorldBound() const;
+    ~QBVHAccel();
+    bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &ray) const;
+
+  private:
+    // QBVHAccel Private Methods
+    int collapse(const LinearBVHNode *bvhNodes, int bvhNodeIndex,
+                 std::vector<QBVHNode> &wideNodes);
+
+    // QBVHAccel Private Data
+    std::vector<std::shared_ptr<Primitive>> primitives;
+    QBVHNode *nodes = nullptr;
+    // Vertices of the primitives in packed leaves, indexed like _primitives_
+    QBVHTriangle *triangles = nullptr;
+    Bounds3f bounds;
+};
+
+std::shared_ptr<QBVHAccel> CreateQBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps);
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_QBVH_H
@@ -33,6 +33,7 @@
 // core/api.cpp*
 #include "api.h"
 #include "parallel.h"
+#include "parser.h"
 #include "paramset.h"
 #include "spectrum.h"
 #include "scene.h"
@@ -43,6 +44,7 @@
 // API Additional Headers
 #include "accelerators/bvh.h"
 #include "accelerators/kdtreeaccel.h"
+#include "accelerators/qbvh.h"
 #include "cameras/environment.h"
 #include "cameras/orthographic.h"
 #include "cameras/perspective.h"
@@ -100,6 +102,7 @@
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
 #include "shapes/plymesh.h"
+#include "shapes/binarymesh.h"
 #include "textures/bilerp.h"
 #include "textures/checkerboard.h"
 #include "textures/constant.h"
@@ -119,6 +122,7 @@
 
 #include <map>
 #include <stdio.h>
+#include <unordered_map>
 
 namespace pbrt {
 
@@ -293,8 +297,8 @@ class TransformCache {
 
     void Clear() {
         transformCacheBytes += arena.TotalAllocated() + hashTable.size() * sizeof(Transform *);
-        hashTable.resize(512);
         hashTable.clear();
+        hashTable.resize(512);
         hashTableOccupancy = 0;
         arena.Reset();
     }
@@ -378,12 +382,63 @@ static std::vector<uint32_t> pushedActiveTransformBits;
 static TransformCache transformCache;
 int catIndentCount = 0;
 
+// Meshes with exactly the same parameters, material, and medium as an
+// earlier one are only created once. With the same transformation, the
+// earlier mesh's primitives are used again; otherwise, a
+// _TransformedPrimitive_ places an aggregate of them with the relative
+// transformation, as if the mesh had been instanced with ObjectBegin and
+// ObjectInstance. Shapes are looked up by the hash of their parameters so
+// that the cache doesn't hold on to the parameters themselves.
+struct ShapeCacheEntry {
+    std::string name;
+    std::pair<uint64_t, uint64_t> hash;
+    Transform *ObjToWorld;
+    bool reverseOrientation;
+    std::shared_ptr<Material> material;
+    MediumInterface mi;
+    std::vector<std::shared_ptr<Primitive>> *primitives;
+    // The first shape's primitives, once it's been created, and the
+    // aggregate of them for the transformed copies
+    std::vector<std::shared_ptr<Primitive>> shapePrims;
+    std::shared_ptr<Primitive> aggregate;
+};
+static std::unordered_multimap<uint64_t, std::shared_ptr<ShapeCacheEntry>>
+    shapeCache;
+
+// Static shapes without area lights are created on the thread pool:
+// pbrtShape() records what they need from the graphics state, and
+// FlushPendingShapes() creates all that are pending in parallel and adds
+// their primitives in the order of the pbrtShape() calls. It has to run
+// before anything else is added to, or reads, the primitive lists.
+struct PendingShape {
+    std::string name;
+    ParamSet params;
+    Transform *ObjToWorld, *WorldToObj;
+    bool reverseOrientation;
+    std::shared_ptr<GraphicsState::FloatTextureMap> floatTextures;
+    std::shared_ptr<Material> material;
+    MediumInterface mi;
+    std::vector<std::shared_ptr<Primitive>> *primitives;
+    Loc loc;
+    // The entry for the shape's primitives if it's the first of its kind,
+    // or the one that it repeats if _duplicate_ is true
+    std::shared_ptr<ShapeCacheEntry> cacheEntry;
+    bool duplicate = false;
+};
+static std::vector<PendingShape> pendingShapes;
+// Flushed early when this many are pending, to bound the memory of the
+// parameter lists held on to
+static PBRT_CONSTEXPR int maxPendingShapes = 4096;
+
 // API Forward Declarations
-std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
-                                               const Transform *ObjectToWorld,
-                                               const Transform *WorldToObject,
-                                               bool reverseOrientation,
-                                               const ParamSet &paramSet);
+std::vector<std::shared_ptr<Shape>> MakeShapes(
+    const std::string &name, const Transform *ObjectToWorld,
+    const Transform *WorldToObject, bool reverseOrientation,
+    const ParamSet &paramSet, GraphicsState::FloatTextureMap *floatTextures);
+static void FlushPendingShapes();
+static void AddDuplicateShape(ShapeCacheEntry &entry, Transform *ObjToWorld,
+                              std::vector<std::shared_ptr<Primitive>> *prims);
+bool shapeMaySetMaterialParameters(const ParamSet &ps);
 
 // API Macros
 #define VERIFY_INITIALIZED(func)                           \
@@ -430,11 +485,10 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
     } while (false) /* swallow trailing semicolon */
 
 // Object Creation Function Definitions
-std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
-                                               const Transform *object2world,
-                                               const Transform *world2object,
-                                               bool reverseOrientation,
-                                               const ParamSet &paramSet) {
+std::vector<std::shared_ptr<Shape>> MakeShapes(
+    const std::string &name, const Transform *object2world,
+    const Transform *world2object, bool reverseOrientation,
+    const ParamSet &paramSet, GraphicsState::FloatTextureMap *floatTextures) {
     std::vector<std::shared_ptr<Shape>> shapes;
     std::shared_ptr<Shape> s;
     if (name == "sphere")
@@ -468,7 +522,7 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
             const int *vi = paramSet.FindInt("indices", &nvi);
 
             if (nvi < 500) {
-                // It's a small mesh; don't bother with a PLY file after all.
+                // It's a small mesh; don't bother with a file after all.
                 printf("%*sShape \"%s\" ", catIndentCount, "", name.c_str());
                 paramSet.Print(catIndentCount);
                 printf("\n");
@@ -476,7 +530,9 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
                 static int count = 1;
                 const char *plyPrefix =
                     getenv("PLY_PREFIX") ? getenv("PLY_PREFIX") : "mesh";
-                std::string fn = StringPrintf("%s_%05d.ply", plyPrefix, count++);
+                std::string fn = StringPrintf(
+                    "%s_%05d.%s", plyPrefix, count++,
+                    PbrtOptions.toBinaryMesh ? "pbm" : "ply");
 
                 int npi, nuvi, nsi, nni;
                 const Point3f *P = paramSet.FindPoint3f("P", &npi);
@@ -500,8 +556,13 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
                 const int *faceIndices = paramSet.FindInt("faceIndices", &nfi);
                 if (faceIndices) CHECK_EQ(nfi, nvi / 3);
 
-                if (!WritePlyFile(fn.c_str(), nvi / 3, vi, npi, P, S, N, uvs,
-                                  faceIndices))
+                if (PbrtOptions.toBinaryMesh) {
+                    if (!WriteBinaryMeshFile(fn, nvi / 3, vi, npi, P, S, N,
+                                             uvs, faceIndices))
+                        Error("Unable to write binary mesh file \"%s\"",
+                              fn.c_str());
+                } else if (!WritePlyFile(fn.c_str(), nvi / 3, vi, npi, P, S,
+                                         N, uvs, faceIndices))
                     Error("Unable to write PLY file \"%s\"", fn.c_str());
 
                 ParamSet ps = paramSet;
@@ -513,18 +574,24 @@ std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string &name,
                 ps.EraseVector3f("S");
                 ps.EraseInt("faceIndices");
 
-                printf("%*sShape \"plymesh\" \"string filename\" \"%s\" ",
-                       catIndentCount, "", fn.c_str());
+                printf("%*sShape \"%s\" \"string filename\" \"%s\" ",
+                       catIndentCount, "",
+                       PbrtOptions.toBinaryMesh ? "binarymesh" : "plymesh",
+                       fn.c_str());
                 ps.Print(catIndentCount);
                 printf("\n");
             }
         } else
             shapes = CreateTriangleMeshShape(object2world, world2object,
                                              reverseOrientation, paramSet,
-                                             &*graphicsState.floatTextures);
+                                             floatTextures);
     } else if (name == "plymesh")
         shapes = CreatePLYMesh(object2world, world2object, reverseOrientation,
-                               paramSet, &*graphicsState.floatTextures);
+                               paramSet, floatTextures);
+    else if (name == "binarymesh")
+        shapes = CreateBinaryMesh(object2world, world2object,
+                                  reverseOrientation, paramSet,
+                                  floatTextures);
     else if (name == "heightfield")
         shapes = CreateHeightfield(object2world, world2object,
                                    reverseOrientation, paramSet);
@@ -783,6 +850,8 @@ std::shared_ptr<Primitive> MakeAccelerator(
         accel = CreateBVHAccelerator(std::move(prims), paramSet);
     else if (name == "kdtree")
         accel = CreateKdTreeAccelerator(std::move(prims), paramSet);
+    else if (name == "qbvh")
+        accel = CreateQBVHAccelerator(std::move(prims), paramSet);
     else
         Warning("Accelerator \"%s\" unknown.", name.c_str());
     paramSet.ReportUnused();
@@ -1353,6 +1422,90 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         printf("\n");
     }
 
+    std::vector<std::shared_ptr<Primitive>> *target =
+        renderOptions->currentInstance ? renderOptions->currentInstance
+                                       : &renderOptions->primitives;
+    std::shared_ptr<ShapeCacheEntry> cacheEntry;
+    if (!curTransform.IsAnimated() && graphicsState.areaLight == "" &&
+        !shapeMaySetMaterialParameters(params) && !PbrtOptions.cat &&
+        !PbrtOptions.toPly &&
+        (name == "trianglemesh" || name == "plymesh" ||
+         name == "binarymesh" || name == "loopsubdiv") &&
+        params.FindTexture("alpha") == "" &&
+        params.FindTexture("shadowalpha") == "") {
+        // Use the primitives of an identical earlier mesh, if there is one
+        cacheEntry = std::make_shared<ShapeCacheEntry>();
+        cacheEntry->name = name;
+        cacheEntry->hash = params.Hash();
+        cacheEntry->ObjToWorld = transformCache.Lookup(curTransform[0]);
+        cacheEntry->reverseOrientation = graphicsState.reverseOrientation;
+        cacheEntry->material = graphicsState.GetMaterialForShape(params);
+        cacheEntry->mi = graphicsState.CreateMediumInterface();
+        cacheEntry->primitives = target;
+        // Copies under another transform become TransformedPrimitives,
+        // which the NLoS object and reflector lists of the Scene don't
+        // recognize, so meshes with an ObjectSemantic are only reused
+        // in place.
+        bool mayInstance = params.FindOneInt("ObjectSemantic", 0) == 0;
+        auto range = shapeCache.equal_range(cacheEntry->hash.first);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            ShapeCacheEntry &entry = *iter->second;
+            if (entry.name == name && entry.hash == cacheEntry->hash &&
+                entry.reverseOrientation == cacheEntry->reverseOrientation &&
+                entry.material == cacheEntry->material &&
+                entry.mi.inside == cacheEntry->mi.inside &&
+                entry.mi.outside == cacheEntry->mi.outside &&
+                entry.primitives == target &&
+                (mayInstance || entry.ObjToWorld == cacheEntry->ObjToWorld) &&
+                entry.ObjToWorld->SwapsHandedness() ==
+                    cacheEntry->ObjToWorld->SwapsHandedness()) {
+                if (pendingShapes.empty())
+                    AddDuplicateShape(entry, cacheEntry->ObjToWorld, target);
+                else {
+                    // Keep it in order with the pending shapes
+                    PendingShape shape;
+                    shape.ObjToWorld = cacheEntry->ObjToWorld;
+                    shape.primitives = target;
+                    shape.cacheEntry = iter->second;
+                    shape.duplicate = true;
+                    pendingShapes.push_back(std::move(shape));
+                }
+                return;
+            }
+        }
+        shapeCache.insert(std::make_pair(cacheEntry->hash.first, cacheEntry));
+    }
+
+    if (!curTransform.IsAnimated() && graphicsState.areaLight == "" &&
+        !shapeMaySetMaterialParameters(params) && !PbrtOptions.cat &&
+        !PbrtOptions.toPly && MaxThreadIndex() > 1) {
+        // Record the shape to be created with others in parallel; shapes
+        // that get a material of their own are still created right away,
+        // since it reports the parameters that the shape didn't use.
+        PendingShape shape;
+        shape.name = name;
+        shape.params = params;
+        shape.ObjToWorld = transformCache.Lookup(curTransform[0]);
+        shape.WorldToObj = transformCache.Lookup(Inverse(curTransform[0]));
+        shape.reverseOrientation = graphicsState.reverseOrientation;
+        if (params.FindTexture("alpha") != "" ||
+            params.FindTexture("shadowalpha") != "") {
+            // Textures defined later mustn't change what it sees
+            shape.floatTextures = graphicsState.floatTextures;
+            graphicsState.floatTexturesShared = true;
+        }
+        shape.material = graphicsState.GetMaterialForShape(params);
+        shape.mi = graphicsState.CreateMediumInterface();
+        shape.primitives = target;
+        if (parserLoc) shape.loc = *parserLoc;
+        shape.cacheEntry = cacheEntry;
+        pendingShapes.push_back(std::move(shape));
+        if (pendingShapes.size() >= maxPendingShapes) FlushPendingShapes();
+        return;
+    }
+
+    // Keep the primitives in order with the pending ones
+    FlushPendingShapes();
     if (!curTransform.IsAnimated()) {
         // Initialize _prims_ and _areaLights_ for static shape
 
@@ -1361,23 +1514,27 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         Transform *WorldToObj = transformCache.Lookup(Inverse(curTransform[0]));
         std::vector<std::shared_ptr<Shape>> shapes =
             MakeShapes(name, ObjToWorld, WorldToObj,
-                       graphicsState.reverseOrientation, params);
+                       graphicsState.reverseOrientation, params,
+                       &*graphicsState.floatTextures);
         if (shapes.empty()) return;
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
-        prims.reserve(shapes.size());
-        for (auto s : shapes) {
-            // Possibly create area light for shape
-            std::shared_ptr<AreaLight> area;
-            if (graphicsState.areaLight != "") {
-                area = MakeAreaLight(graphicsState.areaLight, curTransform[0],
-                                     mi, graphicsState.areaLightParams, s);
+        if (graphicsState.areaLight == "")
+            prims = CreateGeometricPrimitives(shapes, mtl, mi);
+        else {
+            prims.reserve(shapes.size());
+            for (auto s : shapes) {
+                // Create area light for shape
+                std::shared_ptr<AreaLight> area =
+                    MakeAreaLight(graphicsState.areaLight, curTransform[0], mi,
+                                  graphicsState.areaLightParams, s);
                 if (area) areaLights.push_back(area);
+                prims.push_back(
+                    std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
             }
-            prims.push_back(
-                std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
         }
+        if (cacheEntry) cacheEntry->shapePrims = prims;
     } else {
         // Initialize _prims_ and _areaLights_ for animated shape
 
@@ -1387,18 +1544,17 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
                 "Ignoring currently set area light when creating "
                 "animated shape");
         Transform *identity = transformCache.Lookup(Transform());
-        std::vector<std::shared_ptr<Shape>> shapes = MakeShapes(
-            name, identity, identity, graphicsState.reverseOrientation, params);
+        std::vector<std::shared_ptr<Shape>> shapes =
+            MakeShapes(name, identity, identity,
+                       graphicsState.reverseOrientation, params,
+                       &*graphicsState.floatTextures);
         if (shapes.empty()) return;
 
         // Create _GeometricPrimitive_(s) for animated shape
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
-        prims.reserve(shapes.size());
-        for (auto s : shapes)
-            prims.push_back(
-                std::make_shared<GeometricPrimitive>(s, mtl, nullptr, mi));
+        prims = CreateGeometricPrimitives(shapes, mtl, mi);
 
         // Create single _TransformedPrimitive_ for _prims_
 
@@ -1435,6 +1591,75 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
     }
 }
 
+static void FlushPendingShapes() {
+    if (pendingShapes.empty()) return;
+    std::vector<std::vector<std::shared_ptr<Primitive>>> prims(
+        pendingShapes.size());
+    ParallelFor([&](int64_t i) {
+        PendingShape &shape = pendingShapes[i];
+        if (shape.duplicate) return;
+        // Report errors at the location of the pbrtShape() call
+        Loc *callerLoc = parserLoc;
+        parserLoc = shape.loc.filename.empty() ? nullptr : &shape.loc;
+        GraphicsState::FloatTextureMap noTextures;
+        std::vector<std::shared_ptr<Shape>> shapes = MakeShapes(
+            shape.name, shape.ObjToWorld, shape.WorldToObj,
+            shape.reverseOrientation, shape.params,
+            shape.floatTextures ? shape.floatTextures.get() : &noTextures);
+        shape.params.ReportUnused();
+        prims[i] = CreateGeometricPrimitives(shapes, shape.material, shape.mi);
+        parserLoc = callerLoc;
+    }, pendingShapes.size());
+    for (size_t i = 0; i < pendingShapes.size(); ++i) {
+        PendingShape &shape = pendingShapes[i];
+        if (shape.duplicate) {
+            AddDuplicateShape(*shape.cacheEntry, shape.ObjToWorld,
+                              shape.primitives);
+            continue;
+        }
+        if (shape.cacheEntry) shape.cacheEntry->shapePrims = prims[i];
+        shape.primitives->insert(shape.primitives->end(), prims[i].begin(),
+                                 prims[i].end());
+    }
+    pendingShapes.clear();
+}
+
+STAT_COUNTER("Scene/Duplicate meshes reused", nDuplicateMeshesReused);
+STAT_COUNTER("Scene/Duplicate meshes instanced", nDuplicateMeshesInstanced);
+
+static void AddDuplicateShape(ShapeCacheEntry &entry, Transform *ObjToWorld,
+                              std::vector<std::shared_ptr<Primitive>> *prims) {
+    if (entry.shapePrims.empty()) return;
+    if (ObjToWorld == entry.ObjToWorld) {
+        // The _TransformCache_ returns the same pointer for equal transforms
+        prims->insert(prims->end(), entry.shapePrims.begin(),
+                      entry.shapePrims.end());
+        ++nDuplicateMeshesReused;
+        return;
+    }
+
+    if (!entry.aggregate) {
+        if (entry.shapePrims.size() > 1) {
+            entry.aggregate = MakeAccelerator(renderOptions->AcceleratorName,
+                                              entry.shapePrims,
+                                              renderOptions->AcceleratorParams);
+            if (!entry.aggregate)
+                entry.aggregate = std::make_shared<BVHAccel>(entry.shapePrims);
+        } else
+            entry.aggregate = entry.shapePrims[0];
+    }
+    // The earlier mesh's primitives are already transformed by its
+    // ObjToWorld
+    Transform *EntryToWorld =
+        transformCache.Lookup(*ObjToWorld * Inverse(*entry.ObjToWorld));
+    AnimatedTransform animatedEntryToWorld(
+        EntryToWorld, renderOptions->transformStartTime, EntryToWorld,
+        renderOptions->transformEndTime);
+    prims->push_back(std::make_shared<TransformedPrimitive>(
+        entry.aggregate, animatedEntryToWorld));
+    ++nDuplicateMeshesInstanced;
+}
+
 // Attempt to determine if the ParamSet for a shape may provide a value for
 // its material's parameters. Unfortunately, materials don't provide an
 // explicit representation of their parameters that we can query and
@@ -1467,8 +1692,9 @@ bool shapeMaySetMaterialParameters(const ParamSet &ps) {
     for (const auto &param : ps.bools)
         if (param->nValues == 1)
             return true;
+    // The meshes' NLoS "ObjectSemantic" is theirs alone, though.
     for (const auto &param : ps.ints)
-        if (param->nValues == 1)
+        if (param->nValues == 1 && param->name != "ObjectSemantic")
             return true;
     for (const auto &param : ps.point2fs)
         if (param->nValues == 1)
@@ -1536,6 +1762,9 @@ void pbrtReverseOrientation() {
 
 void pbrtObjectBegin(const std::string &name) {
     VERIFY_WORLD("ObjectBegin");
+    // Pending shapes may still be headed for an instance of the same name
+    if (renderOptions->instances.find(name) != renderOptions->instances.end())
+        FlushPendingShapes();
     pbrtAttributeBegin();
     if (renderOptions->currentInstance)
         Error("ObjectBegin called inside of instance definition");
@@ -1576,6 +1805,7 @@ void pbrtObjectInstance(const std::string &name) {
         Error("Unable to find instance named \"%s\"", name.c_str());
         return;
     }
+    FlushPendingShapes();
     std::vector<std::shared_ptr<Primitive>> &in =
         renderOptions->instances[name];
     if (in.empty()) return;
@@ -1604,6 +1834,55 @@ void pbrtObjectInstance(const std::string &name) {
     renderOptions->primitives.push_back(prim);
 }
 
+// Writes the statistics and the profile of a render as JSON, along with
+// its timing and throughput, for scripts that keep track of renders
+static void WriteStatsJSON(const std::string &filename,
+                           std::chrono::system_clock::time_point startTime,
+                           std::chrono::system_clock::time_point endTime,
+                           int xResolution, int yResolution, int tResolution) {
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) {
+        Warning("Unable to write statistics to \"%s\": %s", filename.c_str(),
+                strerror(errno));
+        return;
+    }
+    double seconds = std::chrono::duration<double>(endTime - startTime).count();
+    int64_t nRays =
+        GetStatsCounter("Intersections/Regular ray intersection tests") +
+        GetStatsCounter("Intersections/Shadow ray intersection tests");
+    int64_t nSamples = GetStatsCounter("Integrator/Camera rays traced");
+    auto perSecond = [&](int64_t n) { return seconds > 0 ? n / seconds : 0.; };
+
+    fprintf(f, "{\n  \"timing\": {\n    \"start\": \"%s\",\n"
+            "    \"end\": \"%s\",\n    \"seconds\": %.3f,\n"
+            "    \"threads\": %d\n  },\n",
+            FormatTime(startTime).c_str(), FormatTime(endTime).c_str(),
+            seconds, MaxThreadIndex());
+    fprintf(f, "  \"image\": {\n    \"xresolution\": %d,\n"
+            "    \"yresolution\": %d,\n    \"tresolution\": %d,\n"
+            "    \"samplesPerPixel\": %d\n  },\n",
+            xResolution, yResolution, tResolution, (int)g_TFMD.RenderSamples);
+    fprintf(f, "  \"throughput\": {\n    \"rays\": %" PRId64 ",\n"
+            "    \"raysPerSecond\": %.1f,\n    \"samples\": %" PRId64 ",\n"
+            "    \"samplesPerSecond\": %.1f\n  },\n",
+            nRays, perSecond(nRays), nSamples, perSecond(nSamples));
+    fprintf(f, "  \"statistics\": ");
+    PrintStatsJSON(f);
+    fprintf(f, ",\n  \"profile\": ");
+    ReportProfilerResultsJSON(f);
+    fprintf(f, "\n}\n");
+    if (fclose(f) != 0)
+        Warning("Error writing statistics to \"%s\": %s", filename.c_str(),
+                strerror(errno));
+}
+
+// Returns the primitives of the scene described so far, in the order they
+// were added; lets the tests check how the scene was built
+std::vector<std::shared_ptr<Primitive>> pbrtWorldPrimitives() {
+    FlushPendingShapes();
+    return renderOptions->primitives;
+}
+
 void pbrtWorldEnd() {
     VERIFY_WORLD("WorldEnd");
     // Ensure there are no pushed graphics states
@@ -1616,8 +1895,10 @@ void pbrtWorldEnd() {
         Warning("Missing end to pbrtTransformBegin()");
         pushedTransforms.pop_back();
     }
+    FlushPendingShapes();
 
 	auto startTime = std::chrono::system_clock::now();
+	auto endTime = startTime;
 
 	//copy some meta information for transient images
 	g_TFMD.RenderStartTime = startTime;
@@ -1645,6 +1926,7 @@ void pbrtWorldEnd() {
 
 
         if (scene && integrator) integrator->Render(*scene);
+        endTime = std::chrono::system_clock::now();
 
         CHECK_EQ(CurrentProfilerState(), ProfToBits(Prof::IntegratorRender));
         ProfilerState = ProfToBits(Prof::SceneConstruction);
@@ -1661,6 +1943,7 @@ void pbrtWorldEnd() {
     // Clean up after rendering. Do this before reporting stats so that
     // destructors can run and update stats as needed.
     graphicsState = GraphicsState();
+    shapeCache.clear();
     transformCache.Clear();
     currentApiState = APIState::OptionsBlock;
     ImageTexture<Float, Float>::ClearCache();
@@ -1701,6 +1984,11 @@ void pbrtWorldEnd() {
 			PrintStats(logFile.get());
 			ReportProfilerResults(logFile.get());
 		}
+
+		// and the same as JSON, next to it
+		WriteStatsJSON(filename.substr(0, filename.size() - 4) + ".json",
+		               startTime, endTime, xresolution, yresolution,
+		               tresolution);
         if (!PbrtOptions.quiet) {
             PrintStats(stdout);
             ReportProfilerResults(stdout);
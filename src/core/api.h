@@ -88,6 +88,7 @@ void pbrtObjectBegin(const std::string &name);
 void pbrtObjectEnd();
 void pbrtObjectInstance(const std::string &name);
 void pbrtWorldEnd();
+std::vector<std::shared_ptr<Primitive>> pbrtWorldPrimitives();
 
 void pbrtParseFile(std::string filename);
 void pbrtParseString(std::string str);
@@ -61,6 +61,8 @@ static std::string StringVaprintf(const std::string &fmt, va_list args) {
 
 static void processError(Loc *loc, const char *format, va_list args,
                          const char *errorType) {
+    if (parsingAhead) throw ParseAheadAbandoned();
+
     // Build up an entire formatted error string and print it all at once;
     // this way, if multiple threads are printing messages at once, they
     // don't get jumbled up...
@@ -33,11 +33,22 @@
 
 // core/fileutil.cpp*
 #include "fileutil.h"
+#include "memory.h"
+#include <cstdio>
 #include <cstdlib>
 #include <climits>
 #ifndef PBRT_IS_WINDOWS
 #include <libgen.h>
 #endif
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#elif defined(PBRT_IS_WINDOWS)
+#include <windows.h>  // Windows file mapping API
+#endif
 
 namespace pbrt {
 
@@ -126,4 +137,88 @@ void SetSearchDirectory(const std::string &dirname) {
     searchDirectory = dirname;
 }
 
+std::unique_ptr<MappedFile> MappedFile::Open(const std::string &filename,
+                                             bool copyOnWrite) {
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+    struct stat stat;
+    if (fstat(fd, &stat) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = stat.st_size;
+    void *ptr = nullptr;
+    if (size > 0) {
+        if (copyOnWrite)
+            ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_PRIVATE,
+                       fd, 0);
+        else
+            ptr = mmap(0, size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+    }
+    close(fd);
+    return std::unique_ptr<MappedFile>(
+        new MappedFile((const char *)ptr, size, true, copyOnWrite));
+#elif defined(PBRT_IS_WINDOWS)
+    HANDLE fileHandle =
+        CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (fileHandle == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER liLen;
+    if (!GetFileSizeEx(fileHandle, &liLen)) {
+        CloseHandle(fileHandle);
+        return nullptr;
+    }
+    size_t size = liLen.QuadPart;
+    LPVOID ptr = nullptr;
+    if (size > 0) {
+        HANDLE mapping = CreateFileMapping(
+            fileHandle, 0, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0,
+            0);
+        CloseHandle(fileHandle);
+        if (mapping == 0) return nullptr;
+        ptr = MapViewOfFile(mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ,
+                            0, 0, 0);
+        CloseHandle(mapping);
+        if (ptr == nullptr) return nullptr;
+    } else
+        CloseHandle(fileHandle);
+    return std::unique_ptr<MappedFile>(
+        new MappedFile((const char *)ptr, size, true, copyOnWrite));
+#else
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return nullptr;
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    // Aligned like a mapping would be, so that callers can point directly
+    // into the data
+    char *data = AllocAligned<char>(size);
+    if (fread(data, 1, size, f) != size) {
+        FreeAligned(data);
+        fclose(f);
+        return nullptr;
+    }
+    fclose(f);
+    return std::unique_ptr<MappedFile>(
+        new MappedFile(data, size, false, true));
+#endif
+}
+
+MappedFile::~MappedFile() {
+    if (!mapped)
+        FreeAligned((void *)data);
+    else if (size > 0) {
+#ifdef PBRT_HAVE_MMAP
+        munmap((void *)data, size);
+#elif defined(PBRT_IS_WINDOWS)
+        UnmapViewOfFile(data);
+#endif
+    }
+}
+
 }  // namespace pbrt
@@ -41,6 +41,7 @@
 // core/fileutil.h*
 #include "pbrt.h"
 #include <string>
+#include <memory>
 #include <cctype>
 #include <string.h>
 
@@ -53,6 +54,35 @@ std::string ResolveFilename(const std::string &filename);
 std::string DirectoryContaining(const std::string &filename);
 void SetSearchDirectory(const std::string &dirname);
 
+// Read-only view of the contents of a whole file. The file is memory
+// mapped where supported and read into memory otherwise.
+class MappedFile {
+  public:
+    // Returns nullptr and sets _errno_ if the file can't be opened. A
+    // _copyOnWrite_ mapping can be modified through _MutableData()_; pages
+    // are only copied once they are written to, and the file itself is
+    // never changed.
+    static std::unique_ptr<MappedFile> Open(const std::string &filename,
+                                            bool copyOnWrite = false);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *Data() const { return data; }
+    char *MutableData() {
+        CHECK(writable);
+        return const_cast<char *>(data);
+    }
+    size_t Size() const { return size; }
+
+  private:
+    MappedFile(const char *data, size_t size, bool mapped, bool writable)
+        : data(data), size(size), mapped(mapped), writable(writable) {}
+    const char *data;
+    size_t size;
+    bool mapped, writable;
+};
+
 inline bool HasExtension(const std::string &value, const std::string &ending) {
     if (ending.size() > value.size()) return false;
     return std::equal(
@@ -100,9 +100,17 @@ std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i &sampleBounds) {
     Point2i p1 = (Point2i)Floor(floatBounds.pMax - halfPixel + filter->radius) +
                  Point2i(1, 1);
     Bounds2i tilePixelBounds = Intersect(Bounds2i(p0, p1), croppedPixelBounds);
+    std::vector<FilmTilePixel> buffer;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!freeTileBuffers.empty()) {
+            buffer = std::move(freeTileBuffers.back());
+            freeTileBuffers.pop_back();
+        }
+    }
     return std::unique_ptr<FilmTile>(new FilmTile(
         tilePixelBounds, filter->radius, filterTable, filterTableWidth,
-        maxSampleLuminance));
+        maxSampleLuminance, std::move(buffer)));
 }
 
 void Film::Clear() {
@@ -127,6 +135,7 @@ void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile) {
         for (int i = 0; i < 3; ++i) mergePixel.xyz[i] += xyz[i];
         mergePixel.filterWeightSum += tilePixel.filterWeightSum;
     }
+    freeTileBuffers.push_back(std::move(tile->pixels));
 }
 
 void Film::SetImage(const Spectrum *img) const {
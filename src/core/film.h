@@ -91,6 +91,9 @@ class Film {
     static PBRT_CONSTEXPR int filterTableWidth = 16;
     Float filterTable[filterTableWidth * filterTableWidth];
     std::mutex mutex;
+    // Pixel buffers of merged tiles, reused by _GetFilmTile()_; guarded by
+    // _mutex_
+    std::vector<std::vector<FilmTilePixel>> freeTileBuffers;
     const Float scale;
     const Float maxSampleLuminance;
 
@@ -109,14 +112,17 @@ class FilmTile {
     // FilmTile Public Methods
     FilmTile(const Bounds2i &pixelBounds, const Vector2f &filterRadius,
              const Float *filterTable, int filterTableSize,
-             Float maxSampleLuminance)
+             Float maxSampleLuminance,
+             std::vector<FilmTilePixel> buffer = std::vector<FilmTilePixel>())
         : pixelBounds(pixelBounds),
           filterRadius(filterRadius),
           invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
           filterTable(filterTable),
           filterTableSize(filterTableSize),
           maxSampleLuminance(maxSampleLuminance) {
-        pixels = std::vector<FilmTilePixel>(std::max(0, pixelBounds.Area()));
+        // Reuse the storage of _buffer_, if one is given
+        pixels = std::move(buffer);
+        pixels.assign(std::max(0, pixelBounds.Area()), FilmTilePixel());
     }
     void AddSample(const Point2f &pFilm, Spectrum L,
                    Float sampleWeight = 1.) {
@@ -240,8 +240,8 @@ void SamplerIntegrator::Render(const Scene &scene) {
         ParallelFor2D([&](Point2i tile) {
             // Render section of image corresponding to _tile_
 
-            // Allocate _MemoryArena_ for tile
-            MemoryArena arena;
+            // Use this thread's _MemoryArena_ for the tile
+            MemoryArena &arena = PerThreadArena();
 
             // Get sampler instance for tile
             int seed = tile.y * nTiles.x + tile.x;
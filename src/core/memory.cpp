@@ -33,9 +33,31 @@
 
 // core/memory.cpp*
 #include "memory.h"
+#include "stats.h"
+#include <mutex>
 
 namespace pbrt {
 
+STAT_MEMORY_COUNTER("Memory/Arena blocks allocated", arenaBytesAllocated);
+STAT_MEMORY_COUNTER("Memory/Arena blocks trimmed", arenaBytesTrimmed);
+// Size of an arena whenever it grows; the maximum is the largest any one
+// arena (and so any thread's PerThreadArena()) got
+STAT_INT_DISTRIBUTION("Memory/Arena size after growing (kB)", arenaSizeKB);
+STAT_COUNTER("Memory/Arena blocks reused", nArenaBlocksReused);
+
+// The arenas returned by PerThreadArena(), freed at exit
+static struct PerThreadArenas {
+    ~PerThreadArenas() {
+        for (MemoryArena *arena : arenas) {
+            arena->~MemoryArena();
+            FreeAligned(arena);
+        }
+    }
+    std::mutex mutex;
+    std::vector<MemoryArena *> arenas;
+} perThreadArenas;
+static PBRT_THREAD_LOCAL MemoryArena *perThreadArena;
+
 // Memory Allocation Functions
 void *AllocAligned(size_t size) {
 #if defined(PBRT_HAVE__ALIGNED_MALLOC)
@@ -58,4 +80,84 @@ void FreeAligned(void *ptr) {
 #endif
 }
 
+// MemoryArena Method Definitions
+MemoryArena::~MemoryArena() {
+    FreeAligned(currentBlock);
+    for (auto &block : usedBlocks) FreeAligned(block.second);
+    for (auto &blocks : freeBlocks)
+        for (uint8_t *block : blocks) FreeAligned(block);
+}
+
+void MemoryArena::NewBlock(size_t nBytes) {
+    // Add current block to _usedBlocks_ list
+    if (currentBlock)
+        usedBlocks.push_back(std::make_pair(currentAllocSize, currentBlock));
+    currentBlock = nullptr;
+    currentBlockPos = 0;
+
+    // Try to get the smallest large enough block from _freeBlocks_
+    int sizeClass = SizeClass(nBytes);
+    for (size_t c = sizeClass; c < freeBlocks.size(); ++c)
+        if (!freeBlocks[c].empty()) {
+            currentAllocSize = blockSize << c;
+            currentBlock = freeBlocks[c].back();
+            freeBlocks[c].pop_back();
+            ++nArenaBlocksReused;
+            return;
+        }
+
+    // Get new block of memory for _MemoryArena_
+    currentAllocSize = blockSize << sizeClass;
+    currentBlock = AllocAligned<uint8_t>(currentAllocSize);
+    totalAllocated += currentAllocSize;
+    arenaBytesAllocated += currentAllocSize;
+    ReportValue(arenaSizeKB, (int64_t)totalAllocated / 1024);
+}
+
+void MemoryArena::Reset() {
+    // Keep using the current block if it's the only one
+    if (usedBlocks.empty() && totalAllocated <= maxRetained) {
+        currentBlockPos = 0;
+        return;
+    }
+
+    // Return all blocks to _freeBlocks_
+    if (currentBlock)
+        usedBlocks.push_back(std::make_pair(currentAllocSize, currentBlock));
+    currentBlock = nullptr;
+    currentBlockPos = currentAllocSize = 0;
+    for (const auto &block : usedBlocks) {
+        size_t sizeClass = SizeClass(block.first);
+        if (sizeClass >= freeBlocks.size()) freeBlocks.resize(sizeClass + 1);
+        freeBlocks[sizeClass].push_back(block.second);
+    }
+    usedBlocks.clear();
+
+    // Don't keep more than _maxRetained_ bytes around for later use
+    if (totalAllocated > maxRetained) Trim(maxRetained);
+}
+
+// Frees unused blocks, the largest ones first, until the arena holds at
+// most _maxBytes_
+void MemoryArena::Trim(size_t maxBytes) {
+    for (int c = (int)freeBlocks.size() - 1;
+         c >= 0 && totalAllocated > maxBytes; --c)
+        while (!freeBlocks[c].empty() && totalAllocated > maxBytes) {
+            FreeAligned(freeBlocks[c].back());
+            freeBlocks[c].pop_back();
+            totalAllocated -= blockSize << c;
+            arenaBytesTrimmed += blockSize << c;
+        }
+}
+
+MemoryArena &PerThreadArena() {
+    if (!perThreadArena) {
+        // Allocate the arena aligned to a cache line, as declared
+        perThreadArena = new (AllocAligned(sizeof(MemoryArena))) MemoryArena;
+        std::lock_guard<std::mutex> lock(perThreadArenas.mutex);
+        perThreadArenas.arenas.push_back(perThreadArena);
+    }
+    return *perThreadArena;
+}
+
 }  // namespace pbrt
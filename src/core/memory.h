@@ -40,7 +40,7 @@
 
 // core/memory.h*
 #include "pbrt.h"
-#include <list>
+#include <vector>
 #include <cstddef>
 
 namespace pbrt {
@@ -61,12 +61,9 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
     MemoryArena {
   public:
     // MemoryArena Public Methods
-    MemoryArena(size_t blockSize = 262144) : blockSize(blockSize) {}
-    ~MemoryArena() {
-        FreeAligned(currentBlock);
-        for (auto &block : usedBlocks) FreeAligned(block.second);
-        for (auto &block : availableBlocks) FreeAligned(block.second);
-    }
+    MemoryArena(size_t blockSize = 262144, size_t maxRetained = 32 * 262144)
+        : blockSize(blockSize), maxRetained(std::max(maxRetained, blockSize)) {}
+    ~MemoryArena();
     void *Alloc(size_t nBytes) {
         // Round up _nBytes_ to minimum machine alignment
 #if __GNUC__ == 4 && __GNUC_MINOR__ < 9
@@ -81,33 +78,7 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
         static_assert(IsPowerOf2(align), "Minimum alignment not a power of two");
 #endif
         nBytes = (nBytes + align - 1) & ~(align - 1);
-        if (currentBlockPos + nBytes > currentAllocSize) {
-            // Add current block to _usedBlocks_ list
-            if (currentBlock) {
-                usedBlocks.push_back(
-                    std::make_pair(currentAllocSize, currentBlock));
-                currentBlock = nullptr;
-                currentAllocSize = 0;
-            }
-
-            // Get new block of memory for _MemoryArena_
-
-            // Try to get memory block from _availableBlocks_
-            for (auto iter = availableBlocks.begin();
-                 iter != availableBlocks.end(); ++iter) {
-                if (iter->first >= nBytes) {
-                    currentAllocSize = iter->first;
-                    currentBlock = iter->second;
-                    availableBlocks.erase(iter);
-                    break;
-                }
-            }
-            if (!currentBlock) {
-                currentAllocSize = std::max(nBytes, blockSize);
-                currentBlock = AllocAligned<uint8_t>(currentAllocSize);
-            }
-            currentBlockPos = 0;
-        }
+        if (currentBlockPos + nBytes > currentAllocSize) NewBlock(nBytes);
         void *ret = currentBlock + currentBlockPos;
         currentBlockPos += nBytes;
         return ret;
@@ -119,27 +90,40 @@ alignas(PBRT_L1_CACHE_LINE_SIZE)
             for (size_t i = 0; i < n; ++i) new (&ret[i]) T();
         return ret;
     }
-    void Reset() {
-        currentBlockPos = 0;
-        availableBlocks.splice(availableBlocks.begin(), usedBlocks);
-    }
-    size_t TotalAllocated() const {
-        size_t total = currentAllocSize;
-        for (const auto &alloc : usedBlocks) total += alloc.first;
-        for (const auto &alloc : availableBlocks) total += alloc.first;
-        return total;
-    }
+    void Reset();
+    void Trim(size_t maxBytes);
+    size_t TotalAllocated() const { return totalAllocated; }
 
   private:
     MemoryArena(const MemoryArena &) = delete;
     MemoryArena &operator=(const MemoryArena &) = delete;
+    // MemoryArena Private Methods
+    void NewBlock(size_t nBytes);
+    int SizeClass(size_t nBytes) const {
+        int sizeClass = 0;
+        while ((blockSize << sizeClass) < nBytes) ++sizeClass;
+        return sizeClass;
+    }
+
     // MemoryArena Private Data
-    const size_t blockSize;
+    const size_t blockSize, maxRetained;
     size_t currentBlockPos = 0, currentAllocSize = 0;
     uint8_t *currentBlock = nullptr;
-    std::list<std::pair<size_t, uint8_t *>> usedBlocks, availableBlocks;
+    size_t totalAllocated = 0;
+    std::vector<std::pair<size_t, uint8_t *>> usedBlocks;
+    // Blocks are _blockSize_ bytes, or the next power-of-two multiple of it
+    // that fits an allocation larger than that; the unused ones are kept
+    // in _freeBlocks_, indexed by that power
+    std::vector<std::vector<uint8_t *>> freeBlocks;
 };
 
+// Returns an arena that belongs to the calling thread and is kept until the
+// program exits, so that work done in many small pieces (e.g. image tiles)
+// doesn't create and free an arena for each one. It has to be _Reset()_
+// when a piece of work is done with it, and can't be used by two pieces of
+// work at once.
+MemoryArena &PerThreadArena();
+
 template <typename T, int logBlockSize>
 class BlockedArray {
   public:
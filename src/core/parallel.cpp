@@ -35,22 +35,27 @@
 #include "parallel.h"
 #include "memory.h"
 #include "stats.h"
-#include <list>
+#include <deque>
 #include <thread>
 #include <condition_variable>
+#include <cstdio>
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+#include <pthread.h>
+#include <sched.h>
+#include <cstring>
+#endif
 
 namespace pbrt {
 
 // Parallel Local Definitions
 static std::vector<std::thread> threads;
-static bool shutdownThreads = false;
-class ParallelForLoop;
-static ParallelForLoop *workList = nullptr;
-static std::mutex workListMutex;
+static std::atomic<bool> shutdownThreads{false};
 
 // Bookkeeping variables to help with the implementation of
 // MergeWorkerThreadStats().
-static std::atomic<bool> reportWorkerStats{false};
+// Incremented by the main thread whenever it wants the workers to report
+// their stats; each worker reports once per increment.
+static std::atomic<int> reportGeneration{0};
 // Number of workers that still need to report their stats.
 static std::atomic<int> reporterCount;
 // After kicking the workers to report their stats, the main thread waits
@@ -66,13 +71,15 @@ class ParallelForLoop {
         : func1D(std::move(func1D)),
           maxIndex(maxIndex),
           chunkSize(chunkSize),
-          profilerState(profilerState) {}
+          profilerState(profilerState),
+          remaining(maxIndex) {}
     ParallelForLoop(const std::function<void(Point2i)> &f, const Point2i &count,
                     uint64_t profilerState)
         : func2D(f),
           maxIndex(count.x * count.y),
           chunkSize(1),
-          profilerState(profilerState) {
+          profilerState(profilerState),
+          remaining(maxIndex) {
         nX = count.x;
     }
 
@@ -83,16 +90,55 @@ class ParallelForLoop {
     const int64_t maxIndex;
     const int chunkSize;
     uint64_t profilerState;
-    int64_t nextIndex = 0;
-    int activeWorkers = 0;
-    ParallelForLoop *next = nullptr;
+    // Number of iterations that haven't been run yet; the loop is
+    // finished (and may go out of scope) once it reaches zero.
+    std::atomic<int64_t> remaining;
     int nX = -1;
 
     // ParallelForLoop Private Methods
-    bool Finished() const {
-        return nextIndex >= maxIndex && activeWorkers == 0;
-    }
+    bool Finished() const { return remaining == 0; }
+};
+
+// A range of iterations _[begin, end)_ of a loop that hasn't been started.
+struct ParallelForTask {
+    ParallelForLoop *loop;
+    int64_t begin, end;
+};
+
+// Every thread has its own double-ended queue of tasks. The owner pushes
+// and pops at the back, so that it continues with the iterations right
+// after the ones it just ran, while other threads steal from the front,
+// where the largest ranges are. Each queue has its own lock, so that
+// threads only contend when they actually steal from each other, rather
+// than on every chunk of every loop as with a single global work list.
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<ParallelForTask> tasks;
+    // Number of tasks and the loop of the last one, readable without
+    // taking the lock
+    std::atomic<int> size{0};
+    std::atomic<const ParallelForLoop *> backLoop{nullptr};
+    // Keep the queues of different threads on different cache lines
+    char pad[64];
+};
+static std::vector<std::unique_ptr<WorkQueue>> workQueues;
+
+// Idle workers sleep on _workCondition_ until there is work to steal.
+static std::mutex workMutex;
+static std::condition_variable workCondition;
+static std::atomic<int> sleepingWorkers{0};
+
+// With _PbrtOptions.pinThreads_, the core and (densely numbered) NUMA node
+// each thread is pinned to, indexed by _ThreadIndex_
+struct ThreadPlacement {
+    int cpu, node;
 };
+static std::vector<ThreadPlacement> threadPlacements;
+static int nNumaNodes = 1;
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+// The main thread's affinity before ParallelInit(), restored on cleanup
+static cpu_set_t mainThreadCpus;
+#endif
 
 void Barrier::Wait() {
     std::unique_lock<std::mutex> lock(mutex);
@@ -107,11 +153,229 @@ void Barrier::Wait() {
         cv.wait(lock, [this] { return count == 0; });
 }
 
-static std::condition_variable workListCondition;
+static bool AnyQueuedWork() {
+    for (const auto &queue : workQueues)
+        if (queue->size > 0) return true;
+    return false;
+}
+
+static void PushTask(const ParallelForTask &task) {
+    WorkQueue &queue = *workQueues[ThreadIndex];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+        ++queue.size;
+        queue.backLoop = task.loop;
+    }
+    // Wake up a sleeping worker to steal it; the sleepers recheck the
+    // queue sizes after registering themselves, so none is missed.
+    if (sleepingWorkers > 0) {
+        std::lock_guard<std::mutex> lock(workMutex);
+        workCondition.notify_one();
+    }
+}
+
+// Takes a task from this thread's queue or, failing that, steals one from
+// another thread. With a non-null _loop_, only tasks of that loop are
+// taken: a thread waiting for its loop to finish only helps with that
+// loop, and thus never starts unrelated work in the middle of one of its
+// own loop iterations.
+static bool PopTask(const ParallelForLoop *loop, ParallelForTask *task) {
+    WorkQueue &ownQueue = *workQueues[ThreadIndex];
+    if (ownQueue.size > 0) {
+        std::lock_guard<std::mutex> lock(ownQueue.mutex);
+        if (!ownQueue.tasks.empty() &&
+            (!loop || ownQueue.tasks.back().loop == loop)) {
+            *task = ownQueue.tasks.back();
+            ownQueue.tasks.pop_back();
+            --ownQueue.size;
+            ownQueue.backLoop =
+                ownQueue.tasks.empty() ? nullptr : ownQueue.tasks.back().loop;
+            return true;
+        }
+    }
+
+    int nQueues = workQueues.size();
+    for (int i = 1; i < nQueues; ++i) {
+        WorkQueue &queue = *workQueues[(ThreadIndex + i) % nQueues];
+        if (queue.size == 0) continue;
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty() &&
+            (!loop || queue.tasks.front().loop == loop)) {
+            *task = queue.tasks.front();
+            queue.tasks.pop_front();
+            --queue.size;
+            if (queue.tasks.empty()) queue.backLoop = nullptr;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void RunTask(ParallelForTask task) {
+    ParallelForLoop &loop = *task.loop;
+    WorkQueue &ownQueue = *workQueues[ThreadIndex];
+    int64_t nRun = 0;
+    while (task.begin < task.end) {
+        // Keep the upper half of the range in the queue for the other
+        // threads to steal; it's split off again once the last piece was
+        // taken. This way the queue is only touched a few times per task,
+        // rather than for every chunk.
+        if (task.end - task.begin > loop.chunkSize &&
+            ownQueue.backLoop != &loop) {
+            int64_t mid = task.begin + (task.end - task.begin) / 2;
+            PushTask({&loop, mid, task.end});
+            task.end = mid;
+        }
+
+        // Run loop indices in the next chunk of _task_
+        int64_t chunkEnd = std::min(task.begin + loop.chunkSize, task.end);
+        for (int64_t index = task.begin; index < chunkEnd; ++index) {
+            uint64_t oldState = ProfilerState;
+            ProfilerState = loop.profilerState;
+            if (loop.func1D) {
+                loop.func1D(index);
+            }
+            // Handle other types of loops
+            else {
+                CHECK(loop.func2D);
+                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
+            }
+            ProfilerState = oldState;
+        }
+        nRun += chunkEnd - task.begin;
+        task.begin = chunkEnd;
+    }
+    // _loop_ may go out of scope as soon as this reaches zero
+    loop.remaining -= nRun;
+}
+
+// Enqueues all iterations of _loop_ and helps with them until all are
+// done; this works the same way for loops started inside of the
+// iterations of another loop.
+static void RunLoop(ParallelForLoop &loop) {
+    PushTask({&loop, 0, loop.maxIndex});
+    ParallelForTask task;
+    while (!loop.Finished()) {
+        if (PopTask(&loop, &task))
+            RunTask(task);
+        else
+            // The remaining iterations are running in other threads
+            std::this_thread::yield();
+    }
+}
+
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+// Parses a Linux CPU list such as "0-3,8,10-11".
+static std::vector<int> ParseCpuList(const char *str) {
+    std::vector<int> cpus;
+    while (*str) {
+        char *end;
+        int first = strtol(str, &end, 10);
+        if (end == str) break;
+        int last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+        }
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        str = (*end == ',') ? end + 1 : end;
+    }
+    return cpus;
+}
+
+// Returns the cores this process may run on, sorted by NUMA node, along
+// with their node; the nodes are renumbered to start at zero without gaps.
+static std::vector<ThreadPlacement> GetCpuTopology(int *nNodes) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        *nNodes = 0;
+        return {};
+    }
+
+    std::vector<ThreadPlacement> cpus;
+    *nNodes = 0;
+    // Nodes may be missing, e.g. with memory-only nodes, so look a bit
+    // beyond the first gap
+    for (int node = 0, misses = 0; misses < 64; ++node) {
+        std::string path = StringPrintf(
+            "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f) {
+            ++misses;
+            continue;
+        }
+        char buf[4096];
+        std::vector<int> nodeCpus;
+        if (fgets(buf, sizeof(buf), f)) nodeCpus = ParseCpuList(buf);
+        fclose(f);
+        bool any = false;
+        for (int cpu : nodeCpus)
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back({cpu, *nNodes});
+                any = true;
+            }
+        if (any) ++*nNodes;
+    }
+
+    if (cpus.empty()) {
+        // No NUMA information; treat the machine as a single node
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back({cpu, 0});
+        *nNodes = 1;
+    }
+    return cpus;
+}
+
+static void PinCurrentThread(int cpu) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0)
+        Warning("Unable to pin thread %d to CPU %d: %s", ThreadIndex, cpu,
+                strerror(err));
+}
+#endif  // PBRT_HAVE_PTHREAD_AFFINITY
+
+// Distributes the threads evenly over the available cores and nodes, such
+// that threads with neighbouring indices share a node.
+static void PlaceThreads(int nThreads) {
+    threadPlacements.clear();
+    nNumaNodes = 1;
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    int nNodes;
+    std::vector<ThreadPlacement> cpus = GetCpuTopology(&nNodes);
+    if (cpus.empty()) {
+        Warning("Unable to determine the CPU topology. Not pinning threads.");
+        return;
+    }
+    if (nThreads > (int)cpus.size())
+        Warning("%d threads for %d cores; some cores will run multiple "
+                "pinned threads.", nThreads, (int)cpus.size());
+    for (int i = 0; i < nThreads; ++i)
+        threadPlacements.push_back(
+            nThreads <= (int)cpus.size()
+                ? cpus[(int64_t)i * cpus.size() / nThreads]
+                : cpus[i % cpus.size()]);
+    nNumaNodes = 0;
+    for (const ThreadPlacement &placement : threadPlacements)
+        nNumaNodes = std::max(nNumaNodes, placement.node + 1);
+    LOG(INFO) << "Pinning " << nThreads << " threads to " << cpus.size()
+              << " cores on " << nNodes << " NUMA node(s)";
+#else
+    Warning("Pinning threads is not supported on this platform.");
+#endif
+}
 
 static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     LOG(INFO) << "Started execution in worker thread " << tIndex;
     ThreadIndex = tIndex;
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    if (!threadPlacements.empty())
+        PinCurrentThread(threadPlacements[tIndex].cpu);
+#endif
 
     // Give the profiler a chance to do per-thread initialization for
     // the worker thread before the profiling system actually stops running.
@@ -126,55 +390,30 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
     // the threads have cleared it.
     barrier.reset();
 
-    std::unique_lock<std::mutex> lock(workListMutex);
+    int reportedGeneration = 0;
+    ParallelForTask task;
     while (!shutdownThreads) {
-        if (reportWorkerStats) {
+        if (reportGeneration != reportedGeneration) {
+            reportedGeneration = reportGeneration;
             ReportThreadStats();
+            std::lock_guard<std::mutex> lock(reportDoneMutex);
             if (--reporterCount == 0)
                 // Once all worker threads have merged their stats, wake up
                 // the main thread.
                 reportDoneCondition.notify_one();
-            // Now sleep again.
-            workListCondition.wait(lock);
-        } else if (!workList) {
-            // Sleep until there are more tasks to run
-            workListCondition.wait(lock);
+        } else if (PopTask(nullptr, &task)) {
+            // Run a chunk of loop iterations
+            RunTask(task);
         } else {
-            // Get work from _workList_ and run loop iterations
-            ParallelForLoop &loop = *workList;
-
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            int64_t indexStart = loop.nextIndex;
-            int64_t indexEnd =
-                std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            for (int64_t index = indexStart; index < indexEnd; ++index) {
-                uint64_t oldState = ProfilerState;
-                ProfilerState = loop.profilerState;
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else {
-                    CHECK(loop.func2D);
-                    loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                }
-                ProfilerState = oldState;
-            }
-            lock.lock();
-
-            // Update _loop_ to reflect completion of iterations
-            loop.activeWorkers--;
-            if (loop.Finished()) workListCondition.notify_all();
+            // Sleep until there are more tasks to run
+            std::unique_lock<std::mutex> lock(workMutex);
+            ++sleepingWorkers;
+            workCondition.wait(lock, [&]() {
+                return shutdownThreads ||
+                       reportGeneration != reportedGeneration ||
+                       AnyQueuedWork();
+            });
+            --sleepingWorkers;
         }
     }
     LOG(INFO) << "Exiting worker thread " << tIndex;
@@ -183,59 +422,19 @@ static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
 // Parallel Definitions
 void ParallelFor(std::function<void(int64_t)> func, int64_t count,
                  int chunkSize) {
-    CHECK(threads.size() > 0 || MaxThreadIndex() == 1);
-
-    // Run iterations immediately if not using threads or if _count_ is small
+    // Run iterations immediately if not using threads or if _count_ is
+    // small. Scene construction code such as mesh creation and the BVH
+    // build also runs without the thread pool having been started, as in
+    // the unit tests, in which case the loop runs in this thread.
     if (threads.empty() || count < chunkSize) {
         for (int64_t i = 0; i < count; ++i) func(i);
         return;
     }
 
-    // Create and enqueue _ParallelForLoop_ for this loop
+    // Create and run _ParallelForLoop_ for this loop
     ParallelForLoop loop(std::move(func), count, chunkSize,
                          CurrentProfilerState());
-    workListMutex.lock();
-    loop.next = workList;
-    workList = &loop;
-    workListMutex.unlock();
-
-    // Notify worker threads of work to be done
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
-
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
-
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+    RunLoop(loop);
 }
 
 PBRT_THREAD_LOCAL int ThreadIndex;
@@ -254,52 +453,40 @@ void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count) {
     }
 
     ParallelForLoop loop(std::move(func), count, CurrentProfilerState());
-    {
-        std::lock_guard<std::mutex> lock(workListMutex);
-        loop.next = workList;
-        workList = &loop;
-    }
-
-    std::unique_lock<std::mutex> lock(workListMutex);
-    workListCondition.notify_all();
-
-    // Help out with parallel loop iterations in the current thread
-    while (!loop.Finished()) {
-        // Run a chunk of loop iterations for _loop_
-
-        // Find the set of loop iterations to run next
-        int64_t indexStart = loop.nextIndex;
-        int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+    RunLoop(loop);
+}
 
-        // Update _loop_ to reflect iterations this thread will run
-        loop.nextIndex = indexEnd;
-        if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-        loop.activeWorkers++;
+int NumSystemCores() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
 
-        // Run loop indices in _[indexStart, indexEnd)_
-        lock.unlock();
-        for (int64_t index = indexStart; index < indexEnd; ++index) {
-            uint64_t oldState = ProfilerState;
-            ProfilerState = loop.profilerState;
-            if (loop.func1D) {
-                loop.func1D(index);
-            }
-            // Handle other types of loops
-            else {
-                CHECK(loop.func2D);
-                loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-            }
-            ProfilerState = oldState;
-        }
-        lock.lock();
+int NumNumaNodes() { return nNumaNodes; }
 
-        // Update _loop_ to reflect completion of iterations
-        loop.activeWorkers--;
-    }
+int ThreadNumaNode() {
+    return (ThreadIndex < (int)threadPlacements.size())
+               ? threadPlacements[ThreadIndex].node
+               : 0;
 }
 
-int NumSystemCores() {
-    return std::max(1u, std::thread::hardware_concurrency());
+void ForEachNumaNode(std::function<void(int)> func) {
+    if (nNumaNodes <= 1) {
+        func(0);
+        return;
+    }
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    std::vector<std::thread> nodeThreads;
+    for (int node = 0; node < nNumaNodes; ++node)
+        nodeThreads.push_back(std::thread([&func, node]() {
+            // Run on any of the cores that threads of _node_ are pinned to
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (const ThreadPlacement &placement : threadPlacements)
+                if (placement.node == node) CPU_SET(placement.cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            func(node);
+        }));
+    for (std::thread &thread : nodeThreads) thread.join();
+#endif
 }
 
 void ParallelInit() {
@@ -313,6 +500,21 @@ void ParallelInit() {
     // started until after all worker threads have done that.
     std::shared_ptr<Barrier> barrier = std::make_shared<Barrier>(nThreads);
 
+    // One work queue per thread, including the main thread
+    for (int i = 0; i < nThreads; ++i)
+        workQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+
+    if (PbrtOptions.pinThreads) {
+        PlaceThreads(nThreads);
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+        if (!threadPlacements.empty()) {
+            pthread_getaffinity_np(pthread_self(), sizeof(mainThreadCpus),
+                                   &mainThreadCpus);
+            PinCurrentThread(threadPlacements[0].cpu);
+        }
+#endif
+    }
+
     // Launch one fewer worker thread than the total number we want doing
     // work, since the main thread helps out, too.
     for (int i = 0; i < nThreads - 1; ++i)
@@ -325,31 +527,38 @@ void ParallelCleanup() {
     if (threads.empty()) return;
 
     {
-        std::lock_guard<std::mutex> lock(workListMutex);
+        std::lock_guard<std::mutex> lock(workMutex);
         shutdownThreads = true;
-        workListCondition.notify_all();
+        workCondition.notify_all();
     }
 
     for (std::thread &thread : threads) thread.join();
     threads.erase(threads.begin(), threads.end());
+    workQueues.clear();
     shutdownThreads = false;
+
+#ifdef PBRT_HAVE_PTHREAD_AFFINITY
+    if (!threadPlacements.empty())
+        pthread_setaffinity_np(pthread_self(), sizeof(mainThreadCpus),
+                               &mainThreadCpus);
+#endif
+    threadPlacements.clear();
+    nNumaNodes = 1;
 }
 
 void MergeWorkerThreadStats() {
-    std::unique_lock<std::mutex> lock(workListMutex);
     std::unique_lock<std::mutex> doneLock(reportDoneMutex);
-    // Set up state so that the worker threads will know that we would like
-    // them to report their thread-specific stats when they wake up.
-    reportWorkerStats = true;
     reporterCount = threads.size();
-
-    // Wake up the worker threads.
-    workListCondition.notify_all();
+    {
+        // Ask the worker threads to report their thread-specific stats and
+        // wake up the sleeping ones.
+        std::lock_guard<std::mutex> lock(workMutex);
+        ++reportGeneration;
+        workCondition.notify_all();
+    }
 
     // Wait for all of them to merge their stats.
-    reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
-
-    reportWorkerStats = false;
+    reportDoneCondition.wait(doneLock, []() { return reporterCount == 0; });
 }
 
 }  // namespace pbrt
@@ -105,6 +105,15 @@ void ParallelFor2D(std::function<void(Point2i)> func, const Point2i &count);
 int MaxThreadIndex();
 int NumSystemCores();
 
+// With _PbrtOptions.pinThreads_, ParallelInit() pins every thread to a core.
+// The NUMA nodes of these cores are numbered from zero; without pinning,
+// everything is on node zero.
+int NumNumaNodes();
+int ThreadNumaNode();
+// Runs _func(node)_ for all nodes in parallel, each on a thread running on
+// that node, e.g. to first-touch memory there. Returns once all are done.
+void ForEachNumaNode(std::function<void(int)> func);
+
 void ParallelInit();
 void ParallelCleanup();
 void MergeWorkerThreadStats();
@@ -172,6 +172,8 @@ void ParamSet::AddSampledSpectrumFiles(const std::string &name,
                                        const char **names, int nValues) {
     EraseSpectrum(name);
     std::unique_ptr<Spectrum[]> s(new Spectrum[nValues]);
+    // Included files may be parsed on several threads at once
+    std::lock_guard<std::mutex> lock(cachedSpectraMutex);
     for (int i = 0; i < nValues; ++i) {
         std::string fn = AbsolutePath(ResolveFilename(names[i]));
         if (cachedSpectra.find(fn) != cachedSpectra.end()) {
@@ -208,6 +210,7 @@ void ParamSet::AddSampledSpectrumFiles(const std::string &name,
 }
 
 std::map<std::string, Spectrum> ParamSet::cachedSpectra;
+std::mutex ParamSet::cachedSpectraMutex;
 void ParamSet::AddString(const std::string &name,
                          std::unique_ptr<std::string[]> values, int nValues) {
     EraseString(name);
@@ -474,6 +477,65 @@ void ParamSet::Clear() {
 #undef DEL_PARAMS
 }
 
+// Two 64-bit multiply-xorshift lanes over the data, eight bytes at a time
+class ParamSetHasher {
+  public:
+    void Mix(uint64_t v) {
+        hash[0] = (hash[0] ^ v) * 0xff51afd7ed558ccdull;
+        hash[0] ^= hash[0] >> 32;
+        hash[1] = (hash[1] + v) * 0xc4ceb9fe1a85ec53ull;
+        hash[1] ^= hash[1] >> 29;
+    }
+    void MixBytes(const void *data, size_t size) {
+        Mix(size);
+        const char *ptr = (const char *)data;
+        for (; size >= 8; ptr += 8, size -= 8) {
+            uint64_t v;
+            memcpy(&v, ptr, 8);
+            Mix(v);
+        }
+        uint64_t v = 0;
+        memcpy(&v, ptr, size);
+        Mix(v);
+    }
+    template <typename T>
+    void MixItems(const std::vector<std::shared_ptr<ParamSetItem<T>>> &items) {
+        Mix(items.size());
+        for (const auto &item : items) {
+            MixBytes(item->name.data(), item->name.size());
+            MixBytes(item->values.get(), item->nValues * sizeof(T));
+        }
+    }
+    void MixItems(
+        const std::vector<std::shared_ptr<ParamSetItem<std::string>>> &items) {
+        Mix(items.size());
+        for (const auto &item : items) {
+            MixBytes(item->name.data(), item->name.size());
+            Mix(item->nValues);
+            for (int i = 0; i < item->nValues; ++i)
+                MixBytes(item->values[i].data(), item->values[i].size());
+        }
+    }
+
+    uint64_t hash[2] = {0x9e3779b97f4a7c15ull, 0x2545f4914f6cdd1dull};
+};
+
+std::pair<uint64_t, uint64_t> ParamSet::Hash() const {
+    ParamSetHasher hasher;
+    hasher.MixItems(ints);
+    hasher.MixItems(bools);
+    hasher.MixItems(floats);
+    hasher.MixItems(point2fs);
+    hasher.MixItems(vector2fs);
+    hasher.MixItems(point3fs);
+    hasher.MixItems(vector3fs);
+    hasher.MixItems(normals);
+    hasher.MixItems(spectra);
+    hasher.MixItems(strings);
+    hasher.MixItems(textures);
+    return std::make_pair(hasher.hash[0], hasher.hash[1]);
+}
+
 std::string ParamSet::ToString() const {
     std::string ret;
     size_t i;
@@ -46,6 +46,7 @@
 #include "spectrum.h"
 #include <stdio.h>
 #include <map>
+#include <mutex>
 
 namespace pbrt {
 
@@ -117,6 +118,9 @@ class ParamSet {
     const std::string *FindString(const std::string &, int *nValues) const;
     void ReportUnused() const;
     void Clear();
+    // Hash of all of the parameters' names and values, which is used to
+    // recognize repeated shapes without holding on to their parameters.
+    std::pair<uint64_t, uint64_t> Hash() const;
     std::string ToString() const;
     void Print(int indent) const;
 
@@ -137,6 +141,7 @@ class ParamSet {
     std::vector<std::shared_ptr<ParamSetItem<std::string>>> strings;
     std::vector<std::shared_ptr<ParamSetItem<std::string>>> textures;
     static std::map<std::string, Spectrum> cachedSpectra;
+    static std::mutex cachedSpectraMutex;
 };
 
 template <typename T>
@@ -36,6 +36,7 @@
 #include "fileutil.h"
 #include "memory.h"
 #include "paramset.h"
+#include "parallel.h"
 #include "stats.h"
 
 #include <ctype.h>
@@ -50,6 +51,7 @@
 #elif defined(PBRT_IS_WINDOWS)
 #include <windows.h>  // Windows file mapping API
 #endif
+#include <algorithm>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -59,7 +61,8 @@
 
 namespace pbrt {
 
-Loc *parserLoc;
+PBRT_THREAD_LOCAL Loc *parserLoc;
+PBRT_THREAD_LOCAL bool parsingAhead;
 
 static std::string toString(string_view s) {
     return std::string(s.data(), s.size());
@@ -319,7 +322,146 @@ string_view Tokenizer::Next() {
     }
 }
 
+// Converts the decimal number at _p_ the way strtol() would if it's a plain
+// integer and the way strtof() (strtod() if Float is double) would
+// otherwise, along the lines of the fast_float library's fast path: the
+// significant digits are accumulated in a 64-bit integer and scaled by an
+// exactly representable power of ten. Returns false, leaving the work to
+// those functions, for anything that this can't convert to the same value
+// with certainty, and for anything that isn't a number token.
+static bool parseDecimal(const char *p, const char *end, double *value,
+                         const char **next) {
+    static const double powersOfTen[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    auto isDigit = [](char ch) { return ch >= '0' && ch <= '9'; };
+
+    bool negative = false, isInteger = true;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+        isInteger = false;
+    }
+    uint64_t mantissa = 0;
+    int nDigits = 0, nSignificant = 0, exponent = 0;
+    for (; p < end && isDigit(*p); ++p, ++nDigits) {
+        if (mantissa == 0 && *p == '0') continue;
+        if (++nSignificant > 19) return false;
+        mantissa = 10 * mantissa + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        isInteger = false;
+        for (++p; p < end && isDigit(*p); ++p, ++nDigits) {
+            --exponent;
+            if (mantissa == 0 && *p == '0') continue;
+            if (++nSignificant > 19) return false;
+            mantissa = 10 * mantissa + (*p - '0');
+        }
+    }
+    if (nDigits == 0) return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        isInteger = false;
+        ++p;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+        if (p == end || !isDigit(*p)) return false;
+        int e = 0;
+        for (; p < end && isDigit(*p); ++p) {
+            if (e > 1000) return false;
+            e = 10 * e + (*p - '0');
+        }
+        exponent += negativeExponent ? -e : e;
+    }
+    // The number has to end where the tokenizer ends a token.
+    if (p < end && *p != ' ' && *p != '\n' && *p != '\t' && *p != '\r' &&
+        *p != '"' && *p != '[' && *p != ']')
+        return false;
+    *next = p;
+
+    if (isInteger) {
+        if (mantissa > (uint64_t)std::numeric_limits<long>::max())
+            return false;
+        *value = double(mantissa);
+        return true;
+    }
+    if (mantissa == 0) {
+        *value = negative ? -0. : 0.;
+        return true;
+    }
+    if (exponent < -22 || exponent > 22) return false;
+    // Both operands are exact if the mantissa fits in a double, so the
+    // result is then correctly rounded.
+    bool exact = mantissa <= (uint64_t(1) << 53);
+    double v = double(mantissa);
+    v = exponent < 0 ? v / powersOfTen[-exponent] : v * powersOfTen[exponent];
+    if (sizeof(Float) == sizeof(float)) {
+        // Rounding _v_ to float gives the correctly rounded float unless
+        // _v_ is (or, if it's not exact, may be off by a couple of ulps
+        // from) a midpoint between two floats, where the low 29 bits of
+        // its significand are 1 followed by zeros.
+        if (v < std::numeric_limits<float>::min() ||
+            v > std::numeric_limits<float>::max())
+            return false;
+        int64_t low = FloatToBits(v) & ((uint64_t(1) << 29) - 1);
+        int64_t fromMidpoint = std::abs(low - (int64_t(1) << 28));
+        if (fromMidpoint <= (exact ? 0 : 4)) return false;
+        v = float(v);
+    } else if (!exact)
+        return false;
+    *value = negative ? -v : v;
+    return true;
+}
+
+size_t Tokenizer::ParseNumbers(double *values, size_t maxValues) {
+    size_t n = 0;
+    while (n < maxValues) {
+        while (pos < end &&
+               (*pos == ' ' || *pos == '\n' || *pos == '\t' || *pos == '\r')) {
+            if (*pos++ == '\n') {
+                ++loc.line;
+                loc.column = 0;
+            } else
+                ++loc.column;
+        }
+        const char *next;
+        if (pos == end || !parseDecimal(pos, end, &values[n], &next)) break;
+        loc.column += next - pos;
+        pos = next;
+        ++n;
+    }
+    return n;
+}
+
+bool Tokenizer::Contains(const char *str) const {
+    ptrdiff_t length = strlen(str);
+    if (length == 0) return true;
+    for (const char *p = pos; end - p >= length; ++p) {
+        p = (const char *)memchr(p, str[0], end - p);
+        if (!p || end - p < length) return false;
+        if (memcmp(p, str, length) == 0) return true;
+    }
+    return false;
+}
+
+bool Tokenizer::SkipArray() {
+    const char *close = (const char *)memchr(pos, ']', end - pos);
+    if (!close) return false;
+    int lines = std::count(pos, close, '\n');
+    if (lines > 0) {
+        loc.line += lines;
+        loc.column = 0;
+    }
+    loc.column += 1;
+    pos = close + 1;
+    return true;
+}
+
 static double parseNumber(string_view str) {
+    double fastVal;
+    const char *next;
+    if (parseDecimal(str.begin(), str.end(), &fastVal, &next) &&
+        next == str.end())
+        return fastVal;
+
     // Fast path for a single digit
     if (str.size() == 1) {
         if (!(str[0] >= '0' && str[0] <= '9')) {
@@ -708,9 +850,9 @@ static void AddParam(ParamSet &ps, const ParamListItem &item,
         Warning("Type of parameter \"%s\" is unknown", item.name.c_str());
 }
 
-template <typename Next, typename Unget>
-ParamSet parseParams(Next nextToken, Unget ungetToken, MemoryArena &arena,
-                     SpectrumType spectrumType) {
+template <typename Next, typename Unget, typename Numbers>
+ParamSet parseParams(Next nextToken, Unget ungetToken, Numbers parseNumbers,
+                     MemoryArena &arena, SpectrumType spectrumType) {
     ParamSet ps;
     while (true) {
         string_view decl = nextToken(TokenOptional);
@@ -725,6 +867,16 @@ ParamSet parseParams(Next nextToken, Unget ungetToken, MemoryArena &arena,
         item.name = toString(dequoteString(decl));
         size_t nAlloc = 0;
 
+        auto reserveDouble = [&]() {
+            if (item.size == nAlloc) {
+                nAlloc = std::max<size_t>(2 * item.size, 4);
+                double *newData = arena.Alloc<double>(nAlloc);
+                std::copy(item.doubleValues, item.doubleValues + item.size,
+                          newData);
+                item.doubleValues = newData;
+            }
+        };
+
         auto addVal = [&](string_view val) {
             if (isQuotedString(val)) {
                 if (item.doubleValues) {
@@ -750,21 +902,33 @@ ParamSet parseParams(Next nextToken, Unget ungetToken, MemoryArena &arena,
                     exit(1);
                 }
 
-                if (item.size == nAlloc) {
-                    nAlloc = std::max<size_t>(2 * item.size, 4);
-                    double *newData = arena.Alloc<double>(nAlloc);
-                    std::copy(item.doubleValues, item.doubleValues + item.size,
-                              newData);
-                    item.doubleValues = newData;
-                }
+                reserveDouble();
                 item.doubleValues[item.size++] = parseNumber(val);
             }
         };
 
+        // Converts the numbers that follow directly into the array,
+        // rather than going through the tokens one at a time.
+        auto addNumbers = [&]() {
+            if (item.stringValues) return;
+            if (!item.doubleValues) {
+                double first;
+                if (parseNumbers(&first, 1) == 0) return;
+                reserveDouble();
+                item.doubleValues[item.size++] = first;
+            }
+            do {
+                reserveDouble();
+                item.size += parseNumbers(item.doubleValues + item.size,
+                                          nAlloc - item.size);
+            } while (item.size == nAlloc);
+        };
+
         string_view val = nextToken(TokenRequired);
 
         if (val == "[") {
             while (true) {
+                addNumbers();
                 val = nextToken(TokenRequired);
                 if (val == "]") break;
                 addVal(val);
@@ -782,14 +946,89 @@ ParamSet parseParams(Next nextToken, Unget ungetToken, MemoryArena &arena,
 
 extern int catIndentCount;
 
+// Files included by the main scene file are parsed ahead on the thread
+// pool, a batch at a time. Parsing them only records the API calls that
+// they make, which are then made when the main file's parser reaches the
+// Include, so the scene is built in the same order as when parsing
+// serially.
+struct RecordedCall {
+    Loc loc;  // No filename if there was no location
+    std::function<void()> call;
+};
+
+struct IncludeJob {
+    std::string filename;
+    bool parsed = false;
+    // Parsing it ahead reported a problem; it's parsed serially instead
+    bool failed = false;
+    std::vector<RecordedCall> calls;
+};
+
+static void parse(std::unique_ptr<Tokenizer> t,
+                  std::vector<RecordedCall> *record = nullptr,
+                  std::vector<IncludeJob> *includes = nullptr);
+
+// Returns the files that the given scene file includes itself, in order.
+// This is only a quick scan: files without an "Include" aren't lexed at all,
+// and the values of parameter lists are skipped over. If it gets something
+// wrong, parse() notices that it's out of step and parses serially.
+static std::vector<IncludeJob> findIncludes(const std::string &filename) {
+    std::vector<IncludeJob> includes;
+    auto tokError = [](const char *msg) {};
+    std::unique_ptr<Tokenizer> t = Tokenizer::CreateFromFile(filename, tokError);
+    if (!t || !t->Contains("Include")) return includes;
+    string_view tok;
+    while (!(tok = t->Next()).empty())
+        if (tok == "[") {
+            if (!t->SkipArray()) break;
+        } else if (tok == "Include") {
+            string_view name = t->Next();
+            if (!isQuotedString(name)) break;
+            IncludeJob job;
+            job.filename =
+                AbsolutePath(ResolveFilename(toString(dequoteString(name))));
+            includes.push_back(std::move(job));
+        }
+    return includes;
+}
+
+static void parseIncludesAhead(std::vector<IncludeJob> &includes,
+                               size_t first) {
+    size_t end = std::min(includes.size(), first + 4 * MaxThreadIndex());
+    ParallelFor([&](int64_t i) {
+        IncludeJob &job = includes[first + i];
+        auto tokError = [](const char *msg) { Error("%s", msg); };
+        parsingAhead = true;
+        try {
+            std::unique_ptr<Tokenizer> t =
+                Tokenizer::CreateFromFile(job.filename, tokError);
+            if (t) parse(std::move(t), &job.calls);
+        } catch (const ParseAheadAbandoned &) {
+            std::vector<RecordedCall>().swap(job.calls);
+            job.failed = true;
+        }
+        parsingAhead = false;
+        job.parsed = true;
+    }, end - first);
+}
+
 // Parsing Global Interface
-static void parse(std::unique_ptr<Tokenizer> t) {
+
+// Makes the API calls for the tokens from _t_, or only appends them to
+// _record_ if it's not nullptr. _includes_ are the files that _t_'s file
+// includes, if they are to be parsed ahead.
+static void parse(std::unique_ptr<Tokenizer> t,
+                  std::vector<RecordedCall> *record,
+                  std::vector<IncludeJob> *includes) {
     std::vector<std::unique_ptr<Tokenizer>> fileStack;
     fileStack.push_back(std::move(t));
     parserLoc = &fileStack.back()->loc;
 
     bool ungetTokenSet = false;
     std::string ungetTokenValue;
+    // Included files can only be replayed from where a new statement starts
+    bool atStatementStart = false;
+    size_t nextInclude = 0;
 
     // nextToken is a little helper function that handles the file stack,
     // returning the next token from the current file until reaching EOF,
@@ -818,10 +1057,36 @@ static void parse(std::unique_ptr<Tokenizer> t) {
             if (!fileStack.empty()) parserLoc = &fileStack.back()->loc;
             return nextToken(flags);
         } else if (tok == "Include") {
-            // Switch to the given file.
+            bool replay = atStatementStart && fileStack.size() == 1;
             std::string filename =
                 toString(dequoteString(nextToken(TokenRequired)));
             filename = AbsolutePath(ResolveFilename(filename));
+            IncludeJob *job = nullptr;
+            if (includes && fileStack.size() == 1) {
+                if (nextInclude < includes->size() &&
+                    (*includes)[nextInclude].filename == filename)
+                    job = &(*includes)[nextInclude++];
+                else
+                    // Out of step with the scan; parse the rest serially
+                    includes = nullptr;
+            }
+            if (job && replay && !job->parsed)
+                parseIncludesAhead(*includes, job - &(*includes)[0]);
+            if (job && replay && !job->failed) {
+                // Make the calls of the file that was parsed ahead
+                for (RecordedCall &c : job->calls) {
+                    parserLoc = c.loc.filename.empty() ? nullptr : &c.loc;
+                    c.call();
+                }
+                std::vector<RecordedCall>().swap(job->calls);
+                parserLoc = &fileStack.back()->loc;
+                atStatementStart = true;
+                return nextToken(flags);
+            } else if (job)
+                // Included in the middle of a statement; it's parsed below
+                std::vector<RecordedCall>().swap(job->calls);
+
+            // Switch to the given file.
             auto tokError = [](const char *msg) { Error("%s", msg); };
             std::unique_ptr<Tokenizer> tinc =
                 Tokenizer::CreateFromFile(filename, tokError);
@@ -836,9 +1101,27 @@ static void parse(std::unique_ptr<Tokenizer> t) {
             if (PbrtOptions.cat || PbrtOptions.toPly)
                 printf("%*s%s\n", catIndentCount, "", toString(tok).c_str());
             return nextToken(flags);
-        } else
+        } else {
             // Regular token; success.
+            atStatementStart = false;
             return tok;
+        }
+    };
+
+    // Makes an API call now, or records it
+    auto apiCall = [&](std::function<void()> call) {
+        if (record)
+            record->push_back(
+                RecordedCall{parserLoc ? *parserLoc : Loc(), std::move(call)});
+        else
+            call();
+    };
+
+    // Bulk conversion of numbers from the current file; tokens that it
+    // stops at are left to nextToken.
+    auto parseNumbers = [&](double *values, size_t maxValues) -> size_t {
+        if (ungetTokenSet || fileStack.empty()) return 0;
+        return fileStack.back()->ParseNumbers(values, maxValues);
     };
 
     auto ungetToken = [&](string_view s) {
@@ -858,8 +1141,9 @@ static void parse(std::unique_ptr<Tokenizer> t) {
         string_view dequoted = dequoteString(token);
         std::string n = toString(dequoted);
         ParamSet params =
-            parseParams(nextToken, ungetToken, arena, spectrumType);
-        apiFunc(n, std::move(params));
+            parseParams(nextToken, ungetToken, parseNumbers, arena,
+                        spectrumType);
+        apiCall([=]() { apiFunc(n, params); });
     };
 
     auto syntaxError = [&](string_view tok) {
@@ -868,23 +1152,24 @@ static void parse(std::unique_ptr<Tokenizer> t) {
     };
 
     while (true) {
+        atStatementStart = true;
         string_view tok = nextToken(TokenOptional);
         if (tok.empty()) break;
 
         switch (tok[0]) {
         case 'A':
             if (tok == "AttributeBegin")
-                pbrtAttributeBegin();
+                apiCall(pbrtAttributeBegin);
             else if (tok == "AttributeEnd")
-                pbrtAttributeEnd();
+                apiCall(pbrtAttributeEnd);
             else if (tok == "ActiveTransform") {
                 string_view a = nextToken(TokenRequired);
                 if (a == "All")
-                    pbrtActiveTransformAll();
+                    apiCall(pbrtActiveTransformAll);
                 else if (a == "EndTime")
-                    pbrtActiveTransformEndTime();
+                    apiCall(pbrtActiveTransformEndTime);
                 else if (a == "StartTime")
-                    pbrtActiveTransformStartTime();
+                    apiCall(pbrtActiveTransformStartTime);
                 else
                     syntaxError(tok);
             } else if (tok == "AreaLightSource")
@@ -904,13 +1189,15 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 for (int i = 0; i < 16; ++i)
                     m[i] = parseNumber(nextToken(TokenRequired));
                 if (nextToken(TokenRequired) != "]") syntaxError(tok);
-                pbrtConcatTransform(m);
+                apiCall([=]() mutable { pbrtConcatTransform(m); });
             } else if (tok == "CoordinateSystem") {
                 string_view n = dequoteString(nextToken(TokenRequired));
-                pbrtCoordinateSystem(toString(n));
+                std::string name = toString(n);
+                apiCall([=]() { pbrtCoordinateSystem(name); });
             } else if (tok == "CoordSysTransform") {
                 string_view n = dequoteString(nextToken(TokenRequired));
-                pbrtCoordSysTransform(toString(n));
+                std::string name = toString(n);
+                apiCall([=]() { pbrtCoordSysTransform(name); });
             } else if (tok == "Camera")
                 basicParamListEntrypoint(SpectrumType::Reflectance, pbrtCamera);
             else
@@ -931,7 +1218,7 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 basicParamListEntrypoint(SpectrumType::Reflectance,
                                          pbrtIntegrator);
             else if (tok == "Identity")
-                pbrtIdentity();
+                apiCall(pbrtIdentity);
             else
                 syntaxError(tok);
             break;
@@ -944,8 +1231,10 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 Float v[9];
                 for (int i = 0; i < 9; ++i)
                     v[i] = parseNumber(nextToken(TokenRequired));
-                pbrtLookAt(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7],
-                           v[8]);
+                apiCall([=]() {
+                    pbrtLookAt(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7],
+                               v[8]);
+                });
             } else
                 syntaxError(tok);
             break;
@@ -977,7 +1266,7 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 } else
                     names[1] = names[0];
 
-                pbrtMediumInterface(names[0], names[1]);
+                apiCall([=]() { pbrtMediumInterface(names[0], names[1]); });
             } else
                 syntaxError(tok);
             break;
@@ -985,7 +1274,8 @@ static void parse(std::unique_ptr<Tokenizer> t) {
         case 'N':
             if (tok == "NamedMaterial") {
                 string_view n = dequoteString(nextToken(TokenRequired));
-                pbrtNamedMaterial(toString(n));
+                std::string name = toString(n);
+                apiCall([=]() { pbrtNamedMaterial(name); });
             } else
                 syntaxError(tok);
             break;
@@ -993,12 +1283,14 @@ static void parse(std::unique_ptr<Tokenizer> t) {
         case 'O':
             if (tok == "ObjectBegin") {
                 string_view n = dequoteString(nextToken(TokenRequired));
-                pbrtObjectBegin(toString(n));
+                std::string name = toString(n);
+                apiCall([=]() { pbrtObjectBegin(name); });
             } else if (tok == "ObjectEnd")
-                pbrtObjectEnd();
+                apiCall(pbrtObjectEnd);
             else if (tok == "ObjectInstance") {
                 string_view n = dequoteString(nextToken(TokenRequired));
-                pbrtObjectInstance(toString(n));
+                std::string name = toString(n);
+                apiCall([=]() { pbrtObjectInstance(name); });
             } else
                 syntaxError(tok);
             break;
@@ -1013,12 +1305,12 @@ static void parse(std::unique_ptr<Tokenizer> t) {
 
         case 'R':
             if (tok == "ReverseOrientation")
-                pbrtReverseOrientation();
+                apiCall(pbrtReverseOrientation);
             else if (tok == "Rotate") {
                 Float v[4];
                 for (int i = 0; i < 4; ++i)
                     v[i] = parseNumber(nextToken(TokenRequired));
-                pbrtRotate(v[0], v[1], v[2], v[3]);
+                apiCall([=]() { pbrtRotate(v[0], v[1], v[2], v[3]); });
             } else
                 syntaxError(tok);
             break;
@@ -1033,33 +1325,33 @@ static void parse(std::unique_ptr<Tokenizer> t) {
                 Float v[3];
                 for (int i = 0; i < 3; ++i)
                     v[i] = parseNumber(nextToken(TokenRequired));
-                pbrtScale(v[0], v[1], v[2]);
+                apiCall([=]() { pbrtScale(v[0], v[1], v[2]); });
             } else
                 syntaxError(tok);
             break;
 
         case 'T':
             if (tok == "TransformBegin")
-                pbrtTransformBegin();
+                apiCall(pbrtTransformBegin);
             else if (tok == "TransformEnd")
-                pbrtTransformEnd();
+                apiCall(pbrtTransformEnd);
             else if (tok == "Transform") {
                 if (nextToken(TokenRequired) != "[") syntaxError(tok);
                 Float m[16];
                 for (int i = 0; i < 16; ++i)
                     m[i] = parseNumber(nextToken(TokenRequired));
                 if (nextToken(TokenRequired) != "]") syntaxError(tok);
-                pbrtTransform(m);
+                apiCall([=]() mutable { pbrtTransform(m); });
             } else if (tok == "Translate") {
                 Float v[3];
                 for (int i = 0; i < 3; ++i)
                     v[i] = parseNumber(nextToken(TokenRequired));
-                pbrtTranslate(v[0], v[1], v[2]);
+                apiCall([=]() { pbrtTranslate(v[0], v[1], v[2]); });
             } else if (tok == "TransformTimes") {
                 Float v[2];
                 for (int i = 0; i < 2; ++i)
                     v[i] = parseNumber(nextToken(TokenRequired));
-                pbrtTransformTimes(v[0], v[1]);
+                apiCall([=]() { pbrtTransformTimes(v[0], v[1]); });
             } else if (tok == "Texture") {
                 string_view n = dequoteString(nextToken(TokenRequired));
                 std::string name = toString(n);
@@ -1068,7 +1360,7 @@ static void parse(std::unique_ptr<Tokenizer> t) {
 
                 basicParamListEntrypoint(
                     SpectrumType::Reflectance,
-                    [&](const std::string &texName, const ParamSet &params) {
+                    [=](const std::string &texName, const ParamSet &params) {
                         pbrtTexture(name, type, texName, params);
                     });
             } else
@@ -1077,9 +1369,9 @@ static void parse(std::unique_ptr<Tokenizer> t) {
 
         case 'W':
             if (tok == "WorldBegin")
-                pbrtWorldBegin();
+                apiCall(pbrtWorldBegin);
             else if (tok == "WorldEnd")
-                pbrtWorldEnd();
+                apiCall(pbrtWorldEnd);
             else
                 syntaxError(tok);
             break;
@@ -1097,7 +1389,11 @@ void pbrtParseFile(std::string filename) {
     std::unique_ptr<Tokenizer> t =
         Tokenizer::CreateFromFile(filename, tokError);
     if (!t) return;
-    parse(std::move(t));
+    std::vector<IncludeJob> includes;
+    if (filename != "-" && !PbrtOptions.cat && !PbrtOptions.toPly &&
+        MaxThreadIndex() > 1)
+        includes = findIncludes(filename);
+    parse(std::move(t), nullptr, includes.empty() ? nullptr : &includes);
 }
 
 void pbrtParseString(std::string str) {
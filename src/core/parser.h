@@ -57,8 +57,16 @@ struct Loc {
     int line = 1, column = 0;
 };
 
-// If not nullptr, stores the current file location of the parser.
-extern Loc *parserLoc;
+// If not nullptr, stores the current file location of the parser. Per
+// thread, since included files may be parsed in parallel.
+extern PBRT_THREAD_LOCAL Loc *parserLoc;
+
+// Set on a thread while it parses an included file ahead. Error() and
+// Warning() then throw _ParseAheadAbandoned_ instead of printing; the file
+// is parsed again when the main file reaches it, so that the messages come
+// out in order and fatal errors stop the parse where they would have.
+extern PBRT_THREAD_LOCAL bool parsingAhead;
+struct ParseAheadAbandoned {};
 
 // Reimplement enough of absl/std::string_view as needed for the below
 // (Bringing on the abseil dependency at this point just for this seems
@@ -114,6 +122,22 @@ class Tokenizer {
     // string_view is not guaranteed to be valid after next call to Next().
     string_view Next();
 
+    // Converts the run of numbers starting at the current position, as in
+    // a parameter's list of values, directly into _values_, stopping
+    // after _maxValues_ of them or before the first token that isn't a
+    // number (or that needs the general number parsing). Returns how many
+    // were converted.
+    size_t ParseNumbers(double *values, size_t maxValues);
+
+    // Returns whether _str_ appears anywhere in the rest of the input,
+    // without moving ahead.
+    bool Contains(const char *str) const;
+
+    // Moves to just past the next ']', as after a parameter's list of
+    // values, without lexing the tokens in between (so a ']' inside a
+    // string or comment ends it early). Returns false if there is none.
+    bool SkipArray();
+
     Loc loc;
 
   private:
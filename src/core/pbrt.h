@@ -174,8 +174,15 @@ struct Options {
     int nThreads = 0;
     bool quickRender = false;
     bool quiet = false;
+    bool pinThreads = false;
     bool cat = false, toPly = false;
+    // With _toPly_: write binary mesh files instead of PLY files
+    bool toBinaryMesh = false;
     std::string imageFile;
+    // Where snapshots of the rendering progress are written while
+    // rendering: a file, or "unix:<path>" for a Unix domain socket
+    std::string telemetry;
+    Float telemetryInterval = 10;
     // x0, x1, y0, y1
     Float cropWindow[2][2];
 };
@@ -35,6 +35,7 @@
 #include "primitive.h"
 #include "light.h"
 #include "interaction.h"
+#include "parallel.h"
 #include "stats.h"
 
 namespace pbrt {
@@ -43,6 +44,15 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+void Primitive::IntersectBatch(const Ray *rays, int n,
+                               SurfaceInteraction *isects, bool *hits) const {
+    for (int i = 0; i < n; ++i) hits[i] = Intersect(rays[i], &isects[i]);
+}
+
+void Primitive::IntersectPBatch(const Ray *rays, int n, bool *occluded) const {
+    for (int i = 0; i < n; ++i) occluded[i] = IntersectP(rays[i]);
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
@@ -151,4 +161,26 @@ void GeometricPrimitive::ComputeScatteringFunctions(
     CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
 }
 
+std::vector<std::shared_ptr<Primitive>> CreateGeometricPrimitives(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material, const MediumInterface &mi) {
+    // The primitives are allocated a block at a time; the pointers handed
+    // out share ownership of their block.
+    PBRT_CONSTEXPR int blockSize = 4096;
+    int nShapes = shapes.size();
+    std::vector<std::shared_ptr<Primitive>> prims(nShapes);
+    ParallelFor([&](int64_t b) {
+        int start = b * blockSize;
+        int end = std::min(start + blockSize, nShapes);
+        std::shared_ptr<std::vector<GeometricPrimitive>> block =
+            std::make_shared<std::vector<GeometricPrimitive>>();
+        block->reserve(end - start);
+        for (int i = start; i < end; ++i) {
+            block->emplace_back(shapes[i], material, nullptr, mi);
+            prims[i] = std::shared_ptr<Primitive>(block, &block->back());
+        }
+    }, (nShapes + blockSize - 1) / blockSize);
+    return prims;
+}
+
 }  // namespace pbrt
@@ -55,6 +55,12 @@ class Primitive {
     virtual Bounds3f WorldBound() const = 0;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
+    // Batched versions of Intersect() and IntersectP() for _n_ rays. The
+    // default implementations handle one ray after the other; aggregates
+    // override them to traverse coherent rays together.
+    virtual void IntersectBatch(const Ray *rays, int n,
+                                SurfaceInteraction *isects, bool *hits) const;
+    virtual void IntersectPBatch(const Ray *rays, int n, bool *occluded) const;
     virtual const AreaLight *GetAreaLight() const = 0;
     virtual const Material *GetMaterial() const = 0;
     virtual void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -89,6 +95,12 @@ class GeometricPrimitive : public Primitive {
     MediumInterface mediumInterface;
 };
 
+// Creates a _GeometricPrimitive_ without an area light for each of the
+// shapes, in blocks that are allocated and filled in parallel.
+std::vector<std::shared_ptr<Primitive>> CreateGeometricPrimitives(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material, const MediumInterface &mi);
+
 // TransformedPrimitive Declarations
 class TransformedPrimitive : public Primitive {
   public:
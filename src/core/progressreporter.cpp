@@ -35,10 +35,15 @@
 #include "progressreporter.h"
 #include "parallel.h"
 #include "stats.h"
+#include "util.h"
+#include <condition_variable>
+#include <mutex>
 #ifdef PBRT_IS_WINDOWS
 #include <windows.h>
 #else
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <errno.h>
 #endif  // !PBRT_IS_WINDOWS
@@ -46,6 +51,44 @@
 namespace pbrt {
 
 static int TerminalWidth();
+static bool WriteTelemetryLine(const std::string &line);
+
+// ProgressReporter Local Definitions
+
+// The statistics that telemetry snapshots follow
+static const char *rayCounters[] = {
+    "Intersections/Regular ray intersection tests",
+    "Intersections/Shadow ray intersection tests"};
+static const char sampleCounter[] = "Integrator/Camera rays traced";
+static const char occlusionPercentage[] = "Transient/Occlusion";
+
+// What one rendering thread has done so far. Its statistics are drained
+// into _stats_ at most once per telemetry interval, so they lag behind
+// the work done by up to an interval.
+struct ThreadTelemetry {
+    std::mutex mutex;
+    StatsAccumulator stats;
+    int64_t workDone = 0;
+    std::chrono::system_clock::time_point lastUpdate, lastStatsReport;
+};
+
+struct ProgressTelemetry {
+    ProgressTelemetry(int nThreads, std::chrono::system_clock::time_point start)
+        : nThreads(nThreads),
+          threads(new ThreadTelemetry[nThreads]),
+          interval(std::max(
+              (int64_t)100,
+              (int64_t)(1000 * (double)PbrtOptions.telemetryInterval))) {
+        for (int i = 0; i < nThreads; ++i)
+            threads[i].lastUpdate = threads[i].lastStatsReport = start;
+    }
+    const int nThreads;
+    std::unique_ptr<ThreadTelemetry[]> threads;
+    const std::chrono::milliseconds interval;
+    std::mutex mutex;
+    std::condition_variable exitCondition;
+    bool exit = false;
+};
 
 // ProgressReporter Method Definitions
 ProgressReporter::ProgressReporter(int64_t totalWork, const std::string &title)
@@ -54,8 +97,12 @@ ProgressReporter::ProgressReporter(int64_t totalWork, const std::string &title)
       startTime(std::chrono::system_clock::now()) {
     workDone = 0;
     exitThread = false;
-    // Launch thread to periodically update progress bar
-    if (!PbrtOptions.quiet) {
+    if (!PbrtOptions.telemetry.empty())
+        telemetry.reset(new ProgressTelemetry(MaxThreadIndex(), startTime));
+    // Launch threads to periodically update progress bar and write
+    // telemetry snapshots
+    bool printBar = !PbrtOptions.quiet;
+    if (printBar || telemetry) {
         // We need to temporarily disable the profiler before launching
         // the update thread here, through the time the thread calls
         // ProfilerWorkerThreadInit(). Otherwise, there's a potential
@@ -65,14 +112,23 @@ ProgressReporter::ProgressReporter(int64_t totalWork, const std::string &title)
         // time. (Which in turn calls malloc, which isn't allowed in a
         // signal handler.)
         SuspendProfiler();
-        std::shared_ptr<Barrier> barrier = std::make_shared<Barrier>(2);
-        updateThread = std::thread([this, barrier]() {
-            ProfilerWorkerThreadInit();
-            ProfilerState = 0;
-            barrier->Wait();
-            PrintBar();
-        });
-        // Wait for the thread to get past the ProfilerWorkerThreadInit()
+        std::shared_ptr<Barrier> barrier = std::make_shared<Barrier>(
+            1 + (printBar ? 1 : 0) + (telemetry ? 1 : 0));
+        if (printBar)
+            updateThread = std::thread([this, barrier]() {
+                ProfilerWorkerThreadInit();
+                ProfilerState = 0;
+                barrier->Wait();
+                PrintBar();
+            });
+        if (telemetry)
+            telemetryThread = std::thread([this, barrier]() {
+                ProfilerWorkerThreadInit();
+                ProfilerState = 0;
+                barrier->Wait();
+                ReportTelemetry();
+            });
+        // Wait for the threads to get past the ProfilerWorkerThreadInit()
         // call.
         barrier->Wait();
         ResumeProfiler();
@@ -80,6 +136,16 @@ ProgressReporter::ProgressReporter(int64_t totalWork, const std::string &title)
 }
 
 ProgressReporter::~ProgressReporter() {
+    // The final snapshot reports the work that was actually done, which is
+    // less than _totalWork_ if rendering was cut short, e.g. by a time budget
+    if (telemetry) {
+        {
+            std::lock_guard<std::mutex> lock(telemetry->mutex);
+            telemetry->exit = true;
+        }
+        telemetry->exitCondition.notify_one();
+        telemetryThread.join();
+    }
     if (!PbrtOptions.quiet) {
         workDone = totalWork;
         exitThread = true;
@@ -150,6 +216,94 @@ void ProgressReporter::Done() {
     workDone = totalWork;
 }
 
+void ProgressReporter::UpdateTelemetry(int64_t num) {
+    int index = Clamp(ThreadIndex, 0, telemetry->nThreads - 1);
+    ThreadTelemetry &thread = telemetry->threads[index];
+    std::chrono::system_clock::time_point now =
+        std::chrono::system_clock::now();
+    std::lock_guard<std::mutex> lock(thread.mutex);
+    thread.workDone += num;
+    thread.lastUpdate = now;
+    // Draining the statistics only adds them to the totals earlier, so the
+    // final statistics are the same with or without telemetry
+    if (now - thread.lastStatsReport >= telemetry->interval) {
+        ReportThreadStats(&thread.stats);
+        thread.lastStatsReport = now;
+    }
+}
+
+void ProgressReporter::ReportTelemetry() {
+    std::unique_lock<std::mutex> lock(telemetry->mutex);
+    while (true) {
+        std::chrono::system_clock::time_point next =
+            std::chrono::system_clock::now() + telemetry->interval;
+        while (!telemetry->exit &&
+               telemetry->exitCondition.wait_until(lock, next) !=
+                   std::cv_status::timeout)
+            ;
+        bool done = telemetry->exit;
+        lock.unlock();
+        WriteTelemetry(done);
+        if (done) return;
+        lock.lock();
+    }
+}
+
+void ProgressReporter::WriteTelemetry(bool done) {
+    std::chrono::system_clock::time_point now =
+        std::chrono::system_clock::now();
+    double seconds = ElapsedMS() / 1000.;
+    double fractionDone = double(workDone) / double(totalWork);
+    double remaining = seconds / fractionDone - seconds;
+
+    // Sum up the threads' statistics and describe each thread that has
+    // started working; a thread whose _secondsSinceUpdate_ keeps growing
+    // while others progress has stalled
+    int64_t nRays = 0, nSamples = 0, nOccluded = 0, nOcclusionTests = 0;
+    std::string threads;
+    for (int i = 0; i < telemetry->nThreads; ++i) {
+        ThreadTelemetry &thread = telemetry->threads[i];
+        std::lock_guard<std::mutex> lock(thread.mutex);
+        if (thread.workDone == 0) continue;
+        int64_t threadRays = 0;
+        for (const char *counter : rayCounters)
+            threadRays += thread.stats.GetCounter(counter);
+        int64_t threadSamples = thread.stats.GetCounter(sampleCounter);
+        std::pair<int64_t, int64_t> occlusion =
+            thread.stats.GetPercentage(occlusionPercentage);
+        nRays += threadRays;
+        nSamples += threadSamples;
+        nOccluded += occlusion.first;
+        nOcclusionTests += occlusion.second;
+        double sinceUpdate =
+            std::chrono::duration<double>(now - thread.lastUpdate).count();
+        threads += StringPrintf(
+            "%s{\"thread\": %d, \"workDone\": %" PRId64
+            ", \"rays\": %" PRId64 ", \"samples\": %" PRId64
+            ", \"secondsSinceUpdate\": %.1f}",
+            threads.empty() ? "" : ", ", i, thread.workDone, threadRays,
+            threadSamples, sinceUpdate);
+    }
+
+    std::string occlusion =
+        nOcclusionTests > 0
+            ? StringPrintf("%.2f", 100. * nOccluded / nOcclusionTests)
+            : std::string("null");
+    std::string estimate = (done || !std::isfinite(remaining))
+                               ? std::string(done ? "0" : "null")
+                               : StringPrintf("%.1f", std::max(0., remaining));
+    WriteTelemetryLine(StringPrintf(
+        "{\"time\": \"%s\", \"title\": %s, \"seconds\": %.1f, "
+        "\"workDone\": %" PRId64 ", \"totalWork\": %" PRId64
+        ", \"percentDone\": %.2f, \"secondsRemaining\": %s, "
+        "\"done\": %s, \"rays\": %" PRId64 ", \"samples\": %" PRId64
+        ", \"occlusionPercent\": %s, \"threads\": [%s]}\n",
+        FormatTime(now).c_str(), JSONString(title).c_str(), seconds,
+        (int64_t)workDone, totalWork, 100. * fractionDone, estimate.c_str(),
+        done ? "true" : "false", nRays, nSamples, occlusion.c_str(),
+        threads.c_str()));
+}
+
 static int TerminalWidth() {
 #ifdef PBRT_IS_WINDOWS
     HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -178,4 +332,93 @@ static int TerminalWidth() {
 #endif  // PBRT_IS_WINDOWS
 }
 
+// Writes a line to the telemetry destination given by
+// _PbrtOptions.telemetry_, which is opened the first time and then kept
+// open, so that all of the render's snapshots go to the same connection.
+static bool WriteTelemetryLine(const std::string &line) {
+    static std::mutex mutex;
+    static FILE *file = nullptr;
+    static int socketFd = -1;
+    static bool failed = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (failed) return false;
+
+    const std::string &destination = PbrtOptions.telemetry;
+    if (!file && socketFd < 0) {
+        if (destination.compare(0, 5, "unix:") == 0) {
+#ifdef PBRT_IS_WINDOWS
+            Warning("Telemetry: Unix sockets aren't supported on Windows");
+            failed = true;
+            return false;
+#else
+            std::string path = destination.substr(5);
+            sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path)) {
+                Warning("Telemetry: socket path \"%s\" is too long",
+                        path.c_str());
+                failed = true;
+                return false;
+            }
+            strcpy(address.sun_path, path.c_str());
+            socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (socketFd < 0 ||
+                connect(socketFd, (sockaddr *)&address, sizeof(address)) < 0) {
+                Warning("Telemetry: couldn't connect to socket \"%s\": %s",
+                        path.c_str(), strerror(errno));
+                if (socketFd >= 0) close(socketFd);
+                socketFd = -1;
+                failed = true;
+                return false;
+            }
+#ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(socketFd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+#endif  // PBRT_IS_WINDOWS
+        } else {
+            file = fopen(destination.c_str(), "a");
+            if (!file) {
+                Warning("Telemetry: couldn't open \"%s\": %s",
+                        destination.c_str(), strerror(errno));
+                failed = true;
+                return false;
+            }
+        }
+    }
+
+    if (file) {
+        if (fputs(line.c_str(), file) == EOF || fflush(file) != 0) {
+            Warning("Telemetry: couldn't write to \"%s\": %s",
+                    destination.c_str(), strerror(errno));
+            failed = true;
+        }
+    }
+#ifndef PBRT_IS_WINDOWS
+    else {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        // A reader that went away is reported, rather than raising SIGPIPE
+        for (size_t sent = 0; sent < line.size() && !failed;) {
+            ssize_t n =
+                send(socketFd, line.data() + sent, line.size() - sent, flags);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                Warning("Telemetry: couldn't write to \"%s\": %s",
+                        destination.c_str(), strerror(errno));
+                close(socketFd);
+                socketFd = -1;
+                failed = true;
+            } else
+                sent += n;
+        }
+    }
+#endif  // !PBRT_IS_WINDOWS
+    return !failed;
+}
+
 }  // namespace pbrt
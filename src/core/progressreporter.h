@@ -46,6 +46,8 @@
 
 namespace pbrt {
 
+struct ProgressTelemetry;
+
 // ProgressReporter Declarations
 class ProgressReporter {
   public:
@@ -53,8 +55,9 @@ class ProgressReporter {
     ProgressReporter(int64_t totalWork, const std::string &title);
     ~ProgressReporter();
     void Update(int64_t num = 1) {
-        if (num == 0 || PbrtOptions.quiet) return;
+        if (num == 0 || (PbrtOptions.quiet && !telemetry)) return;
         workDone += num;
+        if (telemetry) UpdateTelemetry(num);
     }
     Float ElapsedMS() const {
         std::chrono::system_clock::time_point now =
@@ -70,6 +73,9 @@ class ProgressReporter {
   private:
     // ProgressReporter Private Methods
     void PrintBar();
+    void UpdateTelemetry(int64_t num);
+    void ReportTelemetry();
+    void WriteTelemetry(bool done);
 
     // ProgressReporter Private Data
     const int64_t totalWork;
@@ -78,6 +84,8 @@ class ProgressReporter {
     std::atomic<int64_t> workDone;
     std::atomic<bool> exitThread;
     std::thread updateThread;
+    std::unique_ptr<ProgressTelemetry> telemetry;
+    std::thread telemetryThread;
 };
 
 }  // namespace pbrt
@@ -200,6 +200,21 @@ bool Scene::IntersectP(const Ray &ray) const {
     return aggregate->IntersectP(ray);
 }
 
+void Scene::IntersectBatch(const Ray *rays, int n, SurfaceInteraction *isects,
+                           bool *hits) const {
+    nIntersectionTests += n;
+    for (int i = 0; i < n; ++i) {
+        DCHECK_NE(rays[i].d, Vector3f(0,0,0));
+        rays[i].tMax = Infinity;
+    }
+    aggregate->IntersectBatch(rays, n, isects, hits);
+}
+
+void Scene::IntersectPBatch(const Ray *rays, int n, bool *occluded) const {
+    nShadowTests += n;
+    aggregate->IntersectPBatch(rays, n, occluded);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                         Spectrum *Tr) const {
     *Tr = Spectrum(1.f);
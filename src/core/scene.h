@@ -59,6 +59,11 @@ class Scene {
     const Bounds3f &WorldBound() const { return worldBound; }
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Intersect()/IntersectP() for _n_ rays at once; coherent rays, e.g.
+    // sorted by origin and direction, are traversed faster this way
+    void IntersectBatch(const Ray *rays, int n, SurfaceInteraction *isects,
+                        bool *hits) const;
+    void IntersectPBatch(const Ray *rays, int n, bool *occluded) const;
     bool IntersectTr(Ray ray, Sampler &sampler, SurfaceInteraction *isect,
                      Spectrum *transmittance) const;
 
@@ -76,10 +76,20 @@ static void ReportProfileSample(int, siginfo_t *, void *);
 #endif  // PBRT_HAVE_ITIMER
 
 // Statistics Definitions
-void ReportThreadStats() {
+// With _threadStats_, what the calling thread reports is also added to it,
+// which lets the statistics be followed per thread while rendering
+void ReportThreadStats(StatsAccumulator *threadStats) {
     static std::mutex mutex;
+    if (!threadStats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        StatRegisterer::CallCallbacks(statsAccumulator);
+        return;
+    }
+    StatsAccumulator reported;
+    StatRegisterer::CallCallbacks(reported);
+    threadStats->Add(reported);
     std::lock_guard<std::mutex> lock(mutex);
-    StatRegisterer::CallCallbacks(statsAccumulator);
+    statsAccumulator.Add(reported);
 }
 
 void StatRegisterer::CallCallbacks(StatsAccumulator &accum) {
@@ -88,6 +98,12 @@ void StatRegisterer::CallCallbacks(StatsAccumulator &accum) {
 
 void PrintStats(FILE *dest) { statsAccumulator.Print(dest); }
 
+void PrintStatsJSON(FILE *dest) { statsAccumulator.PrintJSON(dest); }
+
+int64_t GetStatsCounter(const std::string &name) {
+    return statsAccumulator.GetCounter(name);
+}
+
 void ClearStats() { statsAccumulator.Clear(); }
 
 static void getCategoryAndTitle(const std::string &str, std::string *category,
@@ -186,6 +202,134 @@ void StatsAccumulator::Print(FILE *dest) {
     }
 }
 
+std::string JSONString(const std::string &str) {
+    std::string ret = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            ret += std::string("\\") + c;
+        else if ((unsigned char)c < 0x20)
+            ret += StringPrintf("\\u%04x", (int)c);
+        else
+            ret += c;
+    }
+    return ret + "\"";
+}
+
+static std::string jsonNumber(double value) {
+    // JSON has no infinities or NaNs
+    return std::isfinite(value) ? StringPrintf("%.9g", value) : "null";
+}
+
+// Writes the members of one JSON object, _members_, at the given
+// indentation
+static void printJSONObject(FILE *dest, const std::vector<std::string> &members,
+                            int indent) {
+    fprintf(dest, "{");
+    for (size_t i = 0; i < members.size(); ++i)
+        fprintf(dest, "%s\n%*s%s", i == 0 ? "" : ",", indent + 2, "",
+                members[i].c_str());
+    fprintf(dest, "\n%*s}", indent, "");
+}
+
+void StatsAccumulator::PrintJSON(FILE *dest) {
+    // Unlike Print(), this keeps the full "category/title" names and the
+    // raw values; distributions, percentages, and ratios without any
+    // samples are left out
+    std::vector<std::string> counterMembers, memoryMembers, intMembers,
+        floatMembers, percentageMembers, ratioMembers;
+    for (auto &counter : counters)
+        counterMembers.push_back(StringPrintf(
+            "%s: %" PRId64, JSONString(counter.first).c_str(), counter.second));
+    for (auto &counter : memoryCounters)
+        memoryMembers.push_back(StringPrintf(
+            "%s: %" PRId64, JSONString(counter.first).c_str(), counter.second));
+    for (auto &distributionSum : intDistributionSums) {
+        const std::string &name = distributionSum.first;
+        int64_t count = intDistributionCounts[name];
+        if (count == 0) continue;
+        intMembers.push_back(StringPrintf(
+            "%s: { \"count\": %" PRId64 ", \"sum\": %" PRId64
+            ", \"min\": %" PRId64 ", \"max\": %" PRId64 ", \"avg\": %s }",
+            JSONString(name).c_str(), count, distributionSum.second,
+            intDistributionMins[name], intDistributionMaxs[name],
+            jsonNumber((double)distributionSum.second / count).c_str()));
+    }
+    for (auto &distributionSum : floatDistributionSums) {
+        const std::string &name = distributionSum.first;
+        int64_t count = floatDistributionCounts[name];
+        if (count == 0) continue;
+        floatMembers.push_back(StringPrintf(
+            "%s: { \"count\": %" PRId64
+            ", \"sum\": %s, \"min\": %s, \"max\": %s, \"avg\": %s }",
+            JSONString(name).c_str(), count,
+            jsonNumber(distributionSum.second).c_str(),
+            jsonNumber(floatDistributionMins[name]).c_str(),
+            jsonNumber(floatDistributionMaxs[name]).c_str(),
+            jsonNumber(distributionSum.second / count).c_str()));
+    }
+    for (auto &percentage : percentages) {
+        int64_t num = percentage.second.first;
+        int64_t denom = percentage.second.second;
+        if (denom == 0) continue;
+        percentageMembers.push_back(StringPrintf(
+            "%s: { \"num\": %" PRId64 ", \"denom\": %" PRId64
+            ", \"percent\": %s }",
+            JSONString(percentage.first).c_str(), num, denom,
+            jsonNumber(100. * num / denom).c_str()));
+    }
+    for (auto &ratio : ratios) {
+        int64_t num = ratio.second.first;
+        int64_t denom = ratio.second.second;
+        if (denom == 0) continue;
+        ratioMembers.push_back(StringPrintf(
+            "%s: { \"num\": %" PRId64 ", \"denom\": %" PRId64
+            ", \"ratio\": %s }",
+            JSONString(ratio.first).c_str(), num, denom,
+            jsonNumber((double)num / denom).c_str()));
+    }
+
+    const std::pair<const char *, const std::vector<std::string> *> sections[] =
+        {{"counters", &counterMembers},
+         {"memoryCounters", &memoryMembers},
+         {"intDistributions", &intMembers},
+         {"floatDistributions", &floatMembers},
+         {"percentages", &percentageMembers},
+         {"ratios", &ratioMembers}};
+    fprintf(dest, "{");
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); ++i) {
+        fprintf(dest, "%s\n    \"%s\": ", i == 0 ? "" : ",",
+                sections[i].first);
+        printJSONObject(dest, *sections[i].second, 4);
+    }
+    fprintf(dest, "\n  }");
+}
+
+void StatsAccumulator::Add(const StatsAccumulator &other) {
+    for (auto &counter : other.counters)
+        ReportCounter(counter.first, counter.second);
+    for (auto &counter : other.memoryCounters)
+        ReportMemoryCounter(counter.first, counter.second);
+    for (auto &distributionSum : other.intDistributionSums) {
+        const std::string &name = distributionSum.first;
+        ReportIntDistribution(name, distributionSum.second,
+                              other.intDistributionCounts.at(name),
+                              other.intDistributionMins.at(name),
+                              other.intDistributionMaxs.at(name));
+    }
+    for (auto &distributionSum : other.floatDistributionSums) {
+        const std::string &name = distributionSum.first;
+        ReportFloatDistribution(name, distributionSum.second,
+                                other.floatDistributionCounts.at(name),
+                                other.floatDistributionMins.at(name),
+                                other.floatDistributionMaxs.at(name));
+    }
+    for (auto &percentage : other.percentages)
+        ReportPercentage(percentage.first, percentage.second.first,
+                         percentage.second.second);
+    for (auto &ratio : other.ratios)
+        ReportRatio(ratio.first, ratio.second.first, ratio.second.second);
+}
+
 void StatsAccumulator::Clear() {
     counters.clear();
     memoryCounters.clear();
@@ -315,10 +459,12 @@ static std::string timeString(float pct, std::chrono::system_clock::time_point n
     return StringPrintf("%4d:%02d:%02d.%02d", h, m, s, ms);
 }
 
-void ReportProfilerResults(FILE *dest) {
 #ifdef PBRT_HAVE_ITIMER
-    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-
+// Sums up the profile samples, by the full "parent/child" path of the
+// categories that were active and by the innermost category alone
+static uint64_t computeProfilerResults(
+    std::map<std::string, uint64_t> *hierarchicalResults,
+    std::map<std::string, uint64_t> *flatResults) {
     PBRT_CONSTEXPR int NumProfCategories = (int)Prof::NumProfCategories;
     uint64_t overallCount = 0;
     int used = 0;
@@ -331,8 +477,6 @@ void ReportProfilerResults(FILE *dest) {
     LOG(INFO) << "Used " << used << " / " << profileHashSize
               << " entries in profiler hash table";
 
-    std::map<std::string, uint64_t> flatResults;
-    std::map<std::string, uint64_t> hierarchicalResults;
     for (const ProfileSample &ps : profileSamples) {
         if (ps.count == 0) continue;
 
@@ -341,18 +485,30 @@ void ReportProfilerResults(FILE *dest) {
             if (ps.profilerState & (1ull << b)) {
                 if (s.size() > 0) {
                     // contribute to the parents...
-                    hierarchicalResults[s] += ps.count;
+                    (*hierarchicalResults)[s] += ps.count;
                     s += "/";
                 }
                 s += ProfNames[b];
             }
         }
-        hierarchicalResults[s] += ps.count;
+        (*hierarchicalResults)[s] += ps.count;
 
         int nameIndex = Log2Int(ps.profilerState);
         DCHECK_LT(nameIndex, NumProfCategories);
-        flatResults[ProfNames[nameIndex]] += ps.count;
+        (*flatResults)[ProfNames[nameIndex]] += ps.count;
     }
+    return overallCount;
+}
+#endif  // PBRT_HAVE_ITIMER
+
+void ReportProfilerResults(FILE *dest) {
+#ifdef PBRT_HAVE_ITIMER
+    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+
+    std::map<std::string, uint64_t> flatResults;
+    std::map<std::string, uint64_t> hierarchicalResults;
+    uint64_t overallCount =
+        computeProfilerResults(&hierarchicalResults, &flatResults);
 
     fprintf(dest, "  Profile\n");
     for (const auto &r : hierarchicalResults) {
@@ -391,4 +547,41 @@ void ReportProfilerResults(FILE *dest) {
 #endif
 }
 
+void ReportProfilerResultsJSON(FILE *dest) {
+#ifdef PBRT_HAVE_ITIMER
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::system_clock::now() - profileStartTime)
+                         .count();
+    std::map<std::string, uint64_t> flatResults;
+    std::map<std::string, uint64_t> hierarchicalResults;
+    uint64_t overallCount =
+        computeProfilerResults(&hierarchicalResults, &flatResults);
+
+    // Each category with its number of samples, its share of them, and the
+    // corresponding share of the time since the profiler was started
+    auto members = [&](const std::map<std::string, uint64_t> &results) {
+        std::vector<std::string> m;
+        for (const auto &r : results) {
+            double fraction = (double)r.second / overallCount;
+            m.push_back(StringPrintf(
+                "%s: { \"samples\": %" PRIu64
+                ", \"percent\": %s, \"seconds\": %s }",
+                JSONString(r.first).c_str(), r.second,
+                jsonNumber(100 * fraction).c_str(),
+                jsonNumber(seconds * fraction).c_str()));
+        }
+        return m;
+    };
+    fprintf(dest, "{\n    \"samples\": %" PRIu64 ",\n    \"seconds\": %s",
+            overallCount, jsonNumber(seconds).c_str());
+    fprintf(dest, ",\n    \"hierarchical\": ");
+    printJSONObject(dest, members(hierarchicalResults), 4);
+    fprintf(dest, ",\n    \"flat\": ");
+    printJSONObject(dest, members(flatResults), 4);
+    fprintf(dest, "\n  }");
+#else
+    fprintf(dest, "{ }");
+#endif
+}
+
 }  // namespace pbrt
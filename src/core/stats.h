@@ -68,8 +68,12 @@ class StatRegisterer {
 };
 
 void PrintStats(FILE *dest);
+void PrintStatsJSON(FILE *dest);
+// Quotes _str_ as a JSON string, escaping the characters that need it
+std::string JSONString(const std::string &str);
 void ClearStats();
-void ReportThreadStats();
+void ReportThreadStats(StatsAccumulator *threadStats = nullptr);
+int64_t GetStatsCounter(const std::string &name);
 
 class StatsAccumulator {
   public:
@@ -120,7 +124,18 @@ class StatsAccumulator {
     }
 
     void Print(FILE *file);
+    void PrintJSON(FILE *file);
+    void Add(const StatsAccumulator &other);
     void Clear();
+    int64_t GetCounter(const std::string &name) const {
+        auto iter = counters.find(name);
+        return iter == counters.end() ? 0 : iter->second;
+    }
+    std::pair<int64_t, int64_t> GetPercentage(const std::string &name) const {
+        auto iter = percentages.find(name);
+        return iter == percentages.end() ? std::make_pair(int64_t(0), int64_t(0))
+                                         : iter->second;
+    }
 
   private:
     // StatsAccumulator Private Data
@@ -275,6 +290,7 @@ void SuspendProfiler();
 void ResumeProfiler();
 void ProfilerWorkerThreadInit();
 void ReportProfilerResults(FILE *dest);
+void ReportProfilerResultsJSON(FILE *dest);
 void ClearProfiler();
 void CleanupProfiler();
 
@@ -7,6 +7,7 @@
 #include "util.h"
 
 #include <array>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
@@ -33,12 +34,16 @@ TransientSampleCache::TransientSample* end(TransientSampleCache& c)
 TransientFilm::TransientFilm(const Point3i &resolution, Float tmin, Float tmax,
 	const Bounds2f &cropWindow,
 	std::unique_ptr<Filter> filt, Float diagonal,
-	const std::string &filename, Float maxSampleLuminance)
+	const std::string &filename, Float maxSampleLuminance,
+	bool autoTRange, bool autoTRangeResample, int pyramidLevels)
 	: fullResolution(resolution),
-	tmin(tmin), tmax(tmax),
 	diagonal(diagonal * .001),
 	filter(std::move(filt)),
 	filename(filename),
+	tmin(tmin), tmax(tmax),
+	autoTRange(autoTRange), autoTRangeResample(autoTRangeResample),
+	minPopulatedBin(resolution.z), maxPopulatedBin(-1),
+	pyramidLevels(pyramidLevels),
 	maxSampleLuminance(maxSampleLuminance)
 {
 	// Compute film image bounds
@@ -51,9 +56,21 @@ TransientFilm::TransientFilm(const Point3i &resolution, Float tmin, Float tmax,
 		". Crop window of " << cropWindow << " -> croppedPixelBounds " <<
 		croppedPixelBounds;
 
-	// Allocate film image storage
-	pixelIntensities.resize(croppedPixelBounds.Area() * fullResolution.z);
-	pixelWeights.resize(croppedPixelBounds.Area());
+	// Allocate film image storage. It is left uninitialized here, so that the
+	// band of rows of every NUMA node is first touched by a thread on that
+	// node; the tiles are merged into it by the threads of the same node.
+	pixelIntensities.reset(new Float[croppedPixelBounds.Area() * fullResolution.z]);
+	pixelWeights.reset(new Float[croppedPixelBounds.Area()]);
+	const int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
+	ForEachNumaNode([&](int node) {
+		for(int y = croppedPixelBounds.pMin.y; y < croppedPixelBounds.pMax.y; ++y) {
+			if(GetNumaNode(y) != node)
+				continue;
+			int64_t rowOffset = int64_t(y - croppedPixelBounds.pMin.y) * width;
+			std::fill_n(&pixelIntensities[rowOffset * fullResolution.z], width * fullResolution.z, Float(0));
+			std::fill_n(&pixelWeights[rowOffset], width, Float(0));
+		}
+	});
 	filmPixelMemory += croppedPixelBounds.Area() * fullResolution.z * sizeof(Float); // the intensities
 	filmPixelMemory += croppedPixelBounds.Area() * sizeof(Float); // the weights
 
@@ -92,15 +109,27 @@ std::unique_ptr<TransientFilmTile> TransientFilm::GetFilmTile(const Bounds2i &sa
 	Point2i p1 = (Point2i)Floor(floatBounds.pMax - halfPixel + filter->radius) +
 		Point2i(1, 1);
 	Bounds2i tilePixelBounds = Intersect(Bounds2i(p0, p1), croppedPixelBounds);
+	std::vector<Float> intensityBuffer, weightBuffer;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!freeTileIntensities.empty()) {
+			intensityBuffer = std::move(freeTileIntensities.back());
+			weightBuffer = std::move(freeTileWeights.back());
+			freeTileIntensities.pop_back();
+			freeTileWeights.pop_back();
+		}
+	}
 	return std::unique_ptr<TransientFilmTile>(new TransientFilmTile(
 		tilePixelBounds, fullResolution.z, tmin, tmax, filter->radius, filterTable, filterTableWidth,
-		maxSampleLuminance));
+		maxSampleLuminance, std::move(intensityBuffer), std::move(weightBuffer)));
 }
 
 void TransientFilm::MergeFilmTile(std::unique_ptr<TransientFilmTile> tile) {
 	ProfilePhase p(Prof::MergeFilmTile);
 	VLOG(1) << "Merging film tile " << tile->pixelBounds;
 	std::lock_guard<std::mutex> lock(mutex);
+	minPopulatedBin = std::min(minPopulatedBin, tile->minPopulatedBin);
+	maxPopulatedBin = std::max(maxPopulatedBin, tile->maxPopulatedBin);
 	for(Point2i pixel : tile->GetPixelBounds()) {
 
 		// iterate over temporal dimension of pixels
@@ -113,9 +142,47 @@ void TransientFilm::MergeFilmTile(std::unique_ptr<TransientFilmTile> tile) {
 			*mergePixel.filterWeightSum += *tilePixel.filterWeightSum;
 		}
 	}
+	freeTileIntensities.push_back(std::move(tile->pixelIntensities));
+	freeTileWeights.push_back(std::move(tile->pixelWeights));
 }
 
 
+// Halves the resolution of a transient image in all three dimensions by
+// averaging 2x2x2 blocks. As the intensities are densities, no rescaling is
+// needed. For odd image sizes, the last block only averages the existing
+// pixels. For an odd _numBins_, the bins have to stay uniform, so the last
+// coarse bin reaches half of it past the original _tmax_; that part is padded
+// with zero, as nothing is recorded after _tmax_, which keeps the energy of
+// the last bin the same.
+static LibTransientImage::T01 DownsampleTransientImage(const LibTransientImage::T01 &in) {
+	LibTransientImage::T01 out;
+	out.header.numBins = (in.header.numBins + 1) / 2;
+	out.header.uResolution = (in.header.uResolution + 1) / 2;
+	out.header.vResolution = (in.header.vResolution + 1) / 2;
+	const Float inBinSize = (in.header.tmax - in.header.tmin) / in.header.numBins;
+	const int tScale = in.header.numBins > 1 ? 2 : 1;
+	out.header.tmin = in.header.tmin;
+	out.header.tmax = in.header.tmin + out.header.numBins * tScale * inBinSize;
+	out.data.resize(out.header.numBins * out.header.uResolution * out.header.vResolution);
+
+	ParallelFor([&](int64_t v) {
+		for(unsigned int u = 0; u < out.header.uResolution; ++u) {
+			for(unsigned int t = 0; t < out.header.numBins; ++t) {
+				Float sum = 0;
+				int nPixels = 0;
+				for(unsigned int iv = 2 * v; iv < std::min<unsigned int>(2 * v + 2, in.header.vResolution); ++iv)
+					for(unsigned int iu = 2 * u; iu < std::min(2 * u + 2, in.header.uResolution); ++iu) {
+						for(unsigned int it = 2 * t; it < std::min(2 * t + 2, in.header.numBins); ++it)
+							sum += in(it, iu, iv);
+						++nPixels;
+					}
+				out(t, u, v) = sum / (nPixels * tScale);
+			}
+		}
+	}, out.header.vResolution);
+	return out;
+}
+
 void TransientFilm::WriteImage() {
 	g_TFMD.RenderEndTime = std::chrono::system_clock::now();
 
@@ -127,27 +194,60 @@ void TransientFilm::WriteImage() {
 	LOG(INFO) << "Writing image " << filename << " with bounds " <<
 		croppedPixelBounds;
 
+	// Determine the time bins to write: either all of them or, with
+	// autoTRange, only those which received any intensity.
+	int tBegin = 0, tEnd = fullResolution.z;
+	if(autoTRange && minPopulatedBin <= maxPopulatedBin) {
+		tBegin = minPopulatedBin;
+		tEnd = maxPopulatedBin + 1;
+		LOG(INFO) << "Cropping time range to bins [" << tBegin << ", " << tEnd << ")";
+	}
+	const Float binSize = (tmax - tmin) / fullResolution.z;
+	const int nCroppedBins = tEnd - tBegin;
+	const int nOutputBins = (autoTRange && autoTRangeResample) ? fullResolution.z : nCroppedBins;
+
 	LibTransientImage::T01 outputImage;
 
-	outputImage.header.numBins = fullResolution.z;
+	outputImage.header.numBins = nOutputBins;
 	outputImage.header.uResolution = (croppedPixelBounds.pMax-croppedPixelBounds.pMin).x;
 	outputImage.header.vResolution = (croppedPixelBounds.pMax-croppedPixelBounds.pMin).y;
-	outputImage.header.tmin = tmin;
-	outputImage.header.tmax = tmax;
+	outputImage.header.tmin = tmin + tBegin * binSize;
+	outputImage.header.tmax = tmin + tEnd * binSize;
 	
-	outputImage.data.resize(croppedPixelBounds.Area() * fullResolution.z);
-	int offset = 0;
-	for(Point2i p : croppedPixelBounds) {
-		for(auto t=0; t<fullResolution.z; ++t)
-		{
-			auto pp = Point3i(p.x, p.y, t);
+	outputImage.data.resize(croppedPixelBounds.Area() * nOutputBins);
+
+	// Normalize the image in parallel over scanlines. Both the film storage
+	// and the output image are laid out as [y][x][t], so we can directly walk
+	// the arrays instead of going through GetPixel() for every voxel.
+	const bool resample = nOutputBins != nCroppedBins;
+	const int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
+	const int height = croppedPixelBounds.pMax.y - croppedPixelBounds.pMin.y;
+	ParallelFor([&](int64_t y) {
+		std::vector<float> normalized(resample ? nCroppedBins : 0);
+		for(int x = 0; x < width; ++x) {
+			const int64_t pixelOffset = y * width + x;
 			// this is not quite right: if different samples fall in different times bins, the total amount is higher than if they fall into the same one
 			// we have to add weights of all time bins and divide each bin by the total amount.
 			// but how would this be changed, if we wanted also temporal sampling?
-			outputImage.data[offset] = *GetPixel(pp).intensity / *GetPixel(pp).filterWeightSum;
-			++offset;
+			const Float invWeight = 1 / pixelWeights[pixelOffset];
+			const Float *src = &pixelIntensities[pixelOffset * fullResolution.z + tBegin];
+			float *dst = resample ? normalized.data() : &outputImage.data[pixelOffset * nOutputBins];
+			for(int t = 0; t < nCroppedBins; ++t)
+				dst[t] = src[t] * invWeight;
+
+			if(resample) {
+				// Linearly interpolate the cropped bins at the output bin centers. The
+				// intensities are densities (per path length), so no rescaling is needed.
+				float *out = &outputImage.data[pixelOffset * nOutputBins];
+				for(int t = 0; t < nOutputBins; ++t) {
+					Float tc = Clamp((t + 0.5f) * nCroppedBins / nOutputBins - 0.5f, 0, nCroppedBins - 1);
+					int t0 = std::min((int)tc, nCroppedBins - 1);
+					int t1 = std::min(t0 + 1, nCroppedBins - 1);
+					out[t] = Lerp(tc - t0, normalized[t0], normalized[t1]);
+				}
+			}
 		}
-	}
+	}, height);
 
 	// add meta information:
 	std::stringstream imageProperties;
@@ -175,6 +275,24 @@ void TransientFilm::WriteImage() {
 		<< std::endl;
 	outputImage.imageProperties = imageProperties.str();
 	outputImage.WriteFile(filename);
+
+	// write the lower resolution levels next to the full image, e.g.
+	// "image.ti" -> "image_level1.ti", "image_level2.ti", ...
+	std::string::size_type dot = filename.find_last_of('.');
+	if(dot != std::string::npos && filename.find_first_of("/\\", dot) != std::string::npos)
+		dot = std::string::npos;
+	LibTransientImage::T01 level = std::move(outputImage);
+	for(int i = 1; i <= pyramidLevels; ++i) {
+		if(level.header.numBins == 1 && level.header.uResolution == 1 && level.header.vResolution == 1)
+			break;
+		level = DownsampleTransientImage(level);
+		level.imageProperties = imageProperties.str();
+		std::string levelFilename = (dot == std::string::npos) ?
+			StringPrintf("%s_level%d", filename.c_str(), i) :
+			StringPrintf("%s_level%d%s", filename.substr(0, dot).c_str(), i, filename.substr(dot).c_str());
+		LOG(INFO) << "Writing pyramid level " << i << " to " << levelFilename;
+		level.WriteFile(levelFilename);
+	}
 }
 
 TransientPixelRef TransientFilm::GetPixel(const Point3i &p) {
@@ -185,6 +303,14 @@ TransientPixelRef TransientFilm::GetPixel(const Point3i &p) {
 	return {&pixelIntensities[pixelOffset*fullResolution.z + p.z], &pixelWeights[pixelOffset]};
 }
 
+int TransientFilm::GetNumaNode(int y) const {
+	const int height = croppedPixelBounds.pMax.y - croppedPixelBounds.pMin.y;
+	if(height <= 0)
+		return 0;
+	y = Clamp(y - croppedPixelBounds.pMin.y, 0, height - 1);
+	return int(int64_t(y) * NumNumaNodes() / height);
+}
+
 
 
 
@@ -228,8 +354,21 @@ std::unique_ptr<TransientFilm> CreateTransientFilm(const ParamSet &params, std::
 	Float diagonal = params.FindOneFloat("diagonal", 35.);
 	Float maxSampleLuminance = params.FindOneFloat("maxsampleluminance",
 		Infinity);
+
+	// only write the time range that actually contains a signal
+	bool autoTRange = params.FindOneBool("t_autorange", false);
+	// ... and resample this range to tresolution bins
+	bool autoTRangeResample = params.FindOneBool("t_autorange_resample", false);
+
+	// number of additional images with halved resolution to write for coarse-to-fine reconstructions
+	int pyramidLevels = params.FindOneInt("pyramidlevels", 0);
+	if(pyramidLevels < 0) {
+		Error("\"pyramidlevels\" must not be negative. Ignoring it.");
+		pyramidLevels = 0;
+	}
+
 	return std::make_unique<TransientFilm>(Point3i(xres, yres, tres), tmin, tmax, crop, std::move(filter), diagonal,
-		filename, maxSampleLuminance);
+		filename, maxSampleLuminance, autoTRange, autoTRangeResample, pyramidLevels);
 }
 
 
@@ -241,7 +380,8 @@ std::unique_ptr<TransientFilm> CreateTransientFilm(const ParamSet &params, std::
 TransientFilmTile::TransientFilmTile(const Bounds2i &pixelBounds, unsigned int tresolution, Float tmin, Float tmax,
 	const Vector2f &filterRadius,
 		const Float *filterTable, int filterTableSize,
-		Float maxSampleLuminance)
+		Float maxSampleLuminance,
+		std::vector<Float> intensityBuffer, std::vector<Float> weightBuffer)
 	: pixelBounds(pixelBounds),
 	tresolution(tresolution),
 	tmin(tmin), tmax(tmax),
@@ -250,10 +390,14 @@ TransientFilmTile::TransientFilmTile(const Bounds2i &pixelBounds, unsigned int t
 	invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
 	filterTable(filterTable),
 	filterTableSize(filterTableSize),
-	maxSampleLuminance(maxSampleLuminance)
+	maxSampleLuminance(maxSampleLuminance),
+	minPopulatedBin(tresolution), maxPopulatedBin(-1)
 {
-	pixelIntensities = std::vector<Float>(std::max(0, pixelBounds.Area()) * tresolution);
-	pixelWeights = std::vector<Float>(std::max(0, pixelBounds.Area()));
+	// reuse the storage of the given buffers, if any
+	pixelIntensities = std::move(intensityBuffer);
+	pixelWeights = std::move(weightBuffer);
+	pixelIntensities.assign(std::max(0, pixelBounds.Area()) * tresolution, 0);
+	pixelWeights.assign(std::max(0, pixelBounds.Area()), 0);
 }
 
 
@@ -333,6 +477,11 @@ void TransientFilmTile::AddSample(const Point2f &pFilm, TransientSampleCache& sa
 				}
 				auto temporalFilterTotalWeightInv = 1.0 / temporalFilterTotalWeight;
 
+				if(!L.IsBlack() && t0 < t1) {
+					minPopulatedBin = std::min(minPopulatedBin, t0);
+					maxPopulatedBin = std::max(maxPopulatedBin, t1 - 1);
+				}
+
 				for(int t=t0; t<t1; ++t)
 				{
 					// Update pixel values with filtered sample contribution
@@ -95,29 +95,51 @@ public:
 		const Bounds2f &cropWindow,
 		std::unique_ptr<Filter> filter, Float diagonal,
 		const std::string &filename,
-		Float maxSampleLuminance = Infinity);
+		Float maxSampleLuminance = Infinity,
+		bool autoTRange = false, bool autoTRangeResample = false,
+		int pyramidLevels = 0);
 	Bounds2i GetSampleBounds() const;
 	Bounds2f GetPhysicalExtent() const;
 	std::unique_ptr<TransientFilmTile> GetFilmTile(const Bounds2i &sampleBounds);
 	void MergeFilmTile(std::unique_ptr<TransientFilmTile> tile);
 
+	/// the NUMA node whose memory holds the film row y (see NumNumaNodes())
+	int GetNumaNode(int y) const;
+
 	/// writes the transient image to the previously specified file
 	void WriteImage();
 
+	/// the covered time range, as path length (i.e. the same unit as the scene)
+	Float GetTMin() const { return tmin; }
+	Float GetTMax() const { return tmax; }
+
 	const Point3i fullResolution;
 	const Float diagonal;
 	std::unique_ptr<Filter> filter;
 	const std::string filename;
 	Bounds2i croppedPixelBounds;
 private:
-	std::vector<Float> pixelIntensities;
-	std::vector<Float> pixelWeights;
+	/* the rows are split into one band per NUMA node, and each band is
+	   first touched (and thus stored) on its node, see the constructor */
+	std::unique_ptr<Float[]> pixelIntensities;
+	std::unique_ptr<Float[]> pixelWeights;
 	Float tmin, tmax;
 
+	/* with autoTRange, only the time bins that actually received samples
+	   are written (and optionally resampled to the full tresolution).
+	   The populated range is collected from the tiles while merging. */
+	const bool autoTRange, autoTRangeResample;
+	int minPopulatedBin, maxPopulatedBin;
+
+	/// number of downsampled levels (each halving t, u and v) written alongside the image
+	const int pyramidLevels;
+
 
 	static PBRT_CONSTEXPR int filterTableWidth = 16;
 	Float filterTable[filterTableWidth * filterTableWidth];
 	std::mutex mutex;
+	/// pixel buffers of merged tiles, reused by GetFilmTile(); guarded by mutex
+	std::vector<std::vector<Float>> freeTileIntensities, freeTileWeights;
 	const Float maxSampleLuminance;
 
 
@@ -130,7 +152,9 @@ public:
 	TransientFilmTile(const Bounds2i &pixelBounds, unsigned int tresolution, Float tmin, Float tmax,
 		const Vector2f &filterRadius,
 		const Float *filterTable, int filterTableSize,
-		Float maxSampleLuminance);
+		Float maxSampleLuminance,
+		std::vector<Float> intensityBuffer = std::vector<Float>(),
+		std::vector<Float> weightBuffer = std::vector<Float>());
 
 	void AddSample(const Point2f &pFilm, TransientSampleCache& sample,
 		Float sampleWeight = 1.);
@@ -150,6 +174,7 @@ private:
 	std::vector<Float> pixelIntensities;
 	std::vector<Float> pixelWeights;
 	const Float maxSampleLuminance;
+	int minPopulatedBin, maxPopulatedBin; ///< range of time bins that received any intensity; empty if min > max
 	friend class TransientFilm;
 };
 
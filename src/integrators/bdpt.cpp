@@ -345,7 +345,7 @@ void BDPTIntegrator::Render(const Scene &scene) {
     if (scene.lights.size() > 0) {
         ParallelFor2D([&](const Point2i tile) {
             // Render a single tile using BDPT
-            MemoryArena arena;
+            MemoryArena &arena = PerThreadArena();
             int seed = tile.y * nXTiles + tile.x;
             std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
             int x0 = sampleBounds.pMin.x + tile.x * tileSize;
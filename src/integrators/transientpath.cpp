@@ -9,8 +9,14 @@
 #include "scene.h"
 #include "stats.h"
 #include "progressreporter.h"
+#include "parallel.h"
 #include "shapes/triangle.h" // used for specialized importance sampling
 #include <limits>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <mutex>
 
 namespace pbrt {
 
@@ -19,6 +25,7 @@ STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
 STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
 STAT_PERCENT("Transient/Occlusion", stat_occlusion, stat_occlusionTotalPaths);
 STAT_PERCENT("Transient/RecastLimitReached", stat_recastLimitReached, stat_recastLimitBelow);
+STAT_COUNTER("Transient/Paths terminated beyond t_max", nTimeCulledPaths);
 
 
 // this function is an exact copy of EstimateDirect except for the part that computes the path length
@@ -172,9 +179,11 @@ TransientPathIntegrator::TransientPathIntegrator(int maxDepth,
 							   std::unique_ptr<TransientFilm> film,
 							   bool ignoreDistanceToCamera,
 							   Float rrThreshold,
-                               const std::string &lightSampleStrategy):
+                               const std::string &lightSampleStrategy,
+							   Float timeBudget, bool timeAwareRR, bool wavefront, int tileSize):
 	maxDepth(maxDepth), camera(camera), sampler(sampler), pixelBounds(pixelBounds), ignoreDistanceToCamera(ignoreDistanceToCamera),
-	rrThreshold(rrThreshold), lightSampleStrategy(lightSampleStrategy),
+	rrThreshold(rrThreshold), lightSampleStrategy(lightSampleStrategy), timeBudget(timeBudget),
+	timeAwareRR(timeAwareRR), wavefront(wavefront), tileSize(tileSize), tmax(film->GetTMax()),
 	film(move(film))
 {
 }
@@ -213,8 +222,9 @@ void TransientPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
         bool foundIntersection = scene.Intersect(ray, &isect);
 		
 		// compute the length:
+		Float segmentLength = (isect.p-ray.o).Length();
 		if( ! (ignoreDistanceToCamera && bounces==0))
-			geometricPathLength += (isect.p-ray.o).Length();
+			geometricPathLength += segmentLength;
 
         // Possibly add emitted light at intersection
         if (bounces == 0 || specularBounce) {
@@ -322,13 +332,30 @@ void TransientPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
         // currently we do not support SSS, so the code is removed
 		// ...
 
+		// Every further vertex only makes the path longer. Once it is longer than
+		// t_max, all its future contributions would be dropped by the film, so we
+		// can terminate it right away without introducing any bias.
+		Float remainingLength = tmax - geometricPathLength;
+		if(timeAwareRR && remainingLength <= 0) {
+			++nTimeCulledPaths;
+			break;
+		}
+
+		// If the remaining length is shorter than the last segment, the next
+		// bounce will most likely already be too long. Lower the survival
+		// probability accordingly; dividing by it keeps the estimate unbiased.
+		Float timeFactor = 1;
+		if(timeAwareRR && segmentLength > 0)
+			timeFactor = Clamp(remainingLength / segmentLength, (Float).05, (Float)1);
+
         // Possibly terminate the path with Russian roulette.
         // Factor out radiance scaling due to refraction in rrBeta.
         Spectrum rrBeta = beta * etaScale;
-        if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) {
+        if ((rrBeta.MaxComponentValue() < rrThreshold || timeFactor < 1) && bounces > 3) {
             Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
-            if (sampler.Get1D() < q) break;
-            beta /= 1 - q;
+            Float pSurvive = (1 - q) * timeFactor;
+            if (sampler.Get1D() >= pSurvive) break;
+            beta /= pSurvive;
             DCHECK(!std::isinf(beta.y()));
         }
     }
@@ -336,6 +363,484 @@ void TransientPathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 }
 
 
+/* The wavefront renderer traces the paths of many camera samples together,
+   one bounce at a time, instead of following each path to its end like Li()
+   does. Every bounce is split into stages that each process all paths that
+   are still alive: finding the next vertex, shading it, and resolving the
+   shadow, MIS and reflector connection rays that shading asked for. The rays
+   of a stage are sorted by direction and origin and intersected as a batch,
+   so the BVH traversal sees coherent rays, and each stage only touches the
+   code and data it needs.
+
+   It computes the same estimate as Li(). The tile's sampler can only be
+   queried in sample order though, so it only provides the camera samples;
+   the decisions along the paths use a random number generator per path. */
+
+// Number of camera samples traced together
+static const int wavefrontSize = 4096;
+
+/* Starts the next sample of the current pixel. Each pixel of a pass takes
+   the samples from _firstSample_ on, which are set explicitly for passes
+   after the first (see Render()). */
+static bool StartNextPassSample(Sampler &sampler, int64_t firstSample) {
+	if(firstSample == 0)
+		return sampler.StartNextSample();
+	int64_t sampleNum = sampler.CurrentSampleNumber() + 1;
+	if(sampleNum >= firstSample + sampler.samplesPerPixel)
+		return false;
+	sampler.SetSampleNumber(sampleNum);
+	return true;
+}
+
+// State of a path between the stages of the wavefront renderer
+struct WavefrontPath {
+	// Camera sample
+	Point2f pFilm;
+	Float rayWeight;
+	TransientSampleCache cache;
+
+	RayDifferential ray;
+	Spectrum beta;
+	Float geometricPathLength, segmentLength, etaScale;
+	int bounces;
+	bool specularBounce;
+	RNG rng;
+
+	// Direct lighting at the current vertex. The shadow and MIS rays add
+	// their parts to _Ld_, which goes into the cache once both are resolved.
+	bool directLighting;
+	Spectrum Ld, shadowLd, misLd;
+	Float directPathLength;
+	const Light *misLight;
+	Ray shadowRay, misRay;
+
+	// Pending connection from the NLOS reflector to a hidden object
+	const Triangle *connectionTarget;
+	Spectrum connectionWeight;
+};
+
+// Buffers of the wavefront renderer; each thread keeps its own and reuses it
+// for all of its tiles, instead of allocating the paths and their
+// intersections again for every tile
+struct WavefrontBuffers {
+	WavefrontBuffers() : paths(wavefrontSize), isects(wavefrontSize), results(new bool[wavefrontSize]) {}
+
+	std::vector<WavefrontPath> paths;
+	std::vector<int> active, nextActive, skippedBoundaries;
+	std::vector<int> shadowPaths, misPaths, connectionPaths;
+	std::vector<std::pair<uint64_t, int>> keys;
+	std::vector<Ray> rays;
+	std::vector<SurfaceInteraction> isects;
+	std::unique_ptr<bool[]> results;
+};
+
+// The buffers returned by PerThreadWavefrontBuffers(), freed at exit
+static struct {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<WavefrontBuffers>> buffers;
+} perThreadWavefrontBuffers;
+static PBRT_THREAD_LOCAL WavefrontBuffers *wavefrontBuffers;
+
+static WavefrontBuffers &PerThreadWavefrontBuffers() {
+	if(!wavefrontBuffers) {
+		wavefrontBuffers = new WavefrontBuffers;
+		std::lock_guard<std::mutex> lock(perThreadWavefrontBuffers.mutex);
+		perThreadWavefrontBuffers.buffers.emplace_back(wavefrontBuffers);
+	}
+	return *wavefrontBuffers;
+}
+
+// Sort key that groups rays with the same direction octant and nearby
+// origins
+static uint64_t WavefrontRayKey(const Ray &ray, const Bounds3f &sceneBounds) {
+	auto spreadBits = [](uint64_t x) {
+		// Inserts two zero bits in front of each of the lowest 10 bits of _x_
+		x = (x | (x << 16)) & 0x30000ff;
+		x = (x | (x << 8)) & 0x300f00f;
+		x = (x | (x << 4)) & 0x30c30c3;
+		x = (x | (x << 2)) & 0x9249249;
+		return x;
+	};
+	Vector3f o = sceneBounds.Offset(ray.o);
+	uint64_t q[3];
+	for(int a = 0; a < 3; ++a)
+		q[a] = (uint64_t)Clamp(o[a] * 1024, 0, 1023);
+	uint64_t octant = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+	return (octant << 30) | (spreadBits(q[2]) << 2) | (spreadBits(q[1]) << 1) |
+		spreadBits(q[0]);
+}
+
+// Sorts _indices_ by the WavefrontRayKey() of _getRay(index)_, gathers those
+// rays into _buffers.rays_ and intersects them with the scene
+static void IntersectWavefront(const Scene &scene, std::vector<int> &indices,
+                               const std::function<const Ray &(int)> &getRay,
+                               WavefrontBuffers &buffers, bool withIsects) {
+	const Bounds3f &sceneBounds = scene.WorldBound();
+	std::vector<std::pair<uint64_t, int>> &keys = buffers.keys;
+	std::vector<Ray> &rays = buffers.rays;
+	keys.resize(indices.size());
+	for(size_t i = 0; i < indices.size(); ++i)
+		keys[i] = std::make_pair(WavefrontRayKey(getRay(indices[i]), sceneBounds), indices[i]);
+	std::sort(keys.begin(), keys.end());
+	rays.resize(indices.size());
+	for(size_t i = 0; i < indices.size(); ++i) {
+		indices[i] = keys[i].second;
+		rays[i] = getRay(indices[i]);
+	}
+	if(withIsects)
+		scene.IntersectBatch(rays.data(), rays.size(), buffers.isects.data(), buffers.results.get());
+	else
+		scene.IntersectPBatch(rays.data(), rays.size(), buffers.results.get());
+}
+
+void TransientPathIntegrator::RenderTileWavefront(const Scene &scene, Sampler &tileSampler,
+                                                  const Bounds2i &tileBounds,
+                                                  TransientFilmTile &filmTile,
+                                                  MemoryArena &arena, int seed,
+                                                  int64_t firstSample) const {
+	WavefrontBuffers &buffers = PerThreadWavefrontBuffers();
+	std::vector<WavefrontPath> &paths = buffers.paths;
+	std::vector<int> &active = buffers.active, &nextActive = buffers.nextActive;
+	std::vector<int> &skippedBoundaries = buffers.skippedBoundaries;
+	std::vector<int> &shadowPaths = buffers.shadowPaths, &misPaths = buffers.misPaths;
+	std::vector<int> &connectionPaths = buffers.connectionPaths;
+	std::vector<SurfaceInteraction> &isects = buffers.isects;
+	const bool *results = buffers.results.get();
+	uint64_t pathIndex = 0;
+
+	// Camera samples are taken in the same order as in Render()
+	Bounds2iIterator pixelIter = begin(tileBounds);
+	Point2i pixel;
+	bool inPixel = false;
+	auto startNextSample = [&]() {
+		if(inPixel && StartNextPassSample(tileSampler, firstSample))
+			return true;
+		inPixel = false;
+		while(pixelIter != end(tileBounds)) {
+			pixel = *pixelIter;
+			++pixelIter;
+			{
+				ProfilePhase pp(Prof::StartPixel);
+				tileSampler.StartPixel(pixel);
+			}
+			if(InsideExclusive(pixel, pixelBounds)) {
+				if(firstSample > 0)
+					tileSampler.SetSampleNumber(firstSample);
+				inPixel = true;
+				return true;
+			}
+		}
+		return false;
+	};
+
+	while(true) {
+		// Start the paths of the next wave of camera samples
+		int nPaths = 0;
+		active.clear();
+		while(nPaths < wavefrontSize && startNextSample()) {
+			WavefrontPath &path = paths[nPaths];
+			CameraSample cameraSample = tileSampler.GetCameraSample(pixel);
+			path.pFilm = cameraSample.pFilm;
+			path.rayWeight = camera->GenerateRayDifferential(cameraSample, &path.ray);
+			path.ray.ScaleDifferentials(1 / std::sqrt((Float)tileSampler.samplesPerPixel));
+			++nCameraRays;
+			path.cache = TransientSampleCache();
+			path.beta = Spectrum(1.f);
+			path.geometricPathLength = 0;
+			path.etaScale = 1;
+			path.bounces = 0;
+			path.specularBounce = false;
+			path.directLighting = false;
+			path.rng.SetSequence(((uint64_t)seed << 32) + pathIndex++);
+			if(path.rayWeight > 0)
+				active.push_back(nPaths);
+			++nPaths;
+		}
+		if(nPaths == 0)
+			break;
+
+		ProfilePhase p(Prof::SamplerIntegratorLi);
+		while(!active.empty()) {
+			// Find the next vertex of all active paths
+			IntersectWavefront(scene, active, [&](int i) -> const Ray & { return paths[i].ray; },
+			                   buffers, true);
+
+			// Shade the vertices. Paths that continue are collected in
+			// _nextActive_; light sampling and reflector connections queue
+			// their rays for the following stages.
+			nextActive.clear();
+			skippedBoundaries.clear();
+			shadowPaths.clear();
+			misPaths.clear();
+			connectionPaths.clear();
+			for(size_t k = 0; k < active.size(); ++k) {
+				int i = active[k];
+				WavefrontPath &path = paths[i];
+				SurfaceInteraction &isect = isects[k];
+				bool foundIntersection = results[k];
+				path.directLighting = false;
+				path.connectionTarget = nullptr;
+
+				path.segmentLength = (isect.p - path.ray.o).Length();
+				if(!(ignoreDistanceToCamera && path.bounces == 0))
+					path.geometricPathLength += path.segmentLength;
+
+				if(!foundIntersection || path.bounces >= maxDepth) {
+					ReportValue(pathLength, path.bounces);
+					continue;
+				}
+
+				isect.ComputeScatteringFunctions(path.ray, arena, true);
+				if(!isect.bsdf) {
+					// Skip over the medium boundary without counting a bounce
+					path.ray = isect.SpawnRay(path.ray.d);
+					skippedBoundaries.push_back(i);
+					continue;
+				}
+
+				auto triangleShape = dynamic_cast<const Triangle*>(isect.shape);
+				if(triangleShape && triangleShape->GetMesh()->objectSemantic == TriangleMesh::ObjectSemantic::NlosReflector) {
+					// Importance sample a hidden object, as in Li(); the
+					// connection is checked in its own stage
+					stat_occlusionTotalPaths++;
+					Float p_Select;
+					auto primNum = scene.nlosObjectsDistribution.SampleDiscrete(path.rng.UniformFloat(), &p_Select);
+					const auto& obj = scene.nlosObjects[primNum];
+					Float p_Sample;
+					auto sample = obj->Sample(isect, Point2f(path.rng.UniformFloat(), path.rng.UniformFloat()), &p_Sample);
+					Vector3f wo = -path.ray.d;
+					path.ray = isect.SpawnRay(Normalize(sample.p - isect.p));
+					Vector3f wi = path.ray.d;
+					path.connectionTarget = obj;
+					path.connectionWeight = isect.bsdf->f(wo, wi) * AbsDot(wi, isect.shading.n) /
+						(p_Sample * p_Select);
+					connectionPaths.push_back(i);
+					continue;
+				}
+
+				// Sample illumination from lights, as
+				// TransientUniformSampleOneLight() does, but queue the
+				// shadow ray and the MIS ray instead of tracing them
+				const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
+				int nLights = int(scene.lights.size());
+				if(isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0 && nLights > 0) {
+					++totalPaths;
+					BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+					Float lightSelectPdf;
+					int lightNum = distrib->SampleDiscrete(path.rng.UniformFloat(), &lightSelectPdf);
+					if(lightSelectPdf > 0) {
+						const Light &light = *scene.lights[lightNum];
+						Point2f uLight(path.rng.UniformFloat(), path.rng.UniformFloat());
+						Point2f uScattering(path.rng.UniformFloat(), path.rng.UniformFloat());
+						path.directLighting = true;
+						path.Ld = Spectrum(0.f);
+						path.shadowLd = Spectrum(0.f);
+						path.misLd = Spectrum(0.f);
+						path.misLight = nullptr;
+
+						// Light sampling part
+						Vector3f wi;
+						Float lightPdf = 0, scatteringPdf = 0;
+						VisibilityTester visibility;
+						Spectrum Li = light.Sample_Li(isect, uLight, &wi, &lightPdf, &visibility);
+						path.directPathLength = path.geometricPathLength +
+							(visibility.P0().p - visibility.P1().p).Length();
+						if(lightPdf > 0 && !Li.IsBlack()) {
+							Spectrum f = isect.bsdf->f(isect.wo, wi, bsdfFlags) * AbsDot(wi, isect.shading.n);
+							scatteringPdf = isect.bsdf->Pdf(isect.wo, wi, bsdfFlags);
+							if(!f.IsBlack()) {
+								Float weight = IsDeltaLight(light.flags) ? 1 :
+									PowerHeuristic(1, lightPdf, 1, scatteringPdf);
+								path.shadowLd = path.beta * f * Li * weight / (lightPdf * lightSelectPdf);
+								path.shadowRay = visibility.P0().SpawnRayTo(visibility.P1());
+								shadowPaths.push_back(i);
+							}
+						}
+
+						// BSDF sampling part
+						if(!IsDeltaLight(light.flags)) {
+							BxDFType sampledType;
+							Spectrum f = isect.bsdf->Sample_f(isect.wo, &wi, uScattering, &scatteringPdf,
+							                                  bsdfFlags, &sampledType);
+							f *= AbsDot(wi, isect.shading.n);
+							if(!f.IsBlack() && scatteringPdf > 0) {
+								Float weight = 1;
+								if(!(sampledType & BSDF_SPECULAR)) {
+									lightPdf = light.Pdf_Li(isect, wi);
+									weight = PowerHeuristic(1, scatteringPdf, 1, lightPdf);
+								}
+								if(lightPdf > 0 || (sampledType & BSDF_SPECULAR)) {
+									path.misLd = path.beta * f * weight / (scatteringPdf * lightSelectPdf);
+									path.misLight = &light;
+									path.misRay = isect.SpawnRay(wi);
+									misPaths.push_back(i);
+								}
+							}
+						}
+					}
+				}
+
+				// Sample BSDF to get new path direction
+				Vector3f wo = -path.ray.d;
+				Vector3f wi;
+				Float pdf;
+				BxDFType flags;
+				Point2f u(path.rng.UniformFloat(), path.rng.UniformFloat());
+				Spectrum f = isect.bsdf->Sample_f(wo, &wi, u, &pdf, BSDF_ALL, &flags);
+				if(f.IsBlack() || pdf == 0.f) {
+					ReportValue(pathLength, path.bounces);
+					continue;
+				}
+				path.beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+				CHECK_GE(path.beta.y(), 0.f);
+				DCHECK(!std::isinf(path.beta.y()));
+				path.specularBounce = (flags & BSDF_SPECULAR) != 0;
+				if((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+					Float eta = isect.bsdf->eta;
+					path.etaScale *= (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+				}
+				path.ray = isect.SpawnRay(wi);
+				nextActive.push_back(i);
+			}
+
+			// Resolve the direct lighting of the vertices shaded above
+			IntersectWavefront(scene, shadowPaths, [&](int i) -> const Ray & { return paths[i].shadowRay; },
+			                   buffers, false);
+			for(size_t k = 0; k < shadowPaths.size(); ++k)
+				if(!results[k])
+					paths[shadowPaths[k]].Ld += paths[shadowPaths[k]].shadowLd;
+			IntersectWavefront(scene, misPaths, [&](int i) -> const Ray & { return paths[i].misRay; },
+			                   buffers, true);
+			for(size_t k = 0; k < misPaths.size(); ++k) {
+				WavefrontPath &path = paths[misPaths[k]];
+				Spectrum Li(0.f);
+				if(results[k]) {
+					if(isects[k].primitive->GetAreaLight() == path.misLight)
+						Li = isects[k].Le(-path.misRay.d);
+				} else
+					Li = path.misLight->Le(path.misRay);
+				path.Ld += path.misLd * Li;
+			}
+			for(int i = 0; i < nPaths; ++i) {
+				WavefrontPath &path = paths[i];
+				if(!path.directLighting)
+					continue;
+				if(path.Ld.IsBlack())
+					++zeroRadiancePaths;
+				path.cache.push_back({path.Ld, path.directPathLength});
+				path.directLighting = false;
+			}
+
+			// Check the reflector connections
+			IntersectWavefront(scene, connectionPaths, [&](int i) -> const Ray & { return paths[i].ray; },
+			                   buffers, true);
+			for(size_t k = 0; k < connectionPaths.size(); ++k) {
+				WavefrontPath &path = paths[connectionPaths[k]];
+				if(results[k] && isects[k].shape == path.connectionTarget) {
+					path.beta *= path.connectionWeight;
+					nextActive.push_back(connectionPaths[k]);
+				} else {
+					stat_occlusion++;
+					ReportValue(pathLength, path.bounces);
+				}
+			}
+
+			// Time culling and Russian roulette, as in Li()
+			active.clear();
+			for(int i : nextActive) {
+				WavefrontPath &path = paths[i];
+				Float remainingLength = tmax - path.geometricPathLength;
+				if(timeAwareRR && remainingLength <= 0) {
+					++nTimeCulledPaths;
+					ReportValue(pathLength, path.bounces);
+					continue;
+				}
+				Float timeFactor = 1;
+				if(timeAwareRR && path.segmentLength > 0)
+					timeFactor = Clamp(remainingLength / path.segmentLength, (Float).05, (Float)1);
+				Spectrum rrBeta = path.beta * path.etaScale;
+				if((rrBeta.MaxComponentValue() < rrThreshold || timeFactor < 1) && path.bounces > 3) {
+					Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+					Float pSurvive = (1 - q) * timeFactor;
+					if(path.rng.UniformFloat() >= pSurvive) {
+						ReportValue(pathLength, path.bounces);
+						continue;
+					}
+					path.beta /= pSurvive;
+				}
+				++path.bounces;
+				active.push_back(i);
+			}
+			active.insert(active.end(), skippedBoundaries.begin(), skippedBoundaries.end());
+			arena.Reset();
+		}
+
+		// Add the finished camera samples to the film
+		for(int i = 0; i < nPaths; ++i)
+			filmTile.AddSample(paths[i].pFilm, paths[i].cache, paths[i].rayWeight);
+	}
+}
+
+
+
+/* The film tile of a _tileSize_ x _tileSize_ tile holds tresolution bins per
+   pixel, plus the filter's padding around it. The automatic tile size is the
+   largest one up to 16 (the fixed size pbrt uses) whose buffer still fits into
+   this many bytes, i.e. roughly into the L2 cache. */
+static const size_t tileCacheBytes = 2 << 20;
+
+static int AutomaticTileSize(int tresolution, const Vector2f &filterRadius) {
+	for(int size = 16; size > 1; --size) {
+		size_t width = size + 2 * (size_t)std::ceil(filterRadius.x);
+		size_t height = size + 2 * (size_t)std::ceil(filterRadius.y);
+		if(width * height * tresolution * sizeof(Float) <= tileCacheBytes)
+			return size;
+	}
+	return 1;
+}
+
+// Scrambles the bits of a tile index, so that it can be truncated to the
+// 32-bit seed of a sampler.
+static uint64_t MixBits(uint64_t v) {
+	v ^= (v >> 31);
+	v *= 0x7fb5d329728ea185;
+	v ^= (v >> 27);
+	v *= 0x81dadef4bc2dd44d;
+	v ^= (v >> 33);
+	return v;
+}
+
+// Returns all tiles in the order of a Hilbert curve, so that consecutive tiles
+// are next to each other and see mostly the same geometry.
+static std::vector<Point2i> HilbertTileOrder(const Point2i &nTiles) {
+	int n = 1;
+	while(n < nTiles.x || n < nTiles.y)
+		n *= 2;
+	std::vector<Point2i> order;
+	order.reserve(nTiles.x * nTiles.y);
+	for(int64_t d = 0; d < int64_t(n) * n; ++d) {
+		// Map the curve index _d_ to a point in the _n_ x _n_ square
+		int x = 0, y = 0;
+		int64_t t = d;
+		for(int s = 1; s < n; s *= 2) {
+			int rx = 1 & int(t / 2);
+			int ry = 1 & int(t ^ rx);
+			if(ry == 0) {
+				if(rx == 1) {
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			t /= 4;
+		}
+		if(x < nTiles.x && y < nTiles.y)
+			order.push_back(Point2i(x, y));
+	}
+	return order;
+}
 
 void TransientPathIntegrator::Render(const Scene &scene)
 {
@@ -347,34 +852,120 @@ void TransientPathIntegrator::Render(const Scene &scene)
 	// Compute number of tiles, _nTiles_, to use for parallel rendering
 	Bounds2i sampleBounds = film->GetSampleBounds();
 	Vector2i sampleExtent = sampleBounds.Diagonal();
-	const int tileSize = 16;
+	const int tileSize = this->tileSize > 0 ? this->tileSize :
+		AutomaticTileSize(film->fullResolution.z, film->filter->radius);
 	Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
 		(sampleExtent.y + tileSize - 1) / tileSize);
-	ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
-	{
-		ParallelFor2D([&](Point2i tile) {
-			// Render section of image corresponding to _tile_
+	LOG(INFO) << "Rendering " << nTiles.x * nTiles.y << " tiles of " << tileSize << "x" << tileSize << " pixels";
+
+	/* Without a time budget we render exactly one pass, i.e. every pixel gets
+	   the sampler's samplesPerPixel. With a time budget, further passes are
+	   rendered until the budget is used up. Once it is, no new tiles are started,
+	   so the last pass may only cover parts of the image. This is fine, as each
+	   sample also adds its filter weight and WriteImage() divides by that sum,
+	   so pixels with more samples are just less noisy. The first pass is always
+	   completed, otherwise some pixels would end up without any sample at all. */
+	const auto renderStartTime = std::chrono::steady_clock::now();
+	auto BudgetExpired = [&]() {
+		std::chrono::duration<Float> elapsed = std::chrono::steady_clock::now() - renderStartTime;
+		return timeBudget > 0 && elapsed.count() >= timeBudget;
+	};
+
+	/* The tiles are handed out along a Hilbert curve. With threads pinned to
+	   several NUMA nodes (--pinthreads), every node has its own queue with the
+	   tiles of the band of the film that is stored on it, so that the tiles are
+	   merged into local memory. Once a thread's node runs out of tiles, it helps
+	   with those of the other nodes. */
+	const int nNodes = NumNumaNodes();
+	std::vector<std::vector<Bounds2i>> nodeTiles(nNodes);
+	for(Point2i tile : HilbertTileOrder(nTiles)) {
+		int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+		int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+		int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+		int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+		nodeTiles[film->GetNumaNode((y0 + y1) / 2)].push_back(Bounds2i(Point2i(x0, y0), Point2i(x1, y1)));
+	}
+	struct TileQueue {
+		std::mutex mutex;
+		std::deque<Bounds2i> tiles;
+	};
+	const int nThreads = MaxThreadIndex();
+
+	int completedPasses = 0;
+	for(int pass = 0; ; ++pass) {
+		std::atomic<bool> passComplete{true};
+		ProgressReporter reporter(sampleBounds.Area(),
+			timeBudget > 0 ? StringPrintf("Rendering (pass %d)", pass + 1) : "Rendering");
+
+		std::vector<TileQueue> queues(nNodes);
+		std::atomic<int> nQueuedTiles{0};
+		for(int node = 0; node < nNodes; ++node) {
+			queues[node].tiles.assign(nodeTiles[node].begin(), nodeTiles[node].end());
+			nQueuedTiles += (int)nodeTiles[node].size();
+		}
+
+		/* Takes the next tile. Towards the end of the pass, when there are fewer
+		   tiles left than threads, the tiles are split into quarters, down to
+		   4x4 pixels, so that a few expensive tiles don't leave all but one
+		   thread idle. */
+		auto NextTile = [&](Bounds2i *tileBounds) {
+			for(int i = 0; i < nNodes; ++i) {
+				TileQueue &queue = queues[(ThreadNumaNode() + i) % nNodes];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				if(queue.tiles.empty())
+					continue;
+				*tileBounds = queue.tiles.front();
+				queue.tiles.pop_front();
+				Vector2i extent = tileBounds->Diagonal();
+				if(nQueuedTiles <= nThreads && extent.x >= 8 && extent.y >= 8) {
+					Point2i pMid = tileBounds->pMin + extent / 2;
+					queue.tiles.push_front(Bounds2i(pMid, tileBounds->pMax));
+					queue.tiles.push_front(Bounds2i(Point2i(tileBounds->pMin.x, pMid.y), Point2i(pMid.x, tileBounds->pMax.y)));
+					queue.tiles.push_front(Bounds2i(Point2i(pMid.x, tileBounds->pMin.y), Point2i(tileBounds->pMax.x, pMid.y)));
+					*tileBounds = Bounds2i(tileBounds->pMin, pMid);
+					nQueuedTiles += 3;
+				}
+				--nQueuedTiles;
+				return true;
+			}
+			return false;
+		};
+
+		/* Global samplers like "halton" and "sobol" ignore the seed passed to
+		   Clone() and would repeat the samples of the first pass, so every pass
+		   continues their sequence after the samples of the earlier ones. */
+		const int64_t firstSample = dynamic_cast<GlobalSampler *>(sampler.get()) ?
+			pass * sampler->samplesPerPixel : 0;
+
+		auto RenderTile = [&](const Bounds2i &tileBounds) {
+			// Render section of image corresponding to _tileBounds_
+
+			// Skipped tiles aren't reported as work done, so that the progress
+			// shows how much of the pass was rendered
+			if(pass > 0 && BudgetExpired()) {
+				passComplete = false;
+				return;
+			}
 
-			// Allocate _MemoryArena_ for tile
-			MemoryArena arena;
+			// Use this thread's _MemoryArena_ for the tile
+			MemoryArena &arena = PerThreadArena();
 
-			// Get sampler instance for tile
-			int seed = tile.y * nTiles.x + tile.x;
+			// Get sampler instance for tile; the seed only depends on its
+			// position, as tiles may be split. The index of its first sample
+			// overflows an int after enough passes.
+			int64_t tileIndex = ((int64_t)pass * sampleExtent.y + tileBounds.pMin.y -
+				sampleBounds.pMin.y) * sampleExtent.x + tileBounds.pMin.x - sampleBounds.pMin.x;
+			int seed = (int32_t)(uint32_t)MixBits(tileIndex);
 			std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-
-			// Compute sample bounds for tile
-			int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-			int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-			int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-			int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-			Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
 			LOG(INFO) << "Starting image tile " << tileBounds;
 
 			// Get _FilmTile_ for tile
 			auto filmTile = film->GetFilmTile(tileBounds);
 
 			// Loop over pixels in tile to render them
-			for(Point2i pixel : tileBounds) {
+			if(wavefront)
+				RenderTileWavefront(scene, *tileSampler, tileBounds, *filmTile, arena, seed, firstSample);
+			else for(Point2i pixel : tileBounds) {
 				{
 					ProfilePhase pp(Prof::StartPixel);
 					tileSampler->StartPixel(pixel);
@@ -386,6 +977,8 @@ void TransientPathIntegrator::Render(const Scene &scene)
 				// debugging.
 				if(!InsideExclusive(pixel, pixelBounds))
 					continue;
+				if(firstSample > 0)
+					tileSampler->SetSampleNumber(firstSample);
 
 				do {
 					// Initialize _CameraSample_ for current sample
@@ -445,23 +1038,40 @@ void TransientPathIntegrator::Render(const Scene &scene)
 					// Free _MemoryArena_ memory from computing image sample
 					// value
 					arena.Reset();
-				} while(tileSampler->StartNextSample());
+				} while(StartNextPassSample(*tileSampler, firstSample));
 			}
 			LOG(INFO) << "Finished image tile " << tileBounds;
+			arena.Reset();
 
 			// Merge image tile into _Film_
 			film->MergeFilmTile(std::move(filmTile));
-			reporter.Update();
-		}, nTiles);
-		reporter.Done();
+			reporter.Update(tileBounds.Area());
+		};
+
+		// Every thread keeps taking tiles until all are done
+		ParallelFor([&](int64_t) {
+			Bounds2i tileBounds;
+			while(NextTile(&tileBounds))
+				RenderTile(tileBounds);
+		}, nThreads);
+		if(passComplete) {
+			reporter.Done();
+			++completedPasses;
+		}
+
+		if(timeBudget <= 0 || !passComplete || BudgetExpired())
+			break;
 	}
-	LOG(INFO) << "Rendering finished";
+	LOG(INFO) << "Rendering finished after " << completedPasses << " complete pass(es)";
+
+	// the metadata should reflect the number of samples actually taken
+	if(timeBudget > 0)
+		g_TFMD.RenderSamples = completedPasses * sampler->samplesPerPixel;
 
 	// Save final image after rendering
 	film->WriteImage();
 }
 
-
 std::unique_ptr<TransientPathIntegrator> CreateTransientPathIntegrator(const ParamSet &params,
                                      std::shared_ptr<Sampler> sampler,
 									 std::shared_ptr<const Camera> camera,
@@ -487,8 +1097,28 @@ std::unique_ptr<TransientPathIntegrator> CreateTransientPathIntegrator(const Par
 
 	bool ignoreDistanceToCamera = params.FindOneBool("ignoreDistanceToCamera", false);
 
+	// render time in seconds; 0 renders exactly the sampler's pixelsamples
+	Float timeBudget = params.FindOneFloat("timebudget", 0);
+	if(timeBudget < 0) {
+		Error("\"timebudget\" must not be negative. Ignoring it.");
+		timeBudget = 0;
+	}
+
+	// terminate paths that can't reach the time range [t_min, t_max] any more
+	bool timeAwareRR = params.FindOneBool("timeawarerr", true);
+
+	// trace the paths of many samples breadth-first instead of one after the other
+	bool wavefront = params.FindOneBool("wavefront", false);
+
+	// edge length of the image tiles in pixels; 0 chooses it from tresolution
+	int tileSize = params.FindOneInt("tilesize", 0);
+	if(tileSize < 0) {
+		Error("\"tilesize\" must not be negative. Choosing it automatically.");
+		tileSize = 0;
+	}
+
 	return std::make_unique<TransientPathIntegrator>(maxDepth, camera, sampler, pixelBounds, std::move(film), ignoreDistanceToCamera,
-                              rrThreshold, lightStrategy);
+                              rrThreshold, lightStrategy, timeBudget, timeAwareRR, wavefront, tileSize);
 }
 
 }  // namespace pbrt
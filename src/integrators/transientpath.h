@@ -28,7 +28,11 @@ public:
 							std::unique_ptr<TransientFilm> film,
 							bool ignoreDistanceToCamera,
 							Float rrThreshold = 1,
-							const std::string &lightSampleStrategy = "spatial");
+							const std::string &lightSampleStrategy = "spatial",
+							Float timeBudget = 0,
+							bool timeAwareRR = true,
+							bool wavefront = false,
+							int tileSize = 0);
 
 	/// we don't strictly need this method (it is more of a interface), but we keep it
 	/// so that our structure is closer to the original implementation.
@@ -37,6 +41,11 @@ public:
 	                    MemoryArena &arena, TransientSampleCache& cache, int depth = 0) const;
 	virtual void Render(const Scene &scene);
 private:
+	// renders a tile with the breadth-first alternative to Li(), see the .cpp
+	void RenderTileWavefront(const Scene &scene, Sampler &tileSampler, const Bounds2i &tileBounds,
+	                         TransientFilmTile &filmTile, MemoryArena &arena, int seed,
+	                         int64_t firstSample) const;
+
 	const int maxDepth;
 	std::shared_ptr<const Camera> camera;
 	std::shared_ptr<Sampler> sampler;
@@ -44,6 +53,11 @@ private:
 	const Float rrThreshold;
 	const std::string lightSampleStrategy;
 	const bool ignoreDistanceToCamera;
+	const Float timeBudget; ///< in seconds; if > 0, sample passes are repeated until it is used up
+	const bool timeAwareRR; ///< include the remaining path length up to t_max in the russian roulette
+	const bool wavefront; ///< render with RenderTileWavefront() instead of Li()
+	const int tileSize; ///< in pixels; 0 chooses it from the film's tresolution
+	const Float tmax; ///< copied from the film, as paths longer than this don't contribute
 	
 	std::unique_ptr<LightDistribution> lightDistribution; // created during preprocessing
 
@@ -52,9 +52,16 @@ Rendering options:
   --help               Print this help text.
   --nthreads <num>     Use specified number of threads for rendering.
   --outfile <filename> Write the final image to the given filename.
+  --pinthreads         Pin each rendering thread to a core, and keep the film
+                       memory of each NUMA node with its threads.
   --quick              Automatically reduce a number of quality settings to
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
+  --telemetry <dest>   While rendering, periodically append a line of JSON with
+                       the progress and per-thread statistics to the given
+                       file, or send it to a Unix socket with "unix:<path>".
+  --telemetryinterval <seconds>
+                       Seconds between telemetry snapshots. Default: 10.
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -70,6 +77,8 @@ Reformatting options:
   --toply              Print a reformatted version of the input file(s) to
                        standard output and convert all triangle meshes to
                        PLY files. Does not render an image.
+  --tobinarymesh       Like --toply, but convert the triangle meshes to
+                       "binarymesh" files, which are loaded without parsing.
 )");
     exit(msg ? 1 : 0);
 }
@@ -102,6 +111,20 @@ int main(int argc, char *argv[]) {
             options.cropWindow[1][1] = atof(argv[++i]);
         } else if (!strncmp(argv[i], "--outfile=", 10)) {
             options.imageFile = &argv[i][10];
+        } else if (!strcmp(argv[i], "--telemetry") ||
+                   !strcmp(argv[i], "-telemetry")) {
+            if (i + 1 == argc)
+                usage("missing value after --telemetry argument");
+            options.telemetry = argv[++i];
+        } else if (!strncmp(argv[i], "--telemetry=", 12)) {
+            options.telemetry = &argv[i][12];
+        } else if (!strcmp(argv[i], "--telemetryinterval") ||
+                   !strcmp(argv[i], "-telemetryinterval")) {
+            if (i + 1 == argc)
+                usage("missing value after --telemetryinterval argument");
+            options.telemetryInterval = atof(argv[++i]);
+        } else if (!strncmp(argv[i], "--telemetryinterval=", 20)) {
+            options.telemetryInterval = atof(&argv[i][20]);
 
         } else if (!strcmp(argv[i], "--logdir") || !strcmp(argv[i], "-logdir")) {
             if (i + 1 == argc)
@@ -121,10 +144,17 @@ int main(int argc, char *argv[]) {
             options.quickRender = true;
         } else if (!strcmp(argv[i], "--quiet") || !strcmp(argv[i], "-quiet")) {
             options.quiet = true;
+        } else if (!strcmp(argv[i], "--pinthreads") ||
+                   !strcmp(argv[i], "-pinthreads")) {
+            options.pinThreads = true;
         } else if (!strcmp(argv[i], "--cat") || !strcmp(argv[i], "-cat")) {
             options.cat = true;
         } else if (!strcmp(argv[i], "--toply") || !strcmp(argv[i], "-toply")) {
             options.toPly = true;
+        } else if (!strcmp(argv[i], "--tobinarymesh") ||
+                   !strcmp(argv[i], "-tobinarymesh")) {
+            options.toPly = true;
+            options.toBinaryMesh = true;
         } else if (!strcmp(argv[i], "--v") || !strcmp(argv[i], "-v")) {
             if (i + 1 == argc)
                 usage("missing value after --v argument");
@@ -0,0 +1,261 @@
+
+
+// shapes/binarymesh.cpp*
+#include "shapes/binarymesh.h"
+#include "fileutil.h"
+#include "paramset.h"
+#include "textures/constant.h"
+
+namespace pbrt {
+
+STAT_MEMORY_COUNTER("Memory/Binary mesh files mapped", binaryMeshBytes);
+STAT_COUNTER("Scene/Binary meshes used in place", nAdoptedMeshes);
+
+static const char binaryMeshMagic[4] = {'P', 'B', 'M', 'S'};
+static PBRT_CONSTEXPR uint32_t binaryMeshVersion = 1;
+static_assert(sizeof(BinaryMeshHeader) == 32,
+              "Unexpected BinaryMeshHeader size");
+static_assert(sizeof(Point3f) == 3 * sizeof(Float) &&
+                  sizeof(Normal3f) == 3 * sizeof(Float) &&
+                  sizeof(Vector3f) == 3 * sizeof(Float) &&
+                  sizeof(Point2f) == 2 * sizeof(Float),
+              "Unexpected point/vector layout");
+
+// BinaryMesh Local Definitions
+
+// Offsets of the arrays from the start of a binary mesh file, 0 for the
+// ones that aren't present, and the total size
+struct BinaryMeshLayout {
+    BinaryMeshLayout(uint32_t flags, size_t nTriangles, size_t nVertices) {
+        size_t offset = sizeof(BinaryMeshHeader);
+        auto add = [&](bool present, size_t nValues) -> size_t {
+            if (!present) return 0;
+            size_t start = (offset + 15) & ~size_t(15);
+            offset = start + 4 * nValues;
+            return start;
+        };
+        indices = add(true, 3 * nTriangles);
+        p = add(true, 3 * nVertices);
+        n = add(flags & BinaryMeshHasN, 3 * nVertices);
+        s = add(flags & BinaryMeshHasS, 3 * nVertices);
+        uv = add(flags & BinaryMeshHasUV, 2 * nVertices);
+        faceIndices = add(flags & BinaryMeshHasFaceIndices, nTriangles);
+        size = offset;
+    }
+    size_t indices, p, n, s, uv, faceIndices, size;
+};
+
+static bool HostIsLittleEndian() {
+    uint32_t one = 1;
+    uint8_t firstByte;
+    memcpy(&firstByte, &one, 1);
+    return firstByte == 1;
+}
+
+static uint32_t ReadLittleEndian32(const char *ptr) {
+    const uint8_t *b = (const uint8_t *)ptr;
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) |
+           ((uint32_t)b[3] << 24);
+}
+
+// Converting reads, for hosts where the arrays can't be used in place
+static void ReadFloats(const char *ptr, size_t n, Float *out) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = BitsToFloat(ReadLittleEndian32(ptr + 4 * i));
+}
+
+static void ReadInts(const char *ptr, size_t n, int *out) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = (int32_t)ReadLittleEndian32(ptr + 4 * i);
+}
+
+// Buffered writes of little-endian 32-bit values
+class BinaryMeshWriter {
+  public:
+    explicit BinaryMeshWriter(FILE *f) : f(f) {}
+    void WriteBytes(const char *bytes, size_t n) {
+        buffer.insert(buffer.end(), bytes, bytes + n);
+    }
+    void Write(uint32_t v) {
+        for (int i = 0; i < 4; ++i) buffer.push_back((v >> (8 * i)) & 0xff);
+        if (buffer.size() >= 65536) Flush();
+    }
+    void Write(int v) { Write((uint32_t)v); }
+    void Write(float v) { Write(FloatToBits(v)); }
+    void Write(double v) { Write(FloatToBits((float)v)); }
+    template <typename T>
+    void WriteArray(const T *values, size_t n) {
+        // Pad so that the array starts at a multiple of 16 bytes
+        while ((written + buffer.size()) % 16) buffer.push_back(0);
+        for (size_t i = 0; i < n; ++i) Write(values[i]);
+    }
+    bool Flush() {
+        ok = ok && fwrite(buffer.data(), 1, buffer.size(), f) == buffer.size();
+        written += buffer.size();
+        buffer.clear();
+        return ok;
+    }
+
+  private:
+    FILE *f;
+    std::vector<uint8_t> buffer;
+    size_t written = 0;
+    bool ok = true;
+};
+
+// BinaryMesh Function Definitions
+std::vector<std::shared_ptr<Shape>> CreateBinaryMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures) {
+    const std::string filename = params.FindOneFilename("filename", "");
+    // Can be used in place if the file's representation matches ours
+    bool inPlace = sizeof(Float) == sizeof(float) && HostIsLittleEndian();
+    std::shared_ptr<MappedFile> file = MappedFile::Open(filename, inPlace);
+    if (!file) {
+        Error("Couldn't open binary mesh file \"%s\": %s", filename.c_str(),
+              strerror(errno));
+        return std::vector<std::shared_ptr<Shape>>();
+    }
+
+    // Check the header and that the file holds all of the arrays
+    BinaryMeshHeader header;
+    if (file->Size() >= sizeof(header))
+        memcpy(&header, file->Data(), sizeof(header));
+    if (file->Size() < sizeof(header) ||
+        memcmp(header.magic, binaryMeshMagic, 4) != 0 ||
+        ReadLittleEndian32((const char *)&header.version) !=
+            binaryMeshVersion) {
+        Error("%s: not a binary mesh file of this version", filename.c_str());
+        return std::vector<std::shared_ptr<Shape>>();
+    }
+    uint32_t flags = ReadLittleEndian32((const char *)&header.flags);
+    int nTriangles = ReadLittleEndian32((const char *)&header.nTriangles);
+    int nVertices = ReadLittleEndian32((const char *)&header.nVertices);
+    BinaryMeshLayout layout(flags, std::max(nTriangles, 0),
+                            std::max(nVertices, 0));
+    if (nTriangles <= 0 || nVertices <= 0 || file->Size() < layout.size) {
+        Error("%s: truncated or empty binary mesh file", filename.c_str());
+        return std::vector<std::shared_ptr<Shape>>();
+    }
+    const char *data = file->Data();
+    for (int i = 0; i < 3 * nTriangles; ++i) {
+        int32_t index = ReadLittleEndian32(data + layout.indices + 4 * i);
+        if (index < 0 || index >= nVertices) {
+            Error("%s: out of bounds vertex index %d (%d vertices)",
+                  filename.c_str(), index, nVertices);
+            return std::vector<std::shared_ptr<Shape>>();
+        }
+    }
+
+    // Look up an alpha texture, if applicable
+    std::shared_ptr<Texture<Float>> alphaTex;
+    std::string alphaTexName = params.FindTexture("alpha");
+    if (alphaTexName != "") {
+        if (floatTextures->find(alphaTexName) != floatTextures->end())
+            alphaTex = (*floatTextures)[alphaTexName];
+        else
+            Error("Couldn't find float texture \"%s\" for \"alpha\" parameter",
+                  alphaTexName.c_str());
+    } else if (params.FindOneFloat("alpha", 1.f) == 0.f)
+        alphaTex.reset(new ConstantTexture<Float>(0.f));
+
+    std::shared_ptr<Texture<Float>> shadowAlphaTex;
+    std::string shadowAlphaTexName = params.FindTexture("shadowalpha");
+    if (shadowAlphaTexName != "") {
+        if (floatTextures->find(shadowAlphaTexName) != floatTextures->end())
+            shadowAlphaTex = (*floatTextures)[shadowAlphaTexName];
+        else
+            Error(
+                "Couldn't find float texture \"%s\" for \"shadowalpha\" "
+                "parameter",
+                shadowAlphaTexName.c_str());
+    } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
+        shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
+
+    auto objectSemantic = static_cast<TriangleMesh::ObjectSemantic>(
+        params.FindOneInt("ObjectSemantic", 0));
+
+    if (!inPlace) {
+        // Convert the arrays and create a regular mesh
+        std::vector<int> indices(3 * nTriangles), faceIndices;
+        std::vector<Point3f> P(nVertices);
+        std::vector<Normal3f> N;
+        std::vector<Vector3f> S;
+        std::vector<Point2f> uv;
+        ReadInts(data + layout.indices, indices.size(), indices.data());
+        ReadFloats(data + layout.p, 3 * P.size(), &P[0].x);
+        if (layout.n) {
+            N.resize(nVertices);
+            ReadFloats(data + layout.n, 3 * N.size(), &N[0].x);
+        }
+        if (layout.s) {
+            S.resize(nVertices);
+            ReadFloats(data + layout.s, 3 * S.size(), &S[0].x);
+        }
+        if (layout.uv) {
+            uv.resize(nVertices);
+            ReadFloats(data + layout.uv, 2 * uv.size(), &uv[0].x);
+        }
+        if (layout.faceIndices) {
+            faceIndices.resize(nTriangles);
+            ReadInts(data + layout.faceIndices, faceIndices.size(),
+                     faceIndices.data());
+        }
+        return CreateTriangleMesh(
+            o2w, w2o, reverseOrientation, nTriangles, indices.data(),
+            nVertices, P.data(), S.empty() ? nullptr : S.data(),
+            N.empty() ? nullptr : N.data(), uv.empty() ? nullptr : uv.data(),
+            alphaTex, shadowAlphaTex,
+            faceIndices.empty() ? nullptr : faceIndices.data(),
+            objectSemantic);
+    }
+
+    // Hand the arrays in the mapping over to the mesh
+    char *mutableData = file->MutableData();
+    auto array = [&](size_t offset) -> char * {
+        return offset ? mutableData + offset : nullptr;
+    };
+    binaryMeshBytes += file->Size();
+    ++nAdoptedMeshes;
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
+        *o2w, nTriangles, (int *)array(layout.indices), nVertices,
+        (Point3f *)array(layout.p), (Vector3f *)array(layout.s),
+        (Normal3f *)array(layout.n), (Point2f *)array(layout.uv), alphaTex,
+        shadowAlphaTex, (int *)array(layout.faceIndices), objectSemantic,
+        file);
+    return CreateTriangles(o2w, w2o, reverseOrientation, mesh);
+}
+
+bool WriteBinaryMeshFile(const std::string &filename, int nTriangles,
+                         const int *vertexIndices, int nVertices,
+                         const Point3f *P, const Vector3f *S,
+                         const Normal3f *N, const Point2f *UV,
+                         const int *faceIndices) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+
+    BinaryMeshWriter writer(f);
+    uint32_t flags = 0;
+    if (N) flags |= BinaryMeshHasN;
+    if (S) flags |= BinaryMeshHasS;
+    if (UV) flags |= BinaryMeshHasUV;
+    if (faceIndices) flags |= BinaryMeshHasFaceIndices;
+    writer.WriteBytes(binaryMeshMagic, 4);
+    writer.Write(binaryMeshVersion);
+    writer.Write(flags);
+    writer.Write(nTriangles);
+    writer.Write(nVertices);
+    for (int i = 0; i < 3; ++i) writer.Write(0u);
+
+    writer.WriteArray(vertexIndices, 3 * nTriangles);
+    writer.WriteArray(&P[0].x, 3 * nVertices);
+    if (N) writer.WriteArray(&N[0].x, 3 * nVertices);
+    if (S) writer.WriteArray(&S[0].x, 3 * nVertices);
+    if (UV) writer.WriteArray(&UV[0].x, 2 * nVertices);
+    if (faceIndices) writer.WriteArray(faceIndices, nTriangles);
+    bool ok = writer.Flush();
+    return (fclose(f) == 0) && ok;
+}
+
+}  // namespace pbrt
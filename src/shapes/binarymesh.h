@@ -0,0 +1,56 @@
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SHAPES_BINARYMESH_H
+#define PBRT_SHAPES_BINARYMESH_H
+
+// shapes/binarymesh.h*
+#include "shapes/triangle.h"
+
+namespace pbrt {
+
+/* Triangle meshes stored in a simple binary file that is memory mapped and
+   used in place: the _TriangleMesh_ adopts the arrays from the mapping, so
+   nothing is parsed or copied. The mapping is copy-on-write; only the
+   pages of P, N, and S are copied as they are transformed to world space,
+   and only if the shape's transformation isn't the identity.
+
+   The file starts with a _BinaryMeshHeader_, followed by the arrays
+   indices (3 int32 per triangle), P (3 float32 per vertex), and then the
+   optional N, S (3 float32 per vertex), uv (2 float32 per vertex), and
+   faceIndices (1 int32 per triangle), as flagged in the header. Every
+   array starts at a multiple of 16 bytes from the start of the file, and
+   everything is little-endian. */
+struct BinaryMeshHeader {
+    char magic[4];  // "PBMS"
+    uint32_t version;
+    uint32_t flags;
+    int32_t nTriangles, nVertices;
+    uint32_t pad[3];
+};
+
+enum BinaryMeshFlags : uint32_t {
+    BinaryMeshHasN = 1,
+    BinaryMeshHasS = 2,
+    BinaryMeshHasUV = 4,
+    BinaryMeshHasFaceIndices = 8
+};
+
+std::vector<std::shared_ptr<Shape>> CreateBinaryMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures =
+        nullptr);
+
+bool WriteBinaryMeshFile(const std::string &filename, int nTriangles,
+                         const int *vertexIndices, int nVertices,
+                         const Point3f *P, const Vector3f *S,
+                         const Normal3f *N, const Point2f *UV,
+                         const int *faceIndices);
+
+}  // namespace pbrt
+
+#endif  // PBRT_SHAPES_BINARYMESH_H
@@ -35,9 +35,13 @@
 #include "shapes/triangle.h"
 #include "textures/constant.h"
 #include "paramset.h"
+#include "fileutil.h"
 #include "ext/rply.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <sstream>
 
 namespace pbrt {
 using namespace std;
@@ -49,6 +53,8 @@ struct CallbackContext {
     int *indices;
     int *faceIndices;
     int indexCtr, faceIndexCtr;
+    // Allocated sizes of _indices_ and _faceIndices_
+    int indexCapacity, faceIndexCapacity;
     int face[4];
     bool error;
     int vertexCount;
@@ -61,6 +67,8 @@ struct CallbackContext {
           faceIndices(nullptr),
           indexCtr(0),
           faceIndexCtr(0),
+          indexCapacity(0),
+          faceIndexCapacity(0),
           error(false),
           vertexCount(0) {}
 
@@ -154,21 +162,346 @@ int rply_face_callback(p_ply_argument argument) {
     return 1;
 }
 
-std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
-    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
-    const ParamSet &params,
-    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures)
-{
-    const std::string filename = params.FindOneFilename("filename", "");
+// Bulk reading of binary little-endian PLY files: the header is parsed
+// here, and the vertex and face blocks are then copied straight out of the
+// mapped file, without going through rply's per-value callbacks.
+enum class PLYBulkResult { Read, Failed, Unsupported };
+
+struct PLYProperty {
+    std::string name;
+    int size = 0;  // in bytes; of the list entries for lists
+    bool isFloat = false, isSigned = false;
+    bool isList = false;
+    int countSize = 0;  // in bytes, of a list's length
+};
+
+struct PLYElement {
+    std::string name;
+    int64_t count = 0;
+    std::vector<PLYProperty> properties;
+    int Find(const char *name) const {
+        for (size_t i = 0; i < properties.size(); ++i)
+            if (properties[i].name == name) return i;
+        return -1;
+    }
+};
+
+static bool ParsePLYType(const std::string &type, int *size, bool *isFloat,
+                         bool *isSigned) {
+    static const struct {
+        const char *name;
+        int size;
+        bool isFloat, isSigned;
+    } types[] = {{"char", 1, false, true},    {"int8", 1, false, true},
+                 {"uchar", 1, false, false},  {"uint8", 1, false, false},
+                 {"short", 2, false, true},   {"int16", 2, false, true},
+                 {"ushort", 2, false, false}, {"uint16", 2, false, false},
+                 {"int", 4, false, true},     {"int32", 4, false, true},
+                 {"uint", 4, false, false},   {"uint32", 4, false, false},
+                 {"float", 4, true, true},    {"float32", 4, true, true},
+                 {"double", 8, true, true},   {"float64", 8, true, true}};
+    for (const auto &t : types)
+        if (type == t.name) {
+            *size = t.size;
+            *isFloat = t.isFloat;
+            *isSigned = t.isSigned;
+            return true;
+        }
+    return false;
+}
+
+// Parses the header; returns false if the file isn't binary little-endian
+// or the header can't be understood.
+static bool ParsePLYHeader(const char *data, size_t size,
+                           std::vector<PLYElement> *elements,
+                           size_t *headerSize) {
+    const char *end = data + size, *line = data;
+    bool first = true, binaryLittleEndian = false;
+    while (line < end) {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (!eol) return false;
+        std::istringstream tokens(std::string(line, eol));
+        line = eol + 1;
+        std::string keyword;
+        tokens >> keyword;
+        if (first) {
+            if (keyword != "ply") return false;
+            first = false;
+        } else if (keyword == "format") {
+            std::string format;
+            tokens >> format;
+            binaryLittleEndian = format == "binary_little_endian";
+        } else if (keyword == "element") {
+            PLYElement element;
+            if (!(tokens >> element.name >> element.count) ||
+                element.count < 0)
+                return false;
+            elements->push_back(element);
+        } else if (keyword == "property") {
+            if (elements->empty()) return false;
+            PLYProperty property;
+            std::string type, countType;
+            tokens >> type;
+            if (type == "list") {
+                bool countIsFloat, countIsSigned;
+                property.isList = true;
+                if (!(tokens >> countType >> type) ||
+                    !ParsePLYType(countType, &property.countSize,
+                                  &countIsFloat, &countIsSigned) ||
+                    countIsFloat)
+                    return false;
+            }
+            if (!(tokens >> property.name) ||
+                !ParsePLYType(type, &property.size, &property.isFloat,
+                              &property.isSigned))
+                return false;
+            elements->back().properties.push_back(property);
+        } else if (keyword == "end_header") {
+            *headerSize = line - data;
+            return binaryLittleEndian;
+        } else if (keyword != "comment" && keyword != "obj_info" &&
+                   !keyword.empty())
+            return false;
+    }
+    return false;
+}
+
+static uint32_t ReadPLYUnsigned(const char *ptr, int size) {
+    // Little-endian
+    const uint8_t *b = (const uint8_t *)ptr;
+    uint32_t value = 0;
+    for (int i = size - 1; i >= 0; --i) value = (value << 8) | b[i];
+    return value;
+}
+
+// Deinterleaves _nComponents_ floats from each of _count_ records of
+// _stride_ bytes, copying whole blocks where the layout allows it.
+static void CopyPLYFloats(const char *src, int64_t count, int stride,
+                          const int *offsets, int nComponents, Float *dst) {
+    bool adjacent = true;
+    for (int c = 1; c < nComponents; ++c)
+        adjacent &= offsets[c] == offsets[0] + 4 * c;
+    if (adjacent && stride == 4 * nComponents)
+        memcpy(dst, src + offsets[0], count * stride);
+    else if (adjacent)
+        for (int64_t i = 0; i < count; ++i)
+            memcpy(dst + i * nComponents, src + i * stride + offsets[0],
+                   4 * nComponents);
+    else
+        for (int64_t i = 0; i < count; ++i)
+            for (int c = 0; c < nComponents; ++c)
+                memcpy(dst + i * nComponents + c,
+                       src + i * stride + offsets[c], 4);
+}
+
+static PLYBulkResult ReadPLYBulk(const std::string &filename,
+                                 CallbackContext *context) {
+    if (sizeof(Float) != sizeof(float)) return PLYBulkResult::Unsupported;
+    uint32_t one = 1;
+    uint8_t firstByte;
+    memcpy(&firstByte, &one, 1);
+    if (firstByte != 1) return PLYBulkResult::Unsupported;
+
+    std::unique_ptr<MappedFile> file = MappedFile::Open(filename);
+    if (!file) return PLYBulkResult::Unsupported;
+    std::vector<PLYElement> elements;
+    size_t offset;
+    if (!ParsePLYHeader(file->Data(), file->Size(), &elements, &offset))
+        return PLYBulkResult::Unsupported;
+
+    // Check that the elements have layouts that are handled here, and
+    // find where the properties that we use are
+    const PLYElement *vertices = nullptr, *faces = nullptr;
+    for (const PLYElement &element : elements) {
+        if (element.name == "vertex")
+            vertices = &element;
+        else if (element.name == "face")
+            faces = &element;
+        for (const PLYProperty &property : element.properties)
+            if (property.isList && (&element != faces ||
+                                    property.name != "vertex_indices"))
+                return PLYBulkResult::Unsupported;
+    }
+    if (!vertices || !faces || vertices->count == 0 || faces->count == 0 ||
+        vertices->count > std::numeric_limits<int>::max() ||
+        faces->count > std::numeric_limits<int>::max() / 6)
+        return PLYBulkResult::Unsupported;
+
+    int vertexStride = 0;
+    std::vector<int> vertexOffsets;
+    for (const PLYProperty &property : vertices->properties) {
+        vertexOffsets.push_back(vertexStride);
+        vertexStride += property.size;
+    }
+    // Returns the offsets of the given float properties; false if one of
+    // them is missing, and Unsupported if they aren't float32.
+    bool unsupported = false;
+    auto findFloats = [&](std::initializer_list<const char *> names,
+                          int *offsets) {
+        for (const char *name : names) {
+            int index = vertices->Find(name);
+            if (index == -1) return false;
+            const PLYProperty &property = vertices->properties[index];
+            if (!property.isFloat || property.size != 4) unsupported = true;
+            *offsets++ = vertexOffsets[index];
+        }
+        return true;
+    };
+    int pOffsets[3], nOffsets[3], uvOffsets[2];
+    if (!findFloats({"x", "y", "z"}, pOffsets))
+        return PLYBulkResult::Unsupported;
+    bool hasN = findFloats({"nx", "ny", "nz"}, nOffsets);
+    /* There seem to be lots of different conventions regarding UV coordinate
+     * names */
+    bool hasUV = findFloats({"u", "v"}, uvOffsets) ||
+                 findFloats({"s", "t"}, uvOffsets) ||
+                 findFloats({"texture_u", "texture_v"}, uvOffsets) ||
+                 findFloats({"texture_s", "texture_t"}, uvOffsets);
+    int vertexIndicesProperty = faces->Find("vertex_indices");
+    int faceIndicesProperty = faces->Find("face_indices");
+    if (vertexIndicesProperty == -1 ||
+        faces->properties[vertexIndicesProperty].isFloat ||
+        faces->properties[vertexIndicesProperty].size != 4 ||
+        (faceIndicesProperty != -1 &&
+         faces->properties[faceIndicesProperty].isFloat))
+        unsupported = true;
+    if (unsupported) return PLYBulkResult::Unsupported;
+
+    const char *data = file->Data(), *end = data + file->Size();
+    int nVertices = vertices->count, nFaces = faces->count;
+    context->vertexCount = nVertices;
+    for (const PLYElement &element : elements) {
+        if (&element == vertices) {
+            // Copy the vertex block
+            if (end - (data + offset) < element.count * vertexStride) break;
+            context->p = new Point3f[nVertices];
+            CopyPLYFloats(data + offset, nVertices, vertexStride, pOffsets, 3,
+                          &context->p[0].x);
+            if (hasN) {
+                context->n = new Normal3f[nVertices];
+                CopyPLYFloats(data + offset, nVertices, vertexStride,
+                              nOffsets, 3, &context->n[0].x);
+            }
+            if (hasUV) {
+                context->uv = new Point2f[nVertices];
+                CopyPLYFloats(data + offset, nVertices, vertexStride,
+                              uvOffsets, 2, &context->uv[0].x);
+            }
+            offset += element.count * vertexStride;
+        } else if (&element == faces) {
+            // Walk through the variable-size faces; enough space in case
+            // they are all quads
+            context->indices = new int[6 * nFaces];
+            context->indexCapacity = 6 * nFaces;
+            if (faceIndicesProperty != -1) {
+                context->faceIndices = new int[2 * nFaces];
+                context->faceIndexCapacity = 2 * nFaces;
+            }
+            const char *ptr = data + offset;
+            bool truncated = false;
+            for (int f = 0; f < nFaces && !truncated; ++f) {
+                int face[4], faceIndex = 0;
+                uint32_t length = 0;
+                for (int i = 0; i < (int)faces->properties.size(); ++i) {
+                    const PLYProperty &property = faces->properties[i];
+                    if (property.isList) {
+                        if (end - ptr < property.countSize) {
+                            truncated = true;
+                            break;
+                        }
+                        length = ReadPLYUnsigned(ptr, property.countSize);
+                        ptr += property.countSize;
+                        if (property.isSigned &&
+                            (length >> (8 * property.countSize - 1)) != 0) {
+                            Error("%s: PLY face %d has a negative number of "
+                                  "vertices", filename.c_str(), f);
+                            context->error = true;
+                            return PLYBulkResult::Failed;
+                        }
+                        if ((uint64_t)(end - ptr) < (uint64_t)length * 4) {
+                            truncated = true;
+                            break;
+                        }
+                        if (length == 3 || length == 4)
+                            memcpy(face, ptr, length * 4);
+                        ptr += length * 4;
+                    } else {
+                        if (end - ptr < property.size) {
+                            truncated = true;
+                            break;
+                        }
+                        if (i == faceIndicesProperty) {
+                            faceIndex = ReadPLYUnsigned(ptr, property.size);
+                            if (property.isSigned && property.size < 4 &&
+                                (faceIndex & (1 << (8 * property.size - 1))))
+                                faceIndex -= 1 << (8 * property.size);
+                        }
+                        ptr += property.size;
+                    }
+                }
+                if (truncated) break;
+                if (length != 3 && length != 4) {
+                    Warning("plymesh: Ignoring face with %i vertices (only "
+                            "triangles and quads are supported!)",
+                            (int)length);
+                    continue;
+                }
+                for (int i = 0; i < (int)length; ++i)
+                    if (face[i] < 0 || face[i] >= nVertices) {
+                        Error(
+                            "plymesh: Vertex reference %i is out of bounds! "
+                            "Valid range is [0..%i)",
+                            face[i], nVertices);
+                        context->error = true;
+                        face[i] = 0;
+                    }
+                int *indices = context->indices + context->indexCtr;
+                indices[0] = face[0];
+                indices[1] = face[1];
+                indices[2] = face[2];
+                context->indexCtr += 3;
+                if (length == 4) {
+                    /* This was a quad */
+                    indices[3] = face[3];
+                    indices[4] = face[0];
+                    indices[5] = face[2];
+                    context->indexCtr += 3;
+                }
+                if (context->faceIndices)
+                    for (int i = 0; i < (int)length - 2; ++i)
+                        context->faceIndices[context->faceIndexCtr++] =
+                            faceIndex;
+            }
+            offset = truncated ? file->Size() + 1 : ptr - data;
+        } else {
+            // Skip over other elements
+            int stride = 0;
+            for (const PLYProperty &property : element.properties)
+                stride += property.size;
+            offset += element.count * stride;
+        }
+        if (offset > file->Size()) break;
+    }
+    if (!context->p || !context->indices || offset > file->Size()) {
+        Error("%s: PLY file is truncated", filename.c_str());
+        return PLYBulkResult::Failed;
+    }
+    return context->error ? PLYBulkResult::Failed : PLYBulkResult::Read;
+}
+
+// Reads the file through rply, which calls back for every single value
+static bool ReadPLYWithCallbacks(const std::string &filename,
+                                 CallbackContext *context) {
     p_ply ply = ply_open(filename.c_str(), rply_message_callback, 0, nullptr);
     if (!ply) {
         Error("Couldn't open PLY file \"%s\"", filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
     if (!ply_read_header(ply)) {
         Error("Unable to read the header of PLY file \"%s\"", filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        ply_close(ply);
+        return false;
     }
 
     p_ply_element element = nullptr;
@@ -189,73 +522,116 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     if (vertexCount == 0 || faceCount == 0) {
         Error("%s: PLY file is invalid! No face/vertex elements found!",
               filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        ply_close(ply);
+        return false;
     }
 
-    CallbackContext context;
-
-    if (ply_set_read_cb(ply, "vertex", "x", rply_vertex_callback, &context,
+    if (ply_set_read_cb(ply, "vertex", "x", rply_vertex_callback, context,
                         0x030) &&
-        ply_set_read_cb(ply, "vertex", "y", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "y", rply_vertex_callback, context,
                         0x031) &&
-        ply_set_read_cb(ply, "vertex", "z", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "z", rply_vertex_callback, context,
                         0x032)) {
-        context.p = new Point3f[vertexCount];
+        context->p = new Point3f[vertexCount];
     } else {
         Error("%s: Vertex coordinate property not found!",
               filename.c_str());
-        return std::vector<std::shared_ptr<Shape>>();
+        ply_close(ply);
+        return false;
     }
 
-    if (ply_set_read_cb(ply, "vertex", "nx", rply_vertex_callback, &context,
+    if (ply_set_read_cb(ply, "vertex", "nx", rply_vertex_callback, context,
                         0x130) &&
-        ply_set_read_cb(ply, "vertex", "ny", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "ny", rply_vertex_callback, context,
                         0x131) &&
-        ply_set_read_cb(ply, "vertex", "nz", rply_vertex_callback, &context,
+        ply_set_read_cb(ply, "vertex", "nz", rply_vertex_callback, context,
                         0x132))
-        context.n = new Normal3f[vertexCount];
+        context->n = new Normal3f[vertexCount];
 
     /* There seem to be lots of different conventions regarding UV coordinate
      * names */
-    if ((ply_set_read_cb(ply, "vertex", "u", rply_vertex_callback, &context,
+    if ((ply_set_read_cb(ply, "vertex", "u", rply_vertex_callback, context,
                          0x220) &&
-         ply_set_read_cb(ply, "vertex", "v", rply_vertex_callback, &context,
+         ply_set_read_cb(ply, "vertex", "v", rply_vertex_callback, context,
                          0x221)) ||
-        (ply_set_read_cb(ply, "vertex", "s", rply_vertex_callback, &context,
+        (ply_set_read_cb(ply, "vertex", "s", rply_vertex_callback, context,
                          0x220) &&
-         ply_set_read_cb(ply, "vertex", "t", rply_vertex_callback, &context,
+         ply_set_read_cb(ply, "vertex", "t", rply_vertex_callback, context,
                          0x221)) ||
         (ply_set_read_cb(ply, "vertex", "texture_u", rply_vertex_callback,
-                         &context, 0x220) &&
+                         context, 0x220) &&
          ply_set_read_cb(ply, "vertex", "texture_v", rply_vertex_callback,
-                         &context, 0x221)) ||
+                         context, 0x221)) ||
         (ply_set_read_cb(ply, "vertex", "texture_s", rply_vertex_callback,
-                         &context, 0x220) &&
+                         context, 0x220) &&
          ply_set_read_cb(ply, "vertex", "texture_t", rply_vertex_callback,
-                         &context, 0x221)))
-        context.uv = new Point2f[vertexCount];
+                         context, 0x221)))
+        context->uv = new Point2f[vertexCount];
 
     /* Allocate enough space in case all faces are quads */
-    context.indices = new int[faceCount * 6];
-    context.vertexCount = vertexCount;
+    context->indices = new int[faceCount * 6];
+    context->indexCapacity = faceCount * 6;
+    context->vertexCount = vertexCount;
 
-    ply_set_read_cb(ply, "face", "vertex_indices", rply_face_callback, &context,
+    ply_set_read_cb(ply, "face", "vertex_indices", rply_face_callback, context,
                     0);
-    if (ply_set_read_cb(ply, "face", "face_indices", rply_face_callback, &context,
-                        1))
-        // Extra space in case they're quads
-        context.faceIndices = new int[faceCount];
+    if (ply_set_read_cb(ply, "face", "face_indices", rply_face_callback, context,
+                        1)) {
+        // Quads with face indices aren't supported, see rply_face_callback()
+        context->faceIndices = new int[faceCount];
+        context->faceIndexCapacity = faceCount;
+    }
 
     if (!ply_read(ply)) {
         Error("%s: unable to read the contents of PLY file",
               filename.c_str());
         ply_close(ply);
-        return std::vector<std::shared_ptr<Shape>>();
+        return false;
     }
 
     ply_close(ply);
+    return !context->error;
+}
 
-    if (context.error) return std::vector<std::shared_ptr<Shape>>();
+// Reallocates _*indices_ to hold just the first _size_ of its _capacity_
+// entries
+static void ShrinkPLYIndices(int **indices, int size, int capacity) {
+    if (!*indices || size == capacity) return;
+    int *shrunk = new int[size];
+    std::copy(*indices, *indices + size, shrunk);
+    delete[] *indices;
+    *indices = shrunk;
+}
+
+std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
+    const Transform *o2w, const Transform *w2o, bool reverseOrientation,
+    const ParamSet &params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures)
+{
+    const std::string filename = params.FindOneFilename("filename", "");
+    // The mesh takes over the arrays that are read into the context
+    std::shared_ptr<CallbackContext> context =
+        std::make_shared<CallbackContext>();
+    PLYBulkResult bulk = ReadPLYBulk(filename, context.get());
+    if (bulk == PLYBulkResult::Failed) {
+        return std::vector<std::shared_ptr<Shape>>();
+    } else if (bulk == PLYBulkResult::Unsupported) {
+        context = std::make_shared<CallbackContext>();
+        if (!ReadPLYWithCallbacks(filename, context.get()))
+            return std::vector<std::shared_ptr<Shape>>();
+    }
+    // Both readers allocate the indices for the case of all quads; the mesh
+    // keeps them for its whole lifetime, so don't let it hold on to the rest
+    ShrinkPLYIndices(&context->indices, context->indexCtr,
+                     context->indexCapacity);
+    ShrinkPLYIndices(&context->faceIndices, context->faceIndexCtr,
+                     context->faceIndexCapacity);
+    int nTriangles = context->indexCtr / 3, nVertices = context->vertexCount;
+    triMeshBytes += 3 * nTriangles * sizeof(int) +
+                    nVertices * (sizeof(Point3f) +
+                                 (context->n ? sizeof(Normal3f) : 0) +
+                                 (context->uv ? sizeof(Point2f) : 0)) +
+                    (context->faceIndices ? nTriangles * sizeof(int) : 0);
 
     // Look up an alpha texture, if applicable
     std::shared_ptr<Texture<Float>> alphaTex;
@@ -283,11 +659,11 @@ std::vector<std::shared_ptr<Shape>> CreatePLYMesh(
     } else if (params.FindOneFloat("shadowalpha", 1.f) == 0.f)
         shadowAlphaTex.reset(new ConstantTexture<Float>(0.f));
 
-    return CreateTriangleMesh(o2w, w2o, reverseOrientation,
-                              context.indexCtr / 3, context.indices,
-                              vertexCount, context.p, nullptr, context.n,
-                              context.uv, alphaTex, shadowAlphaTex,
-                              context.faceIndices);
+    std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>(
+        *o2w, nTriangles, context->indices, nVertices, context->p, nullptr,
+        context->n, context->uv, alphaTex, shadowAlphaTex,
+        context->faceIndices, TriangleMesh::ObjectSemantic::Default, context);
+    return CreateTriangles(o2w, w2o, reverseOrientation, mesh);
 }
 
 }  // namespace pbrt
@@ -48,6 +48,20 @@ namespace pbrt {
 STAT_MEMORY_COUNTER("Memory/Triangle meshes", triMeshBytes);
 
 // Triangle Declarations
+
+// Deleter for the _TriangleMesh_ arrays; arrays that the mesh adopted from
+// elsewhere (e.g. a memory-mapped binary mesh file) aren't owned by it.
+struct MeshArrayDeleter {
+    explicit MeshArrayDeleter(bool owned = true) : owned(owned) {}
+    template <typename T>
+    void operator()(T *ptr) const {
+        if (owned) delete[] ptr;
+    }
+    bool owned;
+};
+template <typename T>
+using MeshArray = std::unique_ptr<T[], MeshArrayDeleter>;
+
 struct TriangleMesh {
 	enum class ObjectSemantic : int { Default=0, NlosReflector=10, NlosObject=11 };
 
@@ -59,16 +73,28 @@ struct TriangleMesh {
                  const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
                  const int *faceIndices,
 				 TriangleMesh::ObjectSemantic objectSemantic);
+    // Adopts the given arrays instead of copying them; they have to stay
+    // valid as long as _storage_ is alive. _P_, _S_, and _N_ are
+    // transformed to world space in place, so they only need to be
+    // writable if _ObjectToWorld_ isn't the identity.
+    TriangleMesh(const Transform &ObjectToWorld, int nTriangles,
+                 int *vertexIndices, int nVertices, Point3f *P, Vector3f *S,
+                 Normal3f *N, Point2f *uv,
+                 const std::shared_ptr<Texture<Float>> &alphaMask,
+                 const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
+                 int *faceIndices, TriangleMesh::ObjectSemantic objectSemantic,
+                 std::shared_ptr<void> storage);
 
     // TriangleMesh Data
     const int nTriangles, nVertices;
-    std::vector<int> vertexIndices;
-    std::unique_ptr<Point3f[]> p;
-    std::unique_ptr<Normal3f[]> n;
-    std::unique_ptr<Vector3f[]> s;
-    std::unique_ptr<Point2f[]> uv;
+    MeshArray<int> vertexIndices;
+    MeshArray<Point3f> p;
+    MeshArray<Normal3f> n;
+    MeshArray<Vector3f> s;
+    MeshArray<Point2f> uv;
     std::shared_ptr<Texture<Float>> alphaMask, shadowAlphaMask;
-    std::vector<int> faceIndices;
+    MeshArray<int> faceIndices;
+    std::shared_ptr<void> storage;
 
 	ObjectSemantic objectSemantic;
 };
@@ -76,13 +102,15 @@ struct TriangleMesh {
 class Triangle : public Shape {
   public:
     // Triangle Public Methods
+
+    // The _mesh_ has to outlive the triangle; CreateTriangles() takes care
+    // of that.
     Triangle(const Transform *ObjectToWorld, const Transform *WorldToObject,
-             bool reverseOrientation, const std::shared_ptr<TriangleMesh> &mesh,
-             int triNumber)
+             bool reverseOrientation, const TriangleMesh *mesh, int triNumber)
         : Shape(ObjectToWorld, WorldToObject, reverseOrientation), mesh(mesh) {
         v = &mesh->vertexIndices[3 * triNumber];
         triMeshBytes += sizeof(*this);
-        faceIndex = mesh->faceIndices.size() ? mesh->faceIndices[triNumber] : 0;
+        faceIndex = mesh->faceIndices ? mesh->faceIndices[triNumber] : 0;
     }
     Bounds3f ObjectBound() const;
     Bounds3f WorldBound() const;
@@ -98,7 +126,7 @@ class Triangle : public Shape {
     // reference point p.
     Float SolidAngle(const Point3f &p, int nSamples = 0) const;
 
-	const TriangleMesh* GetMesh() const { return mesh.get(); }
+	const TriangleMesh* GetMesh() const { return mesh; }
 
     const int *v; // we need access to this
   private:
@@ -116,10 +144,20 @@ class Triangle : public Shape {
     }
 
     // Triangle Private Data
-    std::shared_ptr<TriangleMesh> mesh;
+    const TriangleMesh *mesh;
     int faceIndex;
 };
 
+bool IntersectTriangle(const Point3f &p0, const Point3f &p1, const Point3f &p2,
+                       const Ray &ray, Float *tHit, Float *b0, Float *b1,
+                       Float *b2);
+
+// Creates the triangles of _mesh_. They're allocated in blocks that also
+// keep the mesh alive, and the blocks are created in parallel.
+std::vector<std::shared_ptr<Shape>> CreateTriangles(
+    const Transform *ObjectToWorld, const Transform *WorldToObject,
+    bool reverseOrientation, const std::shared_ptr<TriangleMesh> &mesh);
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     int nTriangles, const int *vertexIndices, int nVertices, const Point3f *p,
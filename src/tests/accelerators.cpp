@@ -0,0 +1,339 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "primitive.h"
+#include "interaction.h"
+#include "parallel.h"
+#include "accelerators/bvh.h"
+#include "accelerators/qbvh.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+#include <functional>
+#include <thread>
+#ifdef PBRT_HAVE_MMAP
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+using namespace pbrt;
+
+// Random triangles with vertices in [-10,10]^3, scaled down so that the
+// scene has some empty space to traverse.
+static std::vector<std::shared_ptr<Primitive>> RandomTriangles(RNG &rng,
+                                                               int nTris) {
+    static Transform identity;
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < nTris; ++i) {
+        Point3f center(Lerp(rng.UniformFloat(), -10, 10),
+                       Lerp(rng.UniformFloat(), -10, 10),
+                       Lerp(rng.UniformFloat(), -10, 10));
+        for (int v = 0; v < 3; ++v) {
+            indices.push_back(p.size());
+            p.push_back(center + Vector3f(Lerp(rng.UniformFloat(), -1, 1),
+                                          Lerp(rng.UniformFloat(), -1, 1),
+                                          Lerp(rng.UniformFloat(), -1, 1)));
+        }
+    }
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &identity, &identity, false, nTris, indices.data(), p.size(), p.data(),
+        nullptr, nullptr, nullptr, nullptr, nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+static Ray RandomRay(RNG &rng) {
+    Point3f o(Lerp(rng.UniformFloat(), -15, 15),
+              Lerp(rng.UniformFloat(), -15, 15),
+              Lerp(rng.UniformFloat(), -15, 15));
+    Point3f target(Lerp(rng.UniformFloat(), -5, 5),
+                   Lerp(rng.UniformFloat(), -5, 5),
+                   Lerp(rng.UniformFloat(), -5, 5));
+    // Some rays end before they reach the scene
+    Float tMax = rng.UniformFloat() < .25f ? rng.UniformFloat() : Infinity;
+    return Ray(o, target - o, tMax);
+}
+
+// Checks that _accel_ finds the same closest hits as the binary BVH.
+static void CompareWithBVH(const Aggregate &accel, const BVHAccel &bvh,
+                           RNG &rng, int nRays) {
+    for (int i = 0; i < nRays; ++i) {
+        Ray ray = RandomRay(rng);
+        EXPECT_EQ(bvh.IntersectP(ray), accel.IntersectP(ray)) << ray;
+        Ray bvhRay = ray;
+        SurfaceInteraction isect, bvhIsect;
+        bool hit = accel.Intersect(ray, &isect);
+        bool bvhHit = bvh.Intersect(bvhRay, &bvhIsect);
+        ASSERT_EQ(bvhHit, hit) << ray;
+        if (hit) {
+            EXPECT_EQ(bvhRay.tMax, ray.tMax) << ray;
+            EXPECT_EQ(bvhIsect.p, isect.p) << ray;
+        }
+    }
+}
+
+TEST(BVH, ParallelBuild) {
+    // Enough triangles for the SAH build to hand subtrees to the threads
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        RandomTriangles(rng, 100000);
+    PbrtOptions.nThreads = 1;
+    BVHAccel serialBVH(prims, 4);
+
+    PbrtOptions.nThreads = 4;
+    ParallelInit();
+    BVHAccel parallelBVH(prims, 4);
+    ParallelCleanup();
+    PbrtOptions.nThreads = 0;
+
+    EXPECT_EQ(serialBVH.WorldBound(), parallelBVH.WorldBound());
+    CompareWithBVH(parallelBVH, serialBVH, rng, 10000);
+}
+
+#ifdef PBRT_HAVE_MMAP
+TEST(BVH, Cache) {
+    char cacheDir[] = "/tmp/pbrt-bvhcache-XXXXXX";
+    ASSERT_TRUE(mkdtemp(cacheDir) != nullptr);
+
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 2000);
+    BVHAccel bvh(prims, 4);
+    {
+        // The first one writes the cache file, the second one reads it
+        BVHAccel writtenBVH(prims, 4, BVHAccel::SplitMethod::SAH, cacheDir);
+        BVHAccel cachedBVH(prims, 4, BVHAccel::SplitMethod::SAH, cacheDir);
+        EXPECT_EQ(bvh.WorldBound(), cachedBVH.WorldBound());
+        CompareWithBVH(writtenBVH, bvh, rng, 2000);
+        CompareWithBVH(cachedBVH, bvh, rng, 2000);
+
+        // A different scene must not pick up the tree above
+        std::vector<std::shared_ptr<Primitive>> otherPrims =
+            RandomTriangles(rng, 2000);
+        BVHAccel otherBVH(otherPrims, 4);
+        BVHAccel otherCachedBVH(otherPrims, 4, BVHAccel::SplitMethod::SAH,
+                                cacheDir);
+        CompareWithBVH(otherCachedBVH, otherBVH, rng, 2000);
+
+        // Builds that write the same cache file at once each use a
+        // temporary file of their own
+        std::vector<std::shared_ptr<Primitive>> sharedPrims =
+            RandomTriangles(rng, 2000);
+        BVHAccel sharedBVH(sharedPrims, 4);
+        std::vector<std::unique_ptr<BVHAccel>> concurrentBVHs(4);
+        std::vector<std::thread> threads;
+        for (std::unique_ptr<BVHAccel> &concurrentBVH : concurrentBVHs)
+            threads.push_back(std::thread([&]() {
+                concurrentBVH.reset(new BVHAccel(
+                    sharedPrims, 4, BVHAccel::SplitMethod::SAH, cacheDir));
+            }));
+        for (std::thread &thread : threads) thread.join();
+        for (const std::unique_ptr<BVHAccel> &concurrentBVH : concurrentBVHs)
+            CompareWithBVH(*concurrentBVH, sharedBVH, rng, 500);
+        BVHAccel sharedCachedBVH(sharedPrims, 4, BVHAccel::SplitMethod::SAH,
+                                 cacheDir);
+        CompareWithBVH(sharedCachedBVH, sharedBVH, rng, 2000);
+    }
+
+    // Clean up
+    int nFiles = 0;
+    DIR *dir = opendir(cacheDir);
+    ASSERT_TRUE(dir != nullptr);
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        ++nFiles;
+        EXPECT_EQ(0, remove((std::string(cacheDir) + "/" + name).c_str()));
+    }
+    closedir(dir);
+    EXPECT_EQ(3, nFiles);
+    EXPECT_EQ(0, rmdir(cacheDir));
+}
+
+TEST(BVH, CorruptCache) {
+    char cacheDir[] = "/tmp/pbrt-bvhcache-XXXXXX";
+    ASSERT_TRUE(mkdtemp(cacheDir) != nullptr);
+
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 2000);
+    BVHAccel bvh(prims, 4);
+    { BVHAccel writtenBVH(prims, 4, BVHAccel::SplitMethod::SAH, cacheDir); }
+    std::string cacheFile;
+    DIR *dir = opendir(cacheDir);
+    ASSERT_TRUE(dir != nullptr);
+    while (struct dirent *entry = readdir(dir))
+        if (entry->d_name[0] != '.')
+            cacheFile = std::string(cacheDir) + "/" + entry->d_name;
+    closedir(dir);
+    ASSERT_FALSE(cacheFile.empty());
+
+    auto readFile = [&]() {
+        std::vector<char> contents;
+        FILE *f = fopen(cacheFile.c_str(), "rb");
+        EXPECT_TRUE(f != nullptr);
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            contents.insert(contents.end(), buf, buf + n);
+        fclose(f);
+        return contents;
+    };
+    const size_t headerSize = 64;
+    std::vector<char> original = readFile();
+    int nNodes = (original.size() - headerSize - prims.size() * 4) /
+                 sizeof(LinearBVHNode);
+    auto node = [&](std::vector<char> &contents, int i) {
+        return (LinearBVHNode *)&contents[headerSize +
+                                          i * sizeof(LinearBVHNode)];
+    };
+    int leaf = 0;
+    while (node(original, leaf)->nPrimitives == 0) ++leaf;
+    size_t orderOffset = headerSize + nNodes * sizeof(LinearBVHNode);
+
+    // Each change leaves the file at its size, but must still make the BVH
+    // reject it and build the tree again
+    std::vector<std::function<void(std::vector<char> &)>> corruptions = {
+        [&](std::vector<char> &c) { node(c, 0)->secondChildOffset = nNodes; },
+        [&](std::vector<char> &c) { node(c, 0)->secondChildOffset = 1; },
+        [&](std::vector<char> &c) { node(c, 0)->axis = 3; },
+        [&](std::vector<char> &c) {
+            node(c, leaf)->primitivesOffset = prims.size();
+        },
+        [&](std::vector<char> &c) {
+            int32_t *order = (int32_t *)&c[orderOffset];
+            order[1] = order[0];
+        }};
+    for (size_t i = 0; i < corruptions.size(); ++i) {
+        std::vector<char> contents = original;
+        corruptions[i](contents);
+        FILE *f = fopen(cacheFile.c_str(), "wb");
+        ASSERT_TRUE(f != nullptr);
+        fwrite(contents.data(), 1, contents.size(), f);
+        fclose(f);
+        BVHAccel cachedBVH(prims, 4, BVHAccel::SplitMethod::SAH, cacheDir);
+        EXPECT_EQ(bvh.WorldBound(), cachedBVH.WorldBound()) << i;
+        CompareWithBVH(cachedBVH, bvh, rng, 500);
+    }
+
+    // The rebuilt tree replaced the corrupt file
+    BVHAccel cachedBVH(prims, 4, BVHAccel::SplitMethod::SAH, cacheDir);
+    CompareWithBVH(cachedBVH, bvh, rng, 500);
+
+    EXPECT_EQ(0, remove(cacheFile.c_str()));
+    EXPECT_EQ(0, rmdir(cacheDir));
+}
+#endif  // PBRT_HAVE_MMAP
+
+TEST(BVH, Batch) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 3000);
+    BVHAccel bvh(prims, 4);
+
+    // Incoherent rays, and a coherent bundle from one point towards a
+    // part of the scene; 150 isn't a multiple of the packet size
+    for (bool coherent : {false, true}) {
+        const int nRays = 150;
+        std::vector<Ray> rays, batchRays;
+        Point3f origin(-15, 2, 3);
+        for (int i = 0; i < nRays; ++i) {
+            Ray ray = RandomRay(rng);
+            if (coherent)
+                ray = Ray(origin,
+                          Point3f(0, Lerp(rng.UniformFloat(), -3, 3),
+                                  Lerp(rng.UniformFloat(), -3, 3)) -
+                              origin,
+                          ray.tMax);
+            rays.push_back(ray);
+            batchRays.push_back(ray);
+        }
+
+        bool occluded[nRays];
+        bvh.IntersectPBatch(batchRays.data(), nRays, occluded);
+        for (int i = 0; i < nRays; ++i)
+            EXPECT_EQ(bvh.IntersectP(rays[i]), occluded[i]) << rays[i];
+
+        std::vector<SurfaceInteraction> isects(nRays), batchIsects(nRays);
+        bool hits[nRays];
+        bvh.IntersectBatch(batchRays.data(), nRays, batchIsects.data(), hits);
+        for (int i = 0; i < nRays; ++i) {
+            ASSERT_EQ(bvh.Intersect(rays[i], &isects[i]), hits[i]) << rays[i];
+            if (hits[i]) {
+                EXPECT_EQ(rays[i].tMax, batchRays[i].tMax);
+                EXPECT_EQ(isects[i].p, batchIsects[i].p);
+            }
+        }
+    }
+}
+
+TEST(BVH, ShadowRays) {
+    RNG rng;
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 2000);
+    BVHAccel bvh(prims, 4);
+
+    // Pairs of nearby rays, so that the second one often starts with the
+    // occluder of the first one from the cache; the result has to match
+    // testing all primitives either way.
+    for (int i = 0; i < 5000; ++i) {
+        Ray ray = RandomRay(rng);
+        for (int j = 0; j < 2; ++j) {
+            bool occluded = false;
+            for (const auto &prim : prims) occluded |= prim->IntersectP(ray);
+            EXPECT_EQ(occluded, bvh.IntersectP(ray)) << ray;
+            ray.o += Vector3f(.01f, .01f, .01f);
+        }
+    }
+}
+
+TEST(QBVH, MatchesBVH) {
+    RNG rng;
+    for (int nTris : {1, 3, 100, 5000}) {
+        std::vector<std::shared_ptr<Primitive>> prims =
+            RandomTriangles(rng, nTris);
+        BVHAccel bvh(prims, 1);
+        for (int maxPrims : {1, 4})
+            for (bool packTriangles : {false, true}) {
+                QBVHAccel qbvh(prims, maxPrims, BVHAccel::SplitMethod::SAH,
+                               packTriangles);
+                EXPECT_EQ(bvh.WorldBound(), qbvh.WorldBound());
+                CompareWithBVH(qbvh, bvh, rng, 2000);
+            }
+    }
+}
+
+TEST(QBVH, MixedLeaves) {
+    // Leaves with spheres among the triangles can't use the packed
+    // triangles, but the closest hit must still be found across both kinds.
+    RNG rng(7);
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(rng, 500);
+    std::vector<Transform> sphereTransforms;
+    for (int i = 0; i < 50; ++i)
+        sphereTransforms.push_back(Translate(
+            Vector3f(Lerp(rng.UniformFloat(), -10, 10),
+                     Lerp(rng.UniformFloat(), -10, 10),
+                     Lerp(rng.UniformFloat(), -10, 10))));
+    std::vector<Transform> inverseTransforms;
+    for (const Transform &t : sphereTransforms)
+        inverseTransforms.push_back(Inverse(t));
+    for (int i = 0; i < 50; ++i)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            std::make_shared<Sphere>(&sphereTransforms[i],
+                                     &inverseTransforms[i], false, .5f, -.5f,
+                                     .5f, 360.f),
+            nullptr, nullptr, MediumInterface()));
+
+    BVHAccel bvh(prims, 4);
+    QBVHAccel qbvh(prims, 4);
+    CompareWithBVH(qbvh, bvh, rng, 5000);
+}
+
+TEST(QBVH, Empty) {
+    QBVHAccel qbvh({});
+    Ray ray(Point3f(0, 0, 0), Vector3f(1, 0, 0));
+    SurfaceInteraction isect;
+    EXPECT_FALSE(qbvh.Intersect(ray, &isect));
+    EXPECT_FALSE(qbvh.IntersectP(ray));
+}
@@ -0,0 +1,152 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "api.h"
+#include "paramset.h"
+#include "primitive.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace pbrt;
+
+static ParamSet meshParams(Float z, const std::string &name = "mesh") {
+    ParamSet ps;
+    std::unique_ptr<int[]> indices(new int[6]{0, 1, 2, 0, 2, 3});
+    ps.AddInt("indices", std::move(indices), 6);
+    std::unique_ptr<Point3f[]> P(new Point3f[4]{
+        Point3f(0, 0, z), Point3f(1, 0, z), Point3f(1, 1, z),
+        Point3f(0, 1, z)});
+    ps.AddPoint3f("P", std::move(P), 4);
+    std::unique_ptr<std::string[]> s(new std::string[1]{name});
+    ps.AddString("name", std::move(s), 1);
+    return ps;
+}
+
+TEST(ParamSet, Hash) {
+    EXPECT_EQ(ParamSet().Hash(), ParamSet().Hash());
+    EXPECT_EQ(meshParams(0).Hash(), meshParams(0).Hash());
+    EXPECT_NE(meshParams(0).Hash(), ParamSet().Hash());
+
+    // Values, names and strings all contribute
+    EXPECT_NE(meshParams(0).Hash(), meshParams(1).Hash());
+    EXPECT_NE(meshParams(0).Hash(), meshParams(0, "other").Hash());
+    ParamSet ps = meshParams(0);
+    ps.EraseInt("indices");
+    std::unique_ptr<int[]> indices(new int[6]{0, 1, 2, 0, 2, 3});
+    ps.AddInt("vertexindices", std::move(indices), 6);
+    EXPECT_NE(meshParams(0).Hash(), ps.Hash());
+
+    // An extra parameter, even one with its default value, changes it
+    ParamSet semantic = meshParams(0);
+    std::unique_ptr<int[]> zero(new int[1]{0});
+    semantic.AddInt("ObjectSemantic", std::move(zero), 1);
+    EXPECT_NE(meshParams(0).Hash(), semantic.Hash());
+
+    // The boundaries between strings are part of it
+    ParamSet ab, a;
+    std::unique_ptr<std::string[]> s1(new std::string[2]{"ab", "c"});
+    ab.AddString("s", std::move(s1), 2);
+    std::unique_ptr<std::string[]> s2(new std::string[2]{"a", "bc"});
+    a.AddString("s", std::move(s2), 2);
+    EXPECT_NE(ab.Hash(), a.Hash());
+}
+
+// Parses the scene with the given number of threads and returns the
+// primitives of the world
+static std::vector<std::shared_ptr<Primitive>> worldPrimitives(
+    const std::string &scene, int nThreads) {
+    Options opt;
+    opt.nThreads = nThreads;
+    opt.quiet = true;
+    pbrtInit(opt);
+    pbrtParseString(scene);
+    std::vector<std::shared_ptr<Primitive>> prims = pbrtWorldPrimitives();
+    pbrtWorldEnd();
+    pbrtCleanup();
+    return prims;
+}
+
+static bool isInstance(const std::shared_ptr<Primitive> &p) {
+    return dynamic_cast<const TransformedPrimitive *>(p.get()) != nullptr;
+}
+
+TEST(API, DuplicateMeshes) {
+    const std::string mesh =
+        "Shape \"trianglemesh\" \"integer indices\" [0 1 2 0 2 3] "
+        "\"point P\" [0 0 0 1 0 0 1 1 0 0 1 0]";
+    // The scene's visibility culling reads the normals of NLoS meshes
+    const std::string nlosMesh = mesh +
+                                 " \"normal N\" [0 0 1 0 0 1 0 0 1 0 0 1]"
+                                 " \"integer ObjectSemantic\" 11";
+    const std::string scene = R"(
+LookAt 0 0 -5  0 0 0  0 1 0
+Camera "perspective"
+Film "image" "integer xresolution" 1 "integer yresolution" 1
+  "string filename" "duplicatemeshes.pfm"
+Sampler "random" "integer pixelsamples" 1
+WorldBegin
+MakeNamedMedium "fog" "string type" "homogeneous"
+)" + mesh + "\n" + mesh + R"(
+AttributeBegin
+  Translate 0 0 1
+)" + mesh + R"(
+AttributeEnd
+AttributeBegin
+  Material "plastic"
+  Translate 0 0 2
+)" + mesh + R"(
+AttributeEnd
+AttributeBegin
+  MediumInterface "fog" "fog"
+  Translate 0 0 3
+)" + mesh + R"(
+AttributeEnd
+AttributeBegin
+  Scale -1 1 1
+)" + mesh + R"(
+AttributeEnd
+)" + nlosMesh + "\n" + nlosMesh + R"(
+AttributeBegin
+  Translate 0 0 4
+)" + nlosMesh + R"(
+AttributeEnd
+)";
+
+    for (int nThreads : {1, 4}) {
+        std::vector<std::shared_ptr<Primitive>> prims =
+            worldPrimitives(scene, nThreads);
+        ASSERT_EQ(17, prims.size()) << nThreads;
+
+        // The first mesh is created, the second one with the same
+        // transform reuses its triangles and the third is an instance.
+        for (int i = 0; i < 2; ++i) {
+            EXPECT_FALSE(isInstance(prims[i]));
+            EXPECT_EQ(prims[i], prims[2 + i]);
+        }
+        EXPECT_TRUE(isInstance(prims[4]));
+        EXPECT_EQ(Bounds3f(Point3f(0, 0, 1), Point3f(1, 1, 1)),
+                  prims[4]->WorldBound());
+
+        // A different material, medium or handedness makes new triangles
+        for (int i = 5; i < 11; ++i) {
+            EXPECT_FALSE(isInstance(prims[i])) << i;
+            for (int j = 0; j < i; ++j) EXPECT_NE(prims[i], prims[j]);
+        }
+
+        // NLoS meshes are reused in place but not instanced, so that the
+        // scene still finds their triangles
+        for (int i = 11; i < 17; ++i) EXPECT_FALSE(isInstance(prims[i]));
+        EXPECT_EQ(prims[11], prims[13]);
+        EXPECT_EQ(prims[12], prims[14]);
+        EXPECT_NE(prims[11], prims[15]);
+        EXPECT_NE(prims[12], prims[16]);
+        EXPECT_EQ(Bounds3f(Point3f(0, 0, 4), Point3f(1, 1, 4)),
+                  Union(prims[15]->WorldBound(), prims[16]->WorldBound()));
+    }
+
+    for (const char *f : {"duplicatemeshes.pfm", "duplicatemeshes.pfm.log",
+                          "duplicatemeshes.pfm.json"})
+        remove(f);
+}
@@ -0,0 +1,64 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "memory.h"
+#include <thread>
+
+using namespace pbrt;
+
+TEST(MemoryArena, Basics) {
+    MemoryArena arena(1024);
+
+    char *a = (char *)arena.Alloc(100);
+    char *b = (char *)arena.Alloc(100);
+    EXPECT_EQ(0, (uintptr_t)a % 16);
+    EXPECT_EQ(0, (uintptr_t)b % 16);
+    EXPECT_GE(b - a, 100);
+    EXPECT_EQ(1024, arena.TotalAllocated());
+
+    // Filling the block starts another one
+    for (int i = 0; i < 16; ++i) arena.Alloc(100);
+    EXPECT_EQ(2048, arena.TotalAllocated());
+
+    // Blocks are reused after a reset, not allocated again
+    arena.Reset();
+    EXPECT_EQ(2048, arena.TotalAllocated());
+    for (int i = 0; i < 18; ++i) arena.Alloc(100);
+    EXPECT_EQ(2048, arena.TotalAllocated());
+}
+
+TEST(MemoryArena, LargeAllocations) {
+    MemoryArena arena(1024, 4096);
+
+    // Larger allocations get a power-of-two multiple of the block size,
+    // which can then be reused for smaller ones
+    arena.Alloc(3000);
+    EXPECT_EQ(4096, arena.TotalAllocated());
+    arena.Reset();
+    arena.Alloc(2000);
+    arena.Alloc(2000);
+    EXPECT_EQ(4096, arena.TotalAllocated());
+
+    // Past the limit, the largest unused blocks are freed on a reset
+    arena.Reset();
+    arena.Alloc(100);
+    arena.Alloc(5000);
+    EXPECT_EQ(4096 + 8192, arena.TotalAllocated());
+    arena.Reset();
+    EXPECT_EQ(4096, arena.TotalAllocated());
+
+    arena.Trim(0);
+    EXPECT_EQ(0, arena.TotalAllocated());
+    arena.Alloc(10);
+    EXPECT_EQ(1024, arena.TotalAllocated());
+}
+
+TEST(MemoryArena, PerThread) {
+    MemoryArena *mainArena = &PerThreadArena();
+    EXPECT_EQ(mainArena, &PerThreadArena());
+
+    MemoryArena *otherArena = nullptr;
+    std::thread t([&]() { otherArena = &PerThreadArena(); });
+    t.join();
+    EXPECT_NE(mainArena, otherArena);
+}
@@ -37,3 +37,56 @@ TEST(Parallel, DoNothing) {
 
     ParallelCleanup();
 }
+
+TEST(Parallel, Nested) {
+    ParallelInit();
+
+    // Loops started from inside the iterations of other loops
+    std::atomic<int> counter{0};
+    ParallelFor([&](int64_t) {
+        ParallelFor([&](int64_t) {
+            ParallelFor2D([&](Point2i p) { ++counter; }, Point2i(3, 5));
+        }, 20, 3);
+    }, 50);
+    EXPECT_EQ(50 * 20 * 3 * 5, counter);
+
+    ParallelCleanup();
+}
+
+TEST(Parallel, FineGrained) {
+    ParallelInit();
+
+    // Every iteration runs exactly once
+    const int count = 1000000;
+    std::vector<std::atomic<int>> runs(count);
+    for (auto &r : runs) r = 0;
+    ParallelFor([&](int64_t i) { ++runs[i]; }, count, 1);
+    int nOnce = 0;
+    for (const auto &r : runs) nOnce += (r == 1);
+    EXPECT_EQ(count, nOnce);
+
+    ParallelCleanup();
+}
+
+TEST(Parallel, PinThreads) {
+    PbrtOptions.pinThreads = true;
+    ParallelInit();
+
+    int nNodes = NumNumaNodes();
+    EXPECT_GE(nNodes, 1);
+    std::atomic<int> badNodes{0};
+    ParallelFor([&](int64_t) {
+        int node = ThreadNumaNode();
+        if (node < 0 || node >= nNodes) ++badNodes;
+    }, 1000);
+    EXPECT_EQ(0, badNodes);
+
+    std::vector<std::atomic<int>> calls(nNodes);
+    for (auto &c : calls) c = 0;
+    ForEachNumaNode([&](int node) { ++calls[node]; });
+    for (const auto &c : calls) EXPECT_EQ(1, c);
+
+    ParallelCleanup();
+    PbrtOptions.pinThreads = false;
+    EXPECT_EQ(1, NumNumaNodes());
+}
@@ -1,8 +1,11 @@
 
 #include "tests/gtest/gtest.h"
 #include "pbrt.h"
+#include "api.h"
 #include "parser.h"
+#include "primitive.h"
 
+#include <algorithm>
 #include <fstream>
 #include <initializer_list>
 #include <string>
@@ -12,6 +15,13 @@ using namespace pbrt;
 
 static std::string inTestDir(const std::string &path) { return path; }
 
+static void writeFile(const std::string &filename, const char *contents) {
+    std::ofstream out(filename);
+    out << contents;
+    out.close();
+    EXPECT_TRUE(out.good()) << filename;
+}
+
 static std::vector<std::string> extract(Tokenizer *t) {
     std::vector<std::string> tokens;
     while (true) {
@@ -130,3 +140,179 @@ Integrator "deep" "float density" [ 2 2.66612 -5e-51]
     EXPECT_EQ(0, remove(filename.c_str()));
 }
 
+
+TEST(Parser, NumberArrays) {
+    // Integers, the formats that exporters write floats in, and decimal
+    // representations of float midpoints, which need the general path.
+    std::vector<std::string> numbers = {"0", "7", "12345", "2147483647",
+                                        "-3", "+4", "-0", "5.", "0.5", ".25",
+                                        "1e3", "-2.5E-3", "16777217.0",
+                                        "0.10000000149011612",
+                                        "3.4028235e38", "1e-40"};
+    char buf[64];
+    for (int i = 0; i < 2000; ++i) {
+        double v = (i * 0.61803398875 - 600) * (i % 5 == 0 ? 1e-4 : 1);
+        const char *formats[] = {"%.6f", "%.9g", "%.17g", "%g"};
+        snprintf(buf, sizeof(buf), formats[i % 4], v);
+        numbers.push_back(buf);
+    }
+    std::string str = "[";
+    for (size_t i = 0; i < numbers.size(); ++i)
+        str += numbers[i] + ((i % 7) == 6 ? "\n" : " ");
+    str += "] \"string\"";
+
+    auto err = [](const char *err) {
+        EXPECT_TRUE(false) << "Unexpected error: " << err;
+    };
+    auto t = Tokenizer::CreateFromString(str, err);
+    ASSERT_TRUE(t.get() != nullptr);
+    EXPECT_TRUE(t->Next() == "[");
+    std::vector<double> values(numbers.size());
+    size_t n = 0;
+    while (n < numbers.size()) {
+        n += t->ParseNumbers(&values[n], numbers.size() - n);
+        if (n == numbers.size()) break;
+        // Take the number that needs the general path as a token
+        string_view tok = t->Next();
+        ASSERT_EQ(numbers[n], std::string(tok.data(), tok.size()));
+        values[n++] = std::nan("");
+    }
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        if (std::isnan(values[i])) continue;
+        const char *s = numbers[i].c_str();
+        double expected;
+        if (strspn(s, "0123456789") == numbers[i].size())
+            expected = strtol(s, nullptr, 10);
+        else if (sizeof(Float) == sizeof(float))
+            expected = strtof(s, nullptr);
+        else
+            expected = strtod(s, nullptr);
+        EXPECT_EQ(FloatToBits(expected), FloatToBits(values[i])) << s;
+    }
+
+    // The tokenizer picks up after the numbers
+    EXPECT_TRUE(t->Next() == "]");
+    EXPECT_EQ(0, t->ParseNumbers(&values[0], 1));
+    EXPECT_TRUE(t->Next() == "\"string\"");
+    EXPECT_EQ(int(numbers.size() / 7) + 1, t->loc.line);
+}
+
+TEST(Parser, SkipArray) {
+    auto err = [](const char *err) { EXPECT_TRUE(false) << err; };
+    auto t = Tokenizer::CreateFromString(
+        "Shape \"trianglemesh\" \"point P\" [ 0 1\n2 3 ]\n"
+        "Include \"a.pbrt\" [1]",
+        err);
+    ASSERT_TRUE(t.get() != nullptr);
+    EXPECT_TRUE(t->Contains("Include"));
+    EXPECT_FALSE(t->Contains("Includes"));
+    EXPECT_TRUE(t->Next() == "Shape");
+    EXPECT_TRUE(t->Next() == "\"trianglemesh\"");
+    EXPECT_TRUE(t->Next() == "\"point P\"");
+    EXPECT_TRUE(t->Next() == "[");
+    EXPECT_TRUE(t->SkipArray());
+    EXPECT_EQ(2, t->loc.line);
+    EXPECT_TRUE(t->Next() == "Include");
+    EXPECT_FALSE(t->Contains("Include"));
+    EXPECT_TRUE(t->Next() == "\"a.pbrt\"");
+    EXPECT_TRUE(t->Next() == "[");
+    EXPECT_TRUE(t->SkipArray());
+    EXPECT_FALSE(t->SkipArray());
+    EXPECT_TRUE(t->Next().empty());
+}
+
+// Parses the scene with the given number of threads and returns the world
+// bounds of its primitives, in order, with a flag for instances
+static std::vector<std::pair<Bounds3f, bool>> parsePrimitives(
+    const std::string &filename, int nThreads) {
+    Options opt;
+    opt.nThreads = nThreads;
+    opt.quiet = true;
+    pbrtInit(opt);
+    pbrtParseFile(filename);
+    std::vector<std::pair<Bounds3f, bool>> prims;
+    for (const std::shared_ptr<Primitive> &p : pbrtWorldPrimitives())
+        prims.push_back(std::make_pair(
+            p->WorldBound(),
+            dynamic_cast<const TransformedPrimitive *>(p.get()) != nullptr));
+    pbrtWorldEnd();
+    pbrtCleanup();
+    return prims;
+}
+
+TEST(Parser, IncludesParsedAhead) {
+    // The included files change the graphics state that the main file
+    // carries on with, one is included in the middle of a statement, and
+    // an object is defined in one and instanced in another.
+    writeFile(inTestDir("parseahead.spd"), "400 0.25 700 0.75\n");
+    writeFile(inTestDir("parseahead_a.pbrt"), R"(
+Material "matte" "spectrum Kd" "parseahead.spd"
+AttributeBegin
+  Translate 0 0 2
+  Shape "sphere" "float radius" 0.5
+AttributeEnd
+Translate 0 -1 0
+Shape "trianglemesh" "integer indices" [0 1 2] "point P" [0 0 0 1 0 0 0 1 1]
+)");
+    writeFile(inTestDir("parseahead_radius.pbrt"), "\"float radius\" 0.25\n");
+    writeFile(inTestDir("parseahead_object.pbrt"), R"(
+ObjectBegin "thing"
+  Shape "sphere" "float radius" 0.1
+  Translate 0.5 0 0
+  Shape "sphere" "float radius" 0.2
+ObjectEnd
+Scale 2 2 2
+)");
+    writeFile(inTestDir("parseahead_b.pbrt"), R"(
+Material "plastic" "spectrum Kd" "parseahead.spd"
+Rotate 30 0 1 0
+Include "parseahead_c.pbrt"
+Shape "cylinder" "float radius" 0.3
+)");
+    writeFile(inTestDir("parseahead_c.pbrt"), R"(
+Shape "disk" "float radius" 0.4
+Translate 0 0 -1
+)");
+    writeFile(inTestDir("parseahead.pbrt"), R"(
+LookAt 0 0 -5  0 0 0  0 1 0
+Camera "perspective"
+Film "image" "integer xresolution" 1 "integer yresolution" 1
+  "string filename" "parseahead.pfm"
+Sampler "random" "integer pixelsamples" 1
+WorldBegin
+Include "parseahead_a.pbrt"
+Translate 1 0 0
+Shape "sphere" Include "parseahead_radius.pbrt"
+Include "parseahead_object.pbrt"
+AttributeBegin
+  Translate 0 3 0
+  ObjectInstance "thing"
+AttributeEnd
+Include "parseahead_b.pbrt"
+ObjectInstance "thing"
+Shape "sphere" "float radius" 0.125
+)");
+
+    std::string filename = inTestDir("parseahead.pbrt");
+    std::vector<std::pair<Bounds3f, bool>> serial =
+        parsePrimitives(filename, 1);
+    std::vector<std::pair<Bounds3f, bool>> ahead =
+        parsePrimitives(filename, 4);
+    ASSERT_EQ(8, serial.size());
+    EXPECT_EQ(2, std::count_if(serial.begin(), serial.end(),
+                               [](const std::pair<Bounds3f, bool> &p) {
+                                   return p.second;
+                               }));
+    ASSERT_EQ(serial.size(), ahead.size());
+    for (size_t i = 0; i < serial.size(); ++i) {
+        EXPECT_EQ(serial[i].first, ahead[i].first) << i;
+        EXPECT_EQ(serial[i].second, ahead[i].second) << i;
+    }
+
+    for (const char *f :
+         {"parseahead.pbrt", "parseahead_a.pbrt", "parseahead_b.pbrt",
+          "parseahead_c.pbrt", "parseahead_radius.pbrt",
+          "parseahead_object.pbrt", "parseahead.spd", "parseahead.pfm",
+          "parseahead.pfm.log", "parseahead.pfm.json"})
+        remove(inTestDir(f).c_str());
+}
@@ -13,6 +13,9 @@
 #include "shapes/paraboloid.h"
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "shapes/binarymesh.h"
+#include "shapes/plymesh.h"
+#include "paramset.h"
 
 using namespace pbrt;
 
@@ -557,3 +560,182 @@ TEST(Triangle, BadCases) {
     SurfaceInteraction isect;
     EXPECT_FALSE(mesh[0]->Intersect(ray, &thit, &isect));
 }
+
+TEST(BinaryMesh, RoundTrip) {
+    RNG rng(31);
+    const int nTris = 1000, nVerts = 600;
+    std::vector<int> indices, faceIndices;
+    std::vector<Point3f> p;
+    std::vector<Normal3f> n;
+    std::vector<Point2f> uv;
+    for (int i = 0; i < nVerts; ++i) {
+        p.push_back(Point3f(pUnif(rng), pUnif(rng), pUnif(rng)));
+        n.push_back(Normal3f(pUnif(rng), pUnif(rng), pUnif(rng)));
+        uv.push_back(Point2f(rng.UniformFloat(), rng.UniformFloat()));
+    }
+    for (int i = 0; i < nTris; ++i) {
+        for (int v = 0; v < 3; ++v)
+            indices.push_back(rng.UniformUInt32(nVerts));
+        faceIndices.push_back(i / 2);
+    }
+    std::string filename = "/tmp/pbrt-binarymesh-test.pbm";
+    ASSERT_TRUE(WriteBinaryMeshFile(filename, nTris, indices.data(), nVerts,
+                                    p.data(), nullptr, n.data(), uv.data(),
+                                    faceIndices.data()));
+
+    // The mapped mesh has to match one created from the arrays, including
+    // the transformation to world space
+    Transform o2w = Translate(Vector3f(1, 2, 3)) * RotateY(30);
+    Transform w2o = Inverse(o2w);
+    std::vector<std::shared_ptr<Shape>> tris = CreateTriangleMesh(
+        &o2w, &w2o, false, nTris, indices.data(), nVerts, p.data(), nullptr,
+        n.data(), uv.data(), nullptr, nullptr, faceIndices.data());
+    ParamSet params;
+    std::unique_ptr<std::string[]> fn(new std::string[1]);
+    fn[0] = filename;
+    params.AddString("filename", std::move(fn), 1);
+    std::vector<std::shared_ptr<Shape>> mappedTris =
+        CreateBinaryMesh(&o2w, &w2o, false, params);
+    EXPECT_EQ(0, remove(filename.c_str()));
+    ASSERT_EQ(tris.size(), mappedTris.size());
+
+    const TriangleMesh *mesh = ((const Triangle *)tris[0].get())->GetMesh();
+    const TriangleMesh *mappedMesh =
+        ((const Triangle *)mappedTris[0].get())->GetMesh();
+    ASSERT_EQ(nVerts, mappedMesh->nVertices);
+    for (int i = 0; i < 3 * nTris; ++i)
+        EXPECT_EQ(mesh->vertexIndices[i], mappedMesh->vertexIndices[i]);
+    for (int i = 0; i < nTris; ++i)
+        EXPECT_EQ(mesh->faceIndices[i], mappedMesh->faceIndices[i]);
+    for (int i = 0; i < nVerts; ++i) {
+        EXPECT_EQ(mesh->p[i], mappedMesh->p[i]);
+        EXPECT_EQ(mesh->n[i], mappedMesh->n[i]);
+        EXPECT_EQ(mesh->uv[i], mappedMesh->uv[i]);
+    }
+    EXPECT_TRUE(mappedMesh->s == nullptr);
+    for (size_t i = 0; i < tris.size(); ++i)
+        EXPECT_EQ(tris[i]->WorldBound(), mappedTris[i]->WorldBound());
+}
+
+// Returns the world space vertices of the triangles' corners
+static std::vector<Point3f> TriangleCorners(
+    const std::vector<std::shared_ptr<Shape>> &tris) {
+    std::vector<Point3f> corners;
+    for (const auto &tri : tris) {
+        const Triangle *t = (const Triangle *)tri.get();
+        for (int i = 0; i < 3; ++i) corners.push_back(t->GetMesh()->p[t->v[i]]);
+    }
+    return corners;
+}
+
+TEST(PLYMesh, BulkMatchesCallbacks) {
+    // The same quads and triangles, with an extra vertex property and an
+    // extra element, as ASCII (read through rply's callbacks) and as
+    // binary little-endian (read in bulk)
+    const char *header =
+        "ply\n"
+        "format %s 1.0\n"
+        "comment written by pbrt's tests\n"
+        "element vertex 5\n"
+        "property float x\n"
+        "property float y\n"
+        "property float z\n"
+        "property uchar confidence\n"
+        "property float u\n"
+        "property float v\n"
+        "element face 2\n"
+        "property list uchar int vertex_indices\n"
+        "element camera 1\n"
+        "property double focal\n"
+        "end_header\n";
+    Float p[5][3] = {{0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0}, {2, 2, 1}};
+    int faces[2][4] = {{0, 1, 2, 3}, {2, 4, 3, -1}};
+    std::string ascii = "/tmp/pbrt-plymesh-ascii.ply",
+                binary = "/tmp/pbrt-plymesh-binary.ply";
+    FILE *f = fopen(ascii.c_str(), "w");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, header, "ascii");
+    for (int i = 0; i < 5; ++i)
+        fprintf(f, "%f %f %f 7 %f %f\n", p[i][0], p[i][1], p[i][2],
+                p[i][0] / 2, p[i][1] / 2);
+    fprintf(f, "4 0 1 2 3\n3 2 4 3\n1.5\n");
+    fclose(f);
+
+    f = fopen(binary.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, header, "binary_little_endian");
+    for (int i = 0; i < 5; ++i) {
+        float v[5] = {(float)p[i][0], (float)p[i][1], (float)p[i][2],
+                      (float)p[i][0] / 2, (float)p[i][1] / 2};
+        uint8_t confidence = 7;
+        fwrite(v, sizeof(float), 3, f);
+        fwrite(&confidence, 1, 1, f);
+        fwrite(v + 3, sizeof(float), 2, f);
+    }
+    for (int i = 0; i < 2; ++i) {
+        uint8_t n = i == 0 ? 4 : 3;
+        fwrite(&n, 1, 1, f);
+        fwrite(faces[i], sizeof(int), n, f);
+    }
+    double focal = 1.5;
+    fwrite(&focal, sizeof(double), 1, f);
+    fclose(f);
+
+    Transform identity;
+    std::vector<std::vector<std::shared_ptr<Shape>>> meshes;
+    for (const std::string &filename : {ascii, binary}) {
+        ParamSet params;
+        std::unique_ptr<std::string[]> fn(new std::string[1]);
+        fn[0] = filename;
+        params.AddString("filename", std::move(fn), 1);
+        meshes.push_back(CreatePLYMesh(&identity, &identity, false, params));
+        EXPECT_EQ(0, remove(filename.c_str()));
+    }
+    ASSERT_EQ(3, meshes[0].size());
+    ASSERT_EQ(3, meshes[1].size());
+    EXPECT_EQ(TriangleCorners(meshes[0]), TriangleCorners(meshes[1]));
+    for (int i = 0; i < 5; ++i) {
+        const TriangleMesh *mesh =
+            ((const Triangle *)meshes[1][0].get())->GetMesh();
+        EXPECT_EQ(Point2f(p[i][0] / 2, p[i][1] / 2), mesh->uv[i]);
+        EXPECT_TRUE(mesh->n == nullptr);
+    }
+
+    // Truncated files are rejected
+    f = fopen(binary.c_str(), "wb");
+    ASSERT_TRUE(f != nullptr);
+    fprintf(f, header, "binary_little_endian");
+    fwrite(p, 1, 20, f);
+    fclose(f);
+    ParamSet params;
+    std::unique_ptr<std::string[]> fn(new std::string[1]);
+    fn[0] = binary;
+    params.AddString("filename", std::move(fn), 1);
+    EXPECT_TRUE(CreatePLYMesh(&identity, &identity, false, params).empty());
+    EXPECT_EQ(0, remove(binary.c_str()));
+
+    // So are files with a face with a negative or huge number of vertices,
+    // even after a valid one
+    for (const char *countType : {"int", "uint"}) {
+        f = fopen(binary.c_str(), "wb");
+        ASSERT_TRUE(f != nullptr);
+        fprintf(f,
+                "ply\n"
+                "format binary_little_endian 1.0\n"
+                "element vertex 3\n"
+                "property float x\n"
+                "property float y\n"
+                "property float z\n"
+                "element face 2\n"
+                "property list %s int vertex_indices\n"
+                "end_header\n",
+                countType);
+        fwrite(p, sizeof(float), 9, f);
+        int32_t badFaces[] = {3, 0, 1, 2, -1};
+        fwrite(badFaces, sizeof(int32_t), 5, f);
+        fclose(f);
+        EXPECT_TRUE(
+            CreatePLYMesh(&identity, &identity, false, params).empty());
+        EXPECT_EQ(0, remove(binary.c_str()));
+    }
+}